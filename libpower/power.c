@@ -29,15 +29,20 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#include "ts_socket.h"
+
 #define SCALING_GOVERNOR_PATH "/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor"
 #define BOOSTPULSE_ONDEMAND "/sys/devices/system/cpu/cpufreq/ondemand/boostpulse"
 #define BOOSTPULSE_INTERACTIVE "/sys/devices/system/cpu/cpufreq/interactive/boostpulse"
 #define NOTIFY_ON_MIGRATE "/dev/cpuctl/apps/cpu.notify_on_migrate"
 
-#define TS_SOCKET_LOCATION "/dev/socket/tsdriver"
 #define TS_SOCKET_DEBUG 0
 
 static int ts_state;
+/* the connection to ts_srv is kept open between requests */
+static int ts_fd = -1;
+static __u16 ts_request_id;
+static pthread_mutex_t ts_lock = PTHREAD_MUTEX_INITIALIZER;
 static char governor[20];
 
 struct tenderloin_power_module {
@@ -116,24 +121,79 @@ static int get_scaling_governor() {
 }
 
 /* connects to the touchscreen socket */
-static void send_ts_socket(char *send_data) {
+static int connect_ts_socket(void)
+{
     struct sockaddr_un unaddr;
-    int ts_fd, len;
+    int len;
 
     ts_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ts_fd < 0)
+        return -1;
+
+    unaddr.sun_family = AF_UNIX;
+    strcpy(unaddr.sun_path, TS_SOCKET_LOCATION);
+    len = strlen(unaddr.sun_path) + sizeof(unaddr.sun_family);
+    if (connect(ts_fd, (struct sockaddr *)&unaddr, len) < 0) {
+        close(ts_fd);
+        ts_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* reads the acknowledgements of earlier requests without waiting for them */
+static int read_ts_acks(void)
+{
+    struct ts_msg ack;
+    int len;
 
-    if (ts_fd >= 0) {
-        unaddr.sun_family = AF_UNIX;
-        strcpy(unaddr.sun_path, TS_SOCKET_LOCATION);
-        len = strlen(unaddr.sun_path) + sizeof(unaddr.sun_family);
-        if (connect(ts_fd, (struct sockaddr *)&unaddr, len) >= 0) {
+    while ((len = recv(ts_fd, &ack, sizeof(ack), MSG_DONTWAIT)) == sizeof(ack)) {
 #if TS_SOCKET_DEBUG
-            ALOGD("Send ts socket %i byte(s): '%s'\n", sizeof(*send_data), send_data);
+        ALOGD("ts socket request %i '%c' status %i\n", ack.id, ack.cmd, ack.status);
 #endif
-            send(ts_fd, send_data, sizeof(*send_data), 0);
-        }
+        if (ack.status != TS_MSG_OK)
+            ALOGE("Touch screen request '%c' failed with status %i\n",
+                    ack.cmd, ack.status);
+    }
+    if (len < 0 && errno == EAGAIN)
+        return 0;
+
+    /* ts_srv went away, it may have been restarted */
+    close(ts_fd);
+    ts_fd = -1;
+    return -1;
+}
+
+static void send_ts_socket(char cmd)
+{
+    struct ts_msg req;
+    int tries;
+
+    pthread_mutex_lock(&ts_lock);
+
+    memset(&req, 0, sizeof(req));
+    req.magic = TS_MSG_MAGIC;
+    req.cmd = cmd;
+    req.id = ++ts_request_id;
+
+    /* reconnect once if the old connection is gone */
+    for (tries = 0; tries < 2; tries++) {
+        if (ts_fd < 0 && connect_ts_socket() < 0)
+            break;
+        if (read_ts_acks() < 0)
+            continue;
+#if TS_SOCKET_DEBUG
+        ALOGD("Send ts socket request %i '%c'\n", req.id, cmd);
+#endif
+        if (send(ts_fd, &req, sizeof(req), MSG_NOSIGNAL) == sizeof(req))
+            break;
         close(ts_fd);
+        ts_fd = -1;
     }
+    if (ts_fd < 0)
+        ALOGE("Unable to send '%c' to touch screen\n", cmd);
+
+    pthread_mutex_unlock(&ts_lock);
 }
 
 static void tenderloin_power_set_interactive(struct power_module *module, int on)
@@ -145,11 +205,11 @@ static void tenderloin_power_set_interactive(struct power_module *module, int on
     if (on && ts_state == 0) {
         ALOGI("Enabling touch screen");
         ts_state = 1;
-        send_ts_socket("O");
+        send_ts_socket(TS_CMD_OPEN);
     } else if (!on && ts_state == 1) {
         ALOGI("Disabling touch screen");
         ts_state = 0;
-        send_ts_socket("C");
+        send_ts_socket(TS_CMD_CLOSE);
     }
 }
 
@@ -1,4 +1,36 @@
 LOCAL_PATH:= $(call my-dir)
+
+## libts_touch, the uart parser, peak finding and localisers, touch tracking
+## and event queue shared by ts_srv, ts_replay and the levmar driver
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+	ts_parser.c \
+	ts_locate.c \
+	ts_track.c \
+	ts_events.c
+LOCAL_CFLAGS:= -g -c -W -Wall -O2 -mtune=cortex-a9 -mfpu=neon -mfloat-abi=softfp -funsafe-math-optimizations -D_POSIX_SOURCE
+LOCAL_C_INCLUDES:= $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr/include
+LOCAL_ADDITIONAL_DEPENDENCIES := $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr
+LOCAL_MODULE:=libts_touch
+LOCAL_MODULE_TAGS:= eng
+include $(BUILD_STATIC_LIBRARY)
+
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+	ts_parser.c \
+	ts_locate.c \
+	ts_track.c \
+	ts_events.c
+LOCAL_CFLAGS:= -g -W -Wall -O2
+LOCAL_C_INCLUDES:= $(LOCAL_PATH)/../include
+LOCAL_MODULE:=libts_touch
+LOCAL_MODULE_TAGS:= optional
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+
 include $(CLEAR_VARS)
 #
 ## TP Application
@@ -14,7 +46,8 @@ LOCAL_CFLAGS:= -g -c -W -Wall -O2 -mtune=cortex-a9 -mfpu=neon -mfloat-abi=softfp
 LOCAL_C_INCLUDES:= $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr/include
 LOCAL_MODULE:=ts_srv
 LOCAL_MODULE_TAGS:= eng
-LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_STATIC_LIBRARIES := libts_touch
+LOCAL_SHARED_LIBRARIES := liblog libcutils
 LOCAL_LDLIBS := -L$(SYSROOT)/usr/lib -llog
 include $(BUILD_EXECUTABLE)
 
@@ -32,3 +65,49 @@ LOCAL_MODULE_TAGS:= eng
 LOCAL_SHARED_LIBRARIES := liblog
 LOCAL_LDLIBS := -L$(SYSROOT)/usr/lib -llog
 include $(BUILD_EXECUTABLE)
+
+
+## ts_replay host tool for replaying uart captures through ts_srv
+## and benchmarking the touch processing
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+	ts_srv.c \
+	ts_replay.c
+LOCAL_CFLAGS:= -g -W -Wall -O2 -DTS_REPLAY=1
+LOCAL_C_INCLUDES:= $(LOCAL_PATH)/../include
+LOCAL_MODULE:=ts_replay
+LOCAL_MODULE_TAGS:= optional
+LOCAL_STATIC_LIBRARIES := libts_touch liblog
+LOCAL_LDLIBS := -lm -lrt -lpthread
+include $(BUILD_HOST_EXECUTABLE)
+
+
+## ts_srv built for the host to be run against ts_emu.  The i2c headers in
+## include/ still have the kernel's __user annotations.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+	ts_srv.c \
+	digitizer.c
+LOCAL_CFLAGS:= -g -W -Wall -O2 -D__user=
+LOCAL_C_INCLUDES:= $(LOCAL_PATH)/../include
+LOCAL_MODULE:=ts_srv
+LOCAL_MODULE_TAGS:= optional
+LOCAL_STATIC_LIBRARIES := libts_touch libcutils liblog
+LOCAL_LDLIBS := -lm -lrt -lpthread
+include $(BUILD_HOST_EXECUTABLE)
+
+
+## ts_emu host tool that emulates the touch screen on a pty and measures
+## the latency and accuracy of ts_srv
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+	ts_emu.c
+LOCAL_CFLAGS:= -g -W -Wall -O2
+LOCAL_C_INCLUDES:= $(LOCAL_PATH)/../include
+LOCAL_MODULE:=ts_emu
+LOCAL_MODULE_TAGS:= optional
+LOCAL_LDLIBS := -lm -lrt
+include $(BUILD_HOST_EXECUTABLE)
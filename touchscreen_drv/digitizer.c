@@ -25,141 +25,206 @@
 #define LOG_TAG "ts_power"
 #include <cutils/log.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <errno.h>
 #include <fcntl.h>
 
 #include "digitizer.h"
 
-static int vdd_fd, xres_fd, wake_fd, i2c_fd, ts_state;
-
-void touchscreen_power(int enable)
+// Powering the digitizer on or off is a sequence of pin changes with waits in
+// between.  Each step below does its part and arms the timer for the wait, the
+// event loop calls touchscreen_power_step() when the timer fires so nothing
+// ever sleeps on ts_srv's thread.
+enum power_state {
+	POWER_OFF,
+	// Reset held and vdd on, waiting for the voltage to stabilize
+	POWER_ON_VDD,
+	// Wake asserted and reset released
+	POWER_ON_WAKE,
+	// Wake deasserted, the digitizer can be configured next
+	POWER_ON_CONFIG,
+	// vdd dropped after the digitizer failed to wake, waiting to retry
+	POWER_ON_RETRY,
+	POWER_ON,
+	// vdd dropped and reset held
+	POWER_OFF_RESET,
+	// Reset released, waiting for the data from the digitizer to stop
+	POWER_OFF_SETTLE,
+};
+
+// Configuration written over i2c once the digitizer is awake
+static const struct {
+	__u16 len;
+	__u8 buf[6];
+} digitizer_config[] = {
+	{ 6, { 0x31, 0x01, 0x08, 0x0C, 0x0D, 0x0A } },
+	{ 2, { 0x30, 0x0F } },
+	{ 2, { 0x40, 0x02 } },
+	{ 2, { 0x41, 0x10 } },
+	{ 2, { 0x0A, 0x04 } },
+	{ 2, { 0x08, 0x03 } },
+};
+
+static int vdd_fd, xres_fd, wake_fd, i2c_fd, timer_fd = -1;
+static enum power_state ts_state = POWER_OFF;
+// Whether the digitizer should end up on, and the failed wakes so far
+static int ts_target, retry_count;
+
+static void set_pin(int fd, const char *value, const char *what)
 {
-    struct i2c_rdwr_ioctl_data i2c_ioctl_data;
-    struct i2c_msg i2c_msg;
-    __u8 i2c_buf[16];
-    int rc;
-
-    ALOGI("touchscreen_power: enable=%d, ts_state=%d", enable, ts_state);
-
-    if (enable && !ts_state) {
-		int retry_count = 0;
-try_again:
-		/* Set reset so the chip immediatelly sees it */
-        lseek(xres_fd, 0, SEEK_SET);
-        rc = write(xres_fd, "1", 1);
-		if (rc != 1)
-			ALOGE("TSpower, failed set xres");
+	lseek(fd, 0, SEEK_SET);
+	if (write(fd, value, 1) != 1)
+		ALOGE("TSpower, failed to %s", what);
+}
 
-		/* Then power on */
-        lseek(vdd_fd, 0, SEEK_SET);
-        rc = write(vdd_fd, "1", 1);
-		if (rc != 1)
-			ALOGE("TSpower, failed to enable vdd");
+static int i2c_send(const __u8 *buf, __u16 len)
+{
+	struct i2c_rdwr_ioctl_data i2c_ioctl_data;
+	struct i2c_msg i2c_msg;
+	__u8 i2c_buf[6];
+
+	memcpy(i2c_buf, buf, len);
+	i2c_msg.addr = 0x67;
+	i2c_msg.flags = 0;
+	i2c_msg.len = len;
+	i2c_msg.buf = i2c_buf;
+	i2c_ioctl_data.nmsgs = 1;
+	i2c_ioctl_data.msgs = &i2c_msg;
+	return ioctl(i2c_fd, I2C_RDWR, &i2c_ioctl_data);
+}
 
-		/* Sleep some more for the voltage to stabilize */
-        usleep(50000);
+static void wait_step(enum power_state next, int ms)
+{
+	// Moves to next once ms have passed
+	struct itimerspec its;
+
+	ts_state = next;
+	if (timer_fd < 0) {
+		// No timer, fall back to sleeping like this always used to
+		usleep(ms * 1000);
+		touchscreen_power_step();
+		return;
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	if (timerfd_settime(timer_fd, 0, &its, NULL) < 0)
+		ALOGE("TSpower, unable to set timer - %d", errno);
+}
 
-        lseek(wake_fd, 0, SEEK_SET);
-        rc = write(wake_fd, "1", 1);
-		if (rc != 1)
-			ALOGE("TSpower, failed to assert wake");
+static void power_on_start(void)
+{
+	/* Set reset so the chip immediatelly sees it */
+	set_pin(xres_fd, "1", "set xres");
+	/* Then power on */
+	set_pin(vdd_fd, "1", "enable vdd");
+	/* Sleep some more for the voltage to stabilize */
+	wait_step(POWER_ON_VDD, 50);
+}
 
-        lseek(xres_fd, 0, SEEK_SET);
-        rc = write(xres_fd, "0", 1);
+static void power_on_config(void)
+{
+	unsigned int i;
+	int rc;
+
+	rc = i2c_send((const __u8 *)"\x08\x00", 2);
+	if (rc != 1)
+		ALOGE("TSPower, ioctl1 failed %d errno %d\n", rc, errno);
+	/* Ok, so the TS failed to wake, we need to retry a few times
+	 * before totally giving up */
+	if ((rc != 1) && (retry_count++ < MAX_DIGITIZER_RETRY)) {
+		set_pin(vdd_fd, "0", "disable vdd");
+		wait_step(POWER_ON_RETRY, 10);
+		return;
+	}
+
+	for (i = 0; i < sizeof(digitizer_config) / sizeof(digitizer_config[0]);
+		i++) {
+		rc = i2c_send(digitizer_config[i].buf, digitizer_config[i].len);
 		if (rc != 1)
-			ALOGE("TSpower, failed to reset xres");
-
-        usleep(50000);
+			ALOGE("TSPower, ioctl%u failed %d errno %d\n", i + 2, rc,
+				errno);
+	}
 
-        lseek(wake_fd, 0, SEEK_SET);
-        rc = write(wake_fd, "0", 1);
-		if (rc != 1)
-			ALOGE("TSpower, failed to deassert wake");
+	set_pin(wake_fd, "1", "assert wake again");
+	ts_state = POWER_ON;
+}
 
-        usleep(50000);
+static void power_next(void)
+{
+	// Starts towards ts_target if the digitizer isn't in the middle of
+	// something.  A change of mind during a sequence waits for it to end.
+	if (ts_target && ts_state == POWER_OFF) {
+		retry_count = 0;
+		power_on_start();
+	} else if (!ts_target && ts_state == POWER_ON) {
+		set_pin(vdd_fd, "0", "disable vdd");
+		/* Weird, but on 4G touchpads even after vdd is off there is still
+		 * stream of data from ctp that only disappears after we reset the
+		 * touchscreen, even though it's supposedly powered off already
+		 */
+		set_pin(xres_fd, "1", "set xres");
+		wait_step(POWER_OFF_RESET, 10);
+	}
+}
 
-        i2c_ioctl_data.nmsgs = 1;
-        i2c_ioctl_data.msgs = &i2c_msg;
+void touchscreen_power(int enable)
+{
+	ALOGI("touchscreen_power: enable=%d, ts_state=%d", enable, ts_state);
 
-        i2c_msg.addr = 0x67;
-        i2c_msg.flags = 0;
-        i2c_msg.buf = i2c_buf;
+	ts_target = enable;
+	power_next();
+}
 
-        i2c_msg.len = 2;
-        i2c_buf[0] = 0x08; i2c_buf[1] = 0;
-        rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
-		if (rc != 1)
-			ALOGE("TSPower, ioctl1 failed %d errno %d\n", rc, errno);
-		/* Ok, so the TS failed to wake, we need to retry a few times
-		 * before totally giving up */
-		if ((rc != 1) && (retry_count++ < MAX_DIGITIZER_RETRY)) {
-			lseek(vdd_fd, 0, SEEK_SET);
-			rc = write(vdd_fd, "0", 1);
-			usleep(10000);
+void touchscreen_power_step(void)
+{
+	uint64_t expirations;
+
+	if (timer_fd >= 0 &&
+		read(timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	switch (ts_state) {
+		case POWER_ON_VDD:
+			set_pin(wake_fd, "1", "assert wake");
+			set_pin(xres_fd, "0", "reset xres");
+			wait_step(POWER_ON_WAKE, 50);
+			break;
+		case POWER_ON_WAKE:
+			set_pin(wake_fd, "0", "deassert wake");
+			wait_step(POWER_ON_CONFIG, 50);
+			break;
+		case POWER_ON_CONFIG:
+			power_on_config();
+			break;
+		case POWER_ON_RETRY:
 			ALOGE("TS wakeup retry #%d\n", retry_count);
-			goto try_again;
-		}
-
-        i2c_msg.len = 6;
-        i2c_buf[0] = 0x31; i2c_buf[1] = 0x01; i2c_buf[2] = 0x08;
-        i2c_buf[3] = 0x0C; i2c_buf[4] = 0x0D; i2c_buf[5] = 0x0A;
-        rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
-		if (rc != 1)
-			ALOGE("TSPower, ioctl2 failed %d errno %d\n", rc, errno);
-
-        i2c_msg.len = 2;
-        i2c_buf[0] = 0x30; i2c_buf[1] = 0x0F;
-        rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
-		if (rc != 1)
-			ALOGE("TSPower, ioctl3 failed %d errno %d\n", rc, errno);
-
-        i2c_buf[0] = 0x40; i2c_buf[1] = 0x02;
-        rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
-		if (rc != 1)
-			ALOGE("TSPower, ioctl4 failed %d errno %d\n", rc, errno);
-
-        i2c_buf[0] = 0x41; i2c_buf[1] = 0x10;
-        rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
-		if (rc != 1)
-			ALOGE("TSPower, ioctl5 failed %d errno %d\n", rc, errno);
-
-        i2c_buf[0] = 0x0A; i2c_buf[1] = 0x04;
-        rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
-		if (rc != 1)
-			ALOGE("TSPower, ioctl6 failed %d errno %d\n", rc, errno);
-
-        i2c_buf[0] = 0x08; i2c_buf[1] = 0x03;
-        rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
-		if (rc != 1)
-			ALOGE("TSPower, ioctl7 failed %d errno %d\n", rc, errno);
-
-        lseek(wake_fd, 0, SEEK_SET);
-        rc = write(wake_fd, "1", 1);
-		if (rc != 1)
-			ALOGE("TSpower, failed to assert wake again");
-		ts_state = 1;
-    } else if (ts_state) {
-        lseek(vdd_fd, 0, SEEK_SET);
-        rc = write(vdd_fd, "0", 1);
-		if (rc != 1)
-			ALOGE("TSpower, failed to disable vdd");
+			power_on_start();
+			break;
+		case POWER_OFF_RESET:
+			set_pin(xres_fd, "0", "reset xres");
+			/* XXX, should be correllated with LIFTOFF_TIMEOUT in ts driver */
+			wait_step(POWER_OFF_SETTLE, 80);
+			break;
+		case POWER_OFF_SETTLE:
+			ts_state = POWER_OFF;
+			break;
+		default:
+			break;
+	}
+	if (ts_state == POWER_ON || ts_state == POWER_OFF)
+		power_next();
+}
 
-		/* Weird, but on 4G touchpads even after vdd is off there is still
-		 * stream of data from ctp that only disappears after we reset the
-		 * touchscreen, even though it's supposedly powered off already
-		 */
-        lseek(xres_fd, 0, SEEK_SET);
-        rc = write(xres_fd, "1", 1);
-		usleep(10000);
-        lseek(xres_fd, 0, SEEK_SET);
-        rc = write(xres_fd, "0", 1);
-        /* XXX, should be correllated with LIFTOFF_TIMEOUT in ts driver */
-        usleep(80000);
-		ts_state = 0;
-    }
+int touchscreen_power_fd(void)
+{
+	return timer_fd;
 }
 
 void init_digitizer_fd(void) {
@@ -176,5 +241,9 @@ void init_digitizer_fd(void) {
 	i2c_fd = open("/dev/i2c-5", O_RDWR);
 	if (i2c_fd < 0)
 		ALOGE("TScontrol: Cannot open i2c dev - %d", errno);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if (timer_fd < 0)
+		ALOGE("TScontrol: Cannot create timer, power changes will block - %d",
+			errno);
 
 }
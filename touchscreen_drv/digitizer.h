@@ -25,8 +25,16 @@
 // Maximum number of times to retry powering on the digitizer
 #define MAX_DIGITIZER_RETRY 3
 
+// Starts powering the digitizer on or off and returns straight away.  The
+// rest of the sequence runs from touchscreen_power_step().
 void touchscreen_power(int enable);
 
+// Becomes readable when the next step of powering the digitizer on or off is
+// due, touchscreen_power_step() has to be called then.  -1 if the steps can't
+// be timed, then touchscreen_power() does the whole sequence at once.
+int touchscreen_power_fd(void);
+void touchscreen_power_step(void);
+
 void init_digitizer_fd(void);
 #ifndef __FD_SET
 #define __FD_SET(fd, fdsetp)   (((fd_set *)(fdsetp))->fds_bits[(fd) >> 5] |= (1<<((fd) & 31)))
@@ -65,7 +65,7 @@ void gaussian_fit3(double *p, double *x, int m, int n, void *data)
 
 void jac_gaussian_fit5(double *p, double *jac, int m, int n, void *data)
 {
-	int l;
+	int l = 0;
 	int j, k;
 	int t[5];
 	t[0] = -2;
@@ -84,7 +84,7 @@ void jac_gaussian_fit5(double *p, double *jac, int m, int n, void *data)
 
 void jac_gaussian_fit3(double *p, double *jac, int m, int n, void *data)
 {
-	int l;
+	int l = 0;
 	int j, k;
 	int t[3];
 	t[0] = -1;
@@ -0,0 +1,68 @@
+/*
+ * Levenberg-Marquardt touch localiser for the levmar variant of ts_srv.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+
+#include <math.h>
+
+#include "../ts_locate.h"
+#include "ts_lm.h"
+
+int ts_locate_lm(unsigned char matrix[TS_ROWS][TS_COLS], int peak_i,
+	int peak_j, int radius, int *i, int *j)
+{
+	double submatrix[25], guess[3], results[2];
+	int starti, startj, stride = radius * 2 + 1, k, l, peak = 0;
+
+	if (radius < 1 || radius > 2)
+		return -1;
+	starti = ts_window_start(peak_i, radius, TS_ROWS);
+	startj = ts_window_start(peak_j, radius, TS_COLS);
+	for (k = 0; k < stride; k++) {
+		for (l = 0; l < stride; l++) {
+			submatrix[k * stride + l] = matrix[starti + k][startj + l];
+			if (matrix[starti + k][startj + l] > peak)
+				peak = matrix[starti + k][startj + l];
+		}
+	}
+
+	guess[0] = peak;
+	guess[1] = 0;
+	guess[2] = 0;
+	runlm(radius, guess, submatrix, results);
+
+	// A fit that wandered off the window didn't find the touch
+	if (!(fabs(results[0]) <= radius) || !(fabs(results[1]) <= radius))
+		return -1;
+	*i = floor((starti + radius + results[0]) * (1 << TS_LOC_SHIFT) + 0.5);
+	*j = floor((startj + radius + results[1]) * (1 << TS_LOC_SHIFT) + 0.5);
+	return 0;
+}
+
+int ts_locate_gaussian_lm(unsigned char matrix[TS_ROWS][TS_COLS],
+	int peak_i, int peak_j, int radius, int *i, int *j)
+{
+	if (ts_gaussian_residual(matrix, peak_i, peak_j) <= LM_MAX_RESIDUAL)
+		return ts_localise(TS_LOC_GAUSSIAN, matrix, peak_i, peak_j, radius,
+			i, j);
+	return ts_locate_lm(matrix, peak_i, peak_j, radius, i, j);
+}
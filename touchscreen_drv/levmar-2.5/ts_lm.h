@@ -0,0 +1,43 @@
+/*
+ * Levenberg-Marquardt touch localiser for the levmar variant of ts_srv.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+
+// Needs ts_locate.h
+
+// Fits a gaussian of the height p[0] centered at p[1], p[2] to the window x
+// of radius 1 or 2.  The fitted center is returned in r, relative to the
+// middle of the window.
+int runlm(int radius, double *p, double *x, double *r);
+
+// TS_LOC_LM for ts_register_localiser(), only radius 1 and 2 are supported
+int ts_locate_lm(unsigned char matrix[TS_ROWS][TS_COLS], int peak_i,
+	int peak_j, int radius, int *i, int *j);
+
+// Largest ts_gaussian_residual() that TS_LOC_GAUSSIAN is trusted with
+#define LM_MAX_RESIDUAL 20
+
+// TS_LOC_GAUSSIAN, which costs a few dozen operations, unless the touch is
+// too far from a gaussian for it.  Only those touches get the fit with lm,
+// which costs hundreds of iterations.
+int ts_locate_gaussian_lm(unsigned char matrix[TS_ROWS][TS_COLS],
+	int peak_i, int peak_j, int radius, int *i, int *j);
@@ -0,0 +1,344 @@
+/*
+ * This is a host tool that runs every touch localiser on the same touches
+ * and reports how long each one takes and how far off it is.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+/* Usage: ts_locbench [-n loops] [-r radius] [-g touches] [capture_file...]
+ * -n = run the localisers over the touches this many times for the timing
+ * -r = radius of the window for the centroid and lm, default 2
+ * -g = also generate this many gaussian touches at known locations
+ *
+ * Touches from captures have no known location so they are compared against
+ * lm.  Generated touches are compared against where they really are.  Build
+ * on the host with make ts_locbench CC=gcc.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../ts_capture.h"
+#include "../ts_parser.h"
+#include "../ts_locate.h"
+#include "ts_lm.h"
+
+// Same candidate rules as the levmar ts_srv
+#define PEAK_THRESHOLD 10
+#define PEAK_RADIUS 2
+#define MAX_PEAKS 75
+#define MAX_TOUCH 10
+
+// Width of the generated touches in matrix points, and the noise on them
+#define GEN_SD 0.76
+#define GEN_NOISE 3
+
+struct sample {
+	unsigned int frame;
+	struct ts_peak peak;
+	// Reference location in Q8
+	int ref_i;
+	int ref_j;
+};
+
+struct set {
+	const char *name;
+	// Set when the reference is where the touch really is, not lm
+	int truth;
+	unsigned char (*frames)[TS_ROWS][TS_COLS];
+	unsigned int frame_count, frame_alloc;
+	struct sample *samples;
+	unsigned int sample_count, sample_alloc;
+};
+
+unsigned char matrix[TS_ROWS][TS_COLS];
+struct set *parse_set;
+
+static void *grow(void *ptr, unsigned int *alloc, size_t size)
+{
+	*alloc = *alloc ? *alloc * 2 : 4096;
+	ptr = realloc(ptr, *alloc * size);
+	if (ptr == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+static void add_frame(struct set *set)
+{
+	if (set->frame_count == set->frame_alloc)
+		set->frames = grow(set->frames, &set->frame_alloc,
+			sizeof(*set->frames));
+	memcpy(set->frames[set->frame_count++], matrix, sizeof(matrix));
+}
+
+static void add_sample(struct set *set, struct ts_peak *peak, int ref_i,
+	int ref_j)
+{
+	if (set->sample_count == set->sample_alloc)
+		set->samples = grow(set->samples, &set->sample_alloc,
+			sizeof(*set->samples));
+	set->samples[set->sample_count].frame = set->frame_count - 1;
+	set->samples[set->sample_count].peak = *peak;
+	set->samples[set->sample_count].ref_i = ref_i;
+	set->samples[set->sample_count].ref_j = ref_j;
+	set->sample_count++;
+}
+
+static void consume_row(int row, const unsigned char *data, int first)
+{
+	if (first)
+		memset(matrix, 0, sizeof(matrix));
+	if (row < TS_ROWS)
+		memcpy(matrix[row], data, TS_COLS);
+}
+
+static int consume_frame(void)
+{
+	// Every touch the levmar ts_srv would have found becomes a sample, lm
+	// is the reference so touches it can't fit are left out
+	struct ts_peak peaks[MAX_PEAKS];
+	int count, k, i, j, added = 0;
+
+	count = ts_find_peaks(matrix, PEAK_THRESHOLD, peaks, MAX_PEAKS);
+	count = ts_select_peaks(peaks, count, PEAK_RADIUS, MAX_TOUCH);
+	for (k = 0; k < count; k++) {
+		if (ts_localise(TS_LOC_LM, matrix, peaks[k].i, peaks[k].j,
+			PEAK_RADIUS, &i, &j))
+			continue;
+		if (!added++)
+			add_frame(parse_set);
+		add_sample(parse_set, &peaks[k], i, j);
+	}
+	return 0;
+}
+
+static int load_capture(const char *path, struct set *set)
+{
+	struct ts_parser parser = {
+		.row = consume_row,
+		.frame = consume_frame,
+	};
+	struct ts_capture_header header;
+	struct ts_capture_record rec;
+	unsigned char *data;
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "Unable to open %s\n", path);
+		return -1;
+	}
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+		header.magic != TS_CAPTURE_MAGIC ||
+		header.version != TS_CAPTURE_VERSION) {
+		fprintf(stderr, "%s is not a ts_srv capture file\n", path);
+		fclose(fp);
+		return -1;
+	}
+
+	set->name = path;
+	parse_set = set;
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		if (!rec.len)
+			continue;
+		data = malloc(rec.len);
+		if (data == NULL || fread(data, 1, rec.len, fp) != rec.len) {
+			fprintf(stderr, "Truncated record in %s\n", path);
+			free(data);
+			break;
+		}
+		ts_parse(&parser, data, rec.len);
+		free(data);
+	}
+	fclose(fp);
+	return 0;
+}
+
+static void generate(struct set *set, int touches)
+{
+	// One touch a frame anywhere on the matrix, the edges included
+	struct ts_peak peak;
+	double ti, tj, height, value;
+	int k, i, j;
+
+	set->name = "generated";
+	set->truth = 1;
+	srand(1);
+	for (k = 0; k < touches; k++) {
+		ti = rand() / (double)RAND_MAX * (TS_ROWS - 1);
+		tj = rand() / (double)RAND_MAX * (TS_COLS - 1);
+		height = 40 + rand() % 200;
+		for (i = 0; i < TS_ROWS; i++) {
+			for (j = 0; j < TS_COLS; j++) {
+				value = height * exp(-((i - ti) * (i - ti) +
+					(j - tj) * (j - tj)) / (2 * GEN_SD * GEN_SD));
+				value += rand() % (2 * GEN_NOISE + 1) - GEN_NOISE;
+				matrix[i][j] = value < 0 ? 0 : value > 255 ? 255 : value;
+			}
+		}
+		if (ts_find_peaks(matrix, PEAK_THRESHOLD, &peak, 1) < 1)
+			continue;
+		add_frame(set);
+		add_sample(set, &peak, floor(ti * (1 << TS_LOC_SHIFT) + 0.5),
+			floor(tj * (1 << TS_LOC_SHIFT) + 0.5));
+	}
+}
+
+// One past the last localiser is the one the levmar ts_srv uses near the
+// edges and other touches, the gaussian with lm for touches it doesn't fit
+#define LOC_GAUSSIAN_LM TS_LOC_COUNT
+
+static int localise(int loc, unsigned char matrix[TS_ROWS][TS_COLS],
+	struct ts_peak *peak, int radius, int *i, int *j)
+{
+	if (loc == LOC_GAUSSIAN_LM)
+		return ts_locate_gaussian_lm(matrix, peak->i, peak->j, radius, i, j);
+	return ts_localise(loc, matrix, peak->i, peak->j, radius, i, j);
+}
+
+static long long elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000LL +
+		(end->tv_nsec - start->tv_nsec);
+}
+
+static void bench(struct set *set, int loops, int radius)
+{
+	struct timespec start, end;
+	struct ts_peak peaks[MAX_PEAKS];
+	struct sample *s;
+	unsigned int k, failed, fitted = 0;
+	int loc, n, i, j;
+	double di, dj, err, total, max;
+	long long ns;
+
+	printf("%s: %u touches in %u frames, error in points against %s\n",
+		set->name, set->sample_count, set->frame_count,
+		set->truth ? "truth" : "lm");
+	printf("%-10s %10s %10s %10s %8s\n", "localiser", "ns/call",
+		"mean err", "max err", "failed");
+	if (!set->sample_count)
+		return;
+
+	for (loc = TS_LOC_AREA + 1; loc <= LOC_GAUSSIAN_LM; loc++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (n = 0; n < loops; n++) {
+			for (k = 0; k < set->sample_count; k++) {
+				s = &set->samples[k];
+				localise(loc, set->frames[s->frame], &s->peak, radius,
+					&i, &j);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ns = elapsed_ns(&start, &end);
+
+		total = max = 0;
+		failed = 0;
+		for (k = 0; k < set->sample_count; k++) {
+			s = &set->samples[k];
+			if (loc == LOC_GAUSSIAN_LM && ts_gaussian_residual(
+				set->frames[s->frame], s->peak.i, s->peak.j) >
+				LM_MAX_RESIDUAL)
+				fitted++;
+			if (localise(loc, set->frames[s->frame], &s->peak, radius,
+				&i, &j)) {
+				failed++;
+				continue;
+			}
+			di = (i - s->ref_i) / (double)(1 << TS_LOC_SHIFT);
+			dj = (j - s->ref_j) / (double)(1 << TS_LOC_SHIFT);
+			err = sqrt(di * di + dj * dj);
+			total += err;
+			if (err > max)
+				max = err;
+		}
+		printf("%-10s %10.1f %10.3f %10.3f %8u\n",
+			loc == LOC_GAUSSIAN_LM ? "gauss/lm" : ts_localiser_name(loc),
+			(double)ns / loops / set->sample_count,
+			failed < set->sample_count ?
+				total / (set->sample_count - failed) : 0, max, failed);
+	}
+	printf("gauss/lm fitted %u of the touches with lm\n", fitted);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < loops; n++)
+		for (k = 0; k < set->frame_count; k++)
+			ts_find_peaks(set->frames[k], PEAK_THRESHOLD, peaks, MAX_PEAKS);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("finding the peaks took %.1f ns/frame\n\n",
+		(double)elapsed_ns(&start, &end) / loops / set->frame_count);
+}
+
+int main(int argc, char** argv)
+{
+	struct set set;
+	int opt, loops = 10, radius = 2, touches = 0, i;
+
+	while ((opt = getopt(argc, argv, "n:r:g:")) != -1) {
+		switch (opt) {
+			case 'n':
+				loops = atoi(optarg);
+				break;
+			case 'r':
+				radius = atoi(optarg);
+				break;
+			case 'g':
+				touches = atoi(optarg);
+				break;
+			default:
+				loops = 0;
+				break;
+		}
+	}
+	if (loops < 1 || radius < 1 || radius > 2 ||
+		(optind == argc && touches < 1)) {
+		printf("Usage: %s [-n loops] [-r radius] [-g touches] "
+			"[capture_file...]\n", argv[0]);
+		printf("-n to time this many runs over the touches\n");
+		printf("-r for the centroid and lm window radius, 1 or 2\n");
+		printf("-g to generate this many touches at known locations\n");
+		return -1;
+	}
+
+	ts_locate_init();
+	ts_register_localiser(TS_LOC_LM, ts_locate_lm);
+
+	for (i = optind; i < argc; i++) {
+		memset(&set, 0, sizeof(set));
+		if (!load_capture(argv[i], &set))
+			bench(&set, loops, radius);
+		free(set.frames);
+		free(set.samples);
+	}
+	if (touches) {
+		memset(&set, 0, sizeof(set));
+		generate(&set, touches);
+		bench(&set, loops, radius);
+		free(set.frames);
+		free(set.samples);
+	}
+	return 0;
+}
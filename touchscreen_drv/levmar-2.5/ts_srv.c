@@ -42,7 +42,11 @@
 #include <math.h>
 #include <sys/select.h>
 
-#define USE_LEVMAR
+#include "../ts_parser.h"
+#include "../ts_locate.h"
+#include "../ts_track.h"
+#include "../ts_events.h"
+#include "ts_lm.h"
 
 #if 1
 // This is for Andrioid
@@ -66,45 +70,20 @@
 
 #define MAX_CLIST 75
 
-unsigned char cline[64];
-unsigned int cidx=0;
-unsigned char matrix[30][40]; 
+unsigned char matrix[TS_ROWS][TS_COLS];
 int uinput_fd;
 
+struct ts_events uevents;
+
 int send_uevent(int fd, __u16 type, __u16 code, __s32 value)
 {
-    struct input_event event;
-
-    memset(&event, 0, sizeof(event));
-    event.type = type;
-    event.code = code;
-    event.value = value;
-    gettimeofday(&event.time, NULL);
-
-    if (write(fd, &event, sizeof(event)) != sizeof(event)) {
-        fprintf(stderr, "Error on send_event %d", sizeof(event));
-        return -1;
-    }
-
-    return 0;
-}
-
-
-struct candidate {
-	int pw;
-	int i;
-	int j;
-};
-
-struct touchpoint {
-	int pw;
-	double i;
-	double j;
-};
+	// Events are queued and written out with the SYN_REPORT
+	if (ts_queue_event(&uevents, fd, type, code, value)) {
+		fprintf(stderr, "Error on send_event\n");
+		return -1;
+	}
 
-int tpcmp(const void *v1, const void *v2)
-{
-    return ((*(struct candidate *)v2).pw - (*(struct candidate *)v1).pw);
+	return 0;
 }
 
 #define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
@@ -112,224 +91,107 @@ int tpcmp(const void *v1, const void *v2)
 
 #if WANT_MULTITOUCH
 
-#define SD 0.66
-void runlm(int, double*, double*, double*);
-
-void generate_submatrix(int radius, int locx, int locy, int* ofstx, int* ofsty, double* submatrix)
+// Points above this that no neighbour is higher than are touch candidates
+#define PEAK_THRESHOLD 10
+// Radius around a candidate to use for discounting weaker others
+#define PEAK_RADIUS 2
+// Window for the centroid.  Near the edges and near other touches the
+// centroid is pulled off the touch so those touches use the gaussian peak,
+// or the gaussian fit with lm in the smaller window if they aren't round
+// enough for it.
+#define CENTROID_RADIUS 4
+#define LM_RADIUS 2
+#define LM_EDGE 4
+#define LM_MIN_DISTANCE_SQ 16
+// A touch that moved further than this in matrix points is a new touch
+#define TRACK_MAX_DISTANCE 4
+// Tracking IDs start over from 0 before they pass the absmax given to uinput
+#define MAX_TRACKING_ID 65535
+
+// Localiser picked with -l, or -1 to pick one for each touch as above
+int localiser = -1;
+
+// Touches of the previous frame for the tracking IDs
+struct ts_track_point prev_points[TS_MAX_TOUCH];
+int prev_ids[TS_MAX_TOUCH];
+int prev_count;
+int next_id;
+
+void locate_touch(struct ts_peak *peak, int d2, int *i, int *j)
 {
-	int i,j,k,l,stride;
-	double guess[5];
-
-	stride = radius*2+1;
-	i=locx; j=locy;
-
-	i=MAX(0,i-radius);
-	j=MAX(0,j-radius);
-	i=MIN(i,29-radius*2);
-	j=MIN(j,39-radius*2);
-
-	for(k=0; k < stride; k++)
-	{
-		for(l=0; l < stride; l++)
-			submatrix[k*stride+l] = matrix[i+k][j+l];
+	int loc = localiser, radius = CENTROID_RADIUS;
+
+	*i = peak->i << TS_LOC_SHIFT;
+	*j = peak->j << TS_LOC_SHIFT;
+	if (loc < 0) {
+		loc = TS_LOC_CENTROID;
+		if ((peak->i < LM_EDGE || peak->j < LM_EDGE ||
+			peak->i > TS_ROWS - LM_EDGE ||
+			peak->j > TS_COLS - LM_EDGE || d2 < LM_MIN_DISTANCE_SQ) &&
+			!ts_locate_gaussian_lm(matrix, peak->i, peak->j, LM_RADIUS,
+			i, j))
+			return;
 	}
+	if (loc == TS_LOC_LM)
+		radius = LM_RADIUS;
 
-	*ofstx = i;
-	*ofsty = j;
-}
-
-void process_submatrix_levmar(int locx, int locy, int radius, double* submatrix, double* results)
-{
-	int i,j, tval, peak=0;
-	int total=0, xtotal=0,ytotal=0;
-	double guess[5];
-	int stride = 1+2*radius;
-
-#if DEBUG
-	printf("Sub Matrix: \n");
-#endif
-	for(i=0; i < stride; i++)
-	{
-		for(j=0; j < stride; j++)
-		{
-			tval = submatrix[i*stride+j];
-#if DEBUG
-			printf("%2.2X ", tval);
-#endif
-			if(tval > peak) peak = tval;
-			total+=tval;
-			xtotal += tval*i;
-			ytotal += tval*j;
-		}
-#if DEBUG
-		printf("\n");
-#endif
-	}
-
-	guess[0] = peak;   //Peak by factor
-	guess[1] = 0; //Guess that x is zero
-	guess[2] = 0; //Guess that y is zero
-	guess[3] = SD;
-
-	runlm(radius,guess,submatrix,results);
-
-	results[0] += locx+radius;
-	results[1] += locy+radius;
-//#if DEBUG
-	printf("Coords: %d, %d, %d, %d, %g, %g\n", locx, locy, i, j, results[0], results[1]);
-//#endif
-}	
-
-void process_submatrix_avg(int locx, int locy, int radius, double* submatrix, double* results)
-{
-	int i,j,tweight;
-	double isum,jsum;
-	double avgi,avgj;
-	double powered;
-	int stride = radius*2+1;
-
-	tweight=0;
-	isum=0;
-	jsum=0;
-	for(i=0; i < stride; i++) {
-		for(j=0; j < stride; j++) {
-			powered = pow(submatrix[i*stride+j], 1.5);
-			tweight += powered;
-			isum += powered * i;
-			jsum += powered * j;
-		}
-	}
-	avgi = isum / (double)tweight;
-	avgj = jsum / (double)tweight;
-	results[0] = avgi + locx;
-	results[1] = avgj + locy;
-}
-
-int is_peak(int i, int j)
-{
-	int mini,maxi,minj,maxj;
-	int tvalue = matrix[i][j];
-
-//	printf("Detect: %d, %d\n", i,j);
-	mini = i-1; maxi=i+2;
-	minj = j-1; maxj=j+2;
-	for(i=MAX(0, mini); i < MIN(30, maxi); i++) {
-		for(j=MAX(0, minj); j < MIN(40, maxj); j++) {
-//			printf("Matrix: %d, %d: %d - %d\n", i,j,matrix[i][j],tvalue);
-			if(matrix[i][j] > tvalue)
-			{
-//				printf("Not a peak\n");
-				return 0;
-			}
-		}
-	}
-	return 1;
+	if (!ts_localise(loc, matrix, peak->i, peak->j, radius, i, j))
+		return;
+	// The fit failed, the centroid is always there
+	ts_localise(TS_LOC_CENTROID, matrix, peak->i, peak->j, CENTROID_RADIUS,
+		i, j);
 }
 
 void calc_point()
 {
-	int i,j, dx, dy, d2;
+	struct ts_peak peaks[MAX_CLIST];
+	struct ts_track_point points[TS_MAX_TOUCH];
+	int ids[TS_MAX_TOUCH];
+	int count, k, l, dx, dy, d2;
 	double avgi, avgj;
-	double levmar_results[2];
-	double avg_results[2];
-	double submatrix[81];
-	int ofstx, ofsty;	
-
-	int tpc=0;
-	struct touchpoint tpoint[10];
-
-	int clc=0;
-	struct candidate clist[MAX_CLIST];
-	
-	// generate list of high values
-	for(i=0; i < 30; i++) {
-		for(j=0; j < 40; j++) {
-			if(matrix[i][j] > 10 && clc < MAX_CLIST && is_peak(i,j)) {
-//				printf("Peak: %d, %d\n", i, j);
-				clist[clc].pw = matrix[i][j];
-				clist[clc].i = i;
-				clist[clc].j = j;
-				clc++;
-			}
-		}
-	}
-#if DEBUG
-	printf("%d clc\n", clc);
-#endif
-
-	// sort candidate list by strength
-	qsort(clist, clc, sizeof(clist[0]), tpcmp);
 
+	count = ts_find_peaks(matrix, PEAK_THRESHOLD, peaks, MAX_CLIST);
 #if DEBUG
-	printf("%d %d %d \n", clist[0].pw, clist[1].pw, clist[2].pw);
+	printf("%d clc\n", count);
 #endif
-
-	int k, l;
-	for(k=0; k < clc; k++) {
-		int newtp=1;
-		
-		int rad=2; // radius around candidate to use for discounting others
-		int mini = clist[k].i - rad+1;
-		int maxi = clist[k].i + rad;
-		int minj = clist[k].j - rad+1;
-		int maxj = clist[k].j + rad;
-		
-		// discard points close to already detected touches
-		for(l=0; l<tpc; l++) {
-			if(tpoint[l].i > mini && tpoint[l].i < maxi && tpoint[l].j > minj && tpoint[l].j < maxj) newtp=0;
+	count = ts_select_peaks(peaks, count, PEAK_RADIUS, TS_MAX_TOUCH);
+
+	for(k=0; k < count; k++) {
+		// Closest other touch
+		d2 = 1000;
+		for(l=0; l<count; l++) {
+			if(l==k)
+				continue;
+			dx = peaks[k].i - peaks[l].i;
+			dy = peaks[k].j - peaks[l].j;
+			d2 = MIN(d2, dx*dx+dy*dy);
 		}
-		
-		// calculate new touch near the found candidate
-		if(newtp && tpc < 10) {
-			d2 = 1000;
-			for(l=0; l<clc; l++) {
-				if(l==k)
-					continue;
-				dx = tpoint[k].i - tpoint[l].i;
-				dy = tpoint[k].j - tpoint[l].j;
-				int td2 = dx*dx+dy*dy;
-				if(td2 < d2) d2 = td2;
-			}
-
-			generate_submatrix(4,clist[k].i,clist[k].j,&ofstx,&ofsty,submatrix);
-			process_submatrix_avg(ofstx,ofsty,4,submatrix,avg_results);
-			avgi = avg_results[0];
-			avgj = avg_results[1];
-
-
-#ifdef USE_LEVMAR
-			if(clist[k].i < 4 || clist[k].j < 4 || clist[k].i > 26 || clist[k].j > 36 || d2 < 16)
-			{
-				generate_submatrix(2,clist[k].i,clist[k].j,&ofstx,&ofsty,submatrix);
-
-				process_submatrix_levmar(ofstx,ofsty,2,submatrix,levmar_results);
-
-				avgi = levmar_results[0];
-				avgj = levmar_results[1];
-			}
-#endif
-
-			tpc++;
 
-//#if DEBUG
-			printf("Coords %d %lf, %lf\n", tpc, avgi, avgj);
-//#endif
-
-#if 0
-			/* Android does not need this an it simplifies stuff
-			 * for us as we don't need to track individual touches
-			 */
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_TRACKING_ID, tpc);
+		locate_touch(&peaks[k], d2, &points[k].x, &points[k].y);
+		points[k].valid = 1;
+#if DEBUG
+		printf("Coords %d %d, %d\n", k, points[k].x, points[k].y);
 #endif
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_TOUCH_MAJOR, 1);
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_WIDTH_MAJOR, 10);
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_POSITION_X, avgi*768/29);
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_POSITION_Y, 1024-avgj*1024/39);
-			send_uevent(uinput_fd, EV_SYN, SYN_MT_REPORT, 0);
-
+	}
 
-		}
+	// Every touch of the frame may need a new ID
+	if (next_id > MAX_TRACKING_ID - TS_MAX_TOUCH + 1)
+		next_id = 0;
+	next_id = ts_track_ids(points, count, prev_points, prev_count, prev_ids,
+		ids, next_id, TRACK_MAX_DISTANCE << TS_LOC_SHIFT);
+
+	for(k=0; k < count; k++) {
+		avgi = points[k].x / (double)(1 << TS_LOC_SHIFT);
+		avgj = points[k].y / (double)(1 << TS_LOC_SHIFT);
+		// Every touch has always been reported 10 wide
+		ts_queue_event(&uevents, uinput_fd, EV_ABS, ABS_MT_WIDTH_MAJOR,
+			10);
+		ts_report_mt(&uevents, uinput_fd, ids[k], 1, avgi*768/29,
+			1024-avgj*1024/39, peaks[k].value);
+		prev_points[k] = points[k];
+		prev_ids[k] = ids[k];
 	}
+	prev_count = count;
 
 	send_uevent(uinput_fd, EV_SYN, SYN_REPORT, 0);
 }
@@ -383,96 +245,35 @@ void calc_point()
 }
 #endif
 
-void put_byte(unsigned char byte)
-{
-//	printf("Putc %d %d\n", cidx, byte);
-	if(cidx==0 && byte != 0xFF)
-		return;
-
-	//Sometimes a send is aborted by the touch screen. all we get is an out of place 0xFF
-	if(byte == 0xFF && !cline_valid(1))
-		cidx = 0;
-	cline[cidx++] = byte;
-}
-
-int cline_valid(int extras)
-{
-	if(cline[0] == 0xff && cline[1] == 0x43 && cidx == 44-extras)
-	{
-//		printf("cidx %d\n", cline[cidx-1]);
-		return 1;
-	}
-	if(cline[0] == 0xff && cline[1] == 0x47 && cidx > 4 && cidx == (cline[2]+4-extras))
-	{
-//		printf("cidx %d\n", cline[cidx-1]);
-		return 1;
-	}
-	return 0;
-}
-
-void consume_line()
+void consume_row(int row, const unsigned char *data, int first)
 {
 	int i,j;
 
-	if(cline[1] == 0x47)
+	//This is a start event. clear the matrix
+	if(first)
 	{
-		//calculate the data points. all transfers complete
-		calc_point();
-	}
-
-	if(cline[1] == 0x43)
-	{
-		//This is a start event. clear the matrix
-		if(cline[2] & 0x80)
-		{
-			for(i=0; i < 30; i++)
-				for(j=0; j < 40; j++)
-					matrix[i][j] = 0;
-		}
-
-		//Write the line into the matrix
-		for(i=0; i < 40; i++)
-			matrix[cline[2] & 0x1F][i] = cline[i+3];
+		for(i=0; i < 30; i++)
+			for(j=0; j < 40; j++)
+				matrix[i][j] = 0;
 	}
 
-//	printf("Received %d bytes\n", cidx-1);
-		
-/*		for(i=0; i < cidx; i++)
-			printf("%2.2X ",cline[i]);
-		printf("\n");	*/
-	cidx = 0;
+	//Write the line into the matrix
+	if(row < 30)
+		memcpy(matrix[row], data, 40);
 }
 
-void snarf2(unsigned char* bytes, int size)
+int consume_frame()
 {
-	int i=0;
-	while(i < size)
-	{
-		while(i < size)
-		{
-			put_byte(bytes[i]);
-			i++;
-			if(cline_valid(0))
-			{
-//				printf("was valid\n");
-				break;
-			}
-		}
-
-		if(i >= size)
-			break;
-
-//		printf("Cline went valid\n");
-		consume_line();
-	}
-
-	if(cline_valid(0))
-	{
-		consume_line();
-//		printf("was valid2\n");
-	}
+	//calculate the data points. all transfers complete
+	calc_point();
+	return 0;
 }
 
+struct ts_parser uart_parser = {
+	.row = consume_row,
+	.frame = consume_frame,
+};
+
 void open_uinput()
 {
     struct uinput_user_dev device;
@@ -519,6 +320,8 @@ void open_uinput()
     device.absflat[ABS_MT_POSITION_Y]=0;
     device.absmax[ABS_MT_TOUCH_MAJOR]=1;
     device.absmax[ABS_MT_WIDTH_MAJOR]=100;
+    device.absmax[ABS_MT_PRESSURE]=255;
+    device.absmax[ABS_MT_TRACKING_ID]=MAX_TRACKING_ID;
 #endif
 
 
@@ -550,10 +353,13 @@ void open_uinput()
             fprintf(stderr, "error tool rel\n");
 #endif
 
-//    if (ioctl(uinput_fd,UI_SET_ABSBIT,ABS_MT_TRACKING_ID) < 0)
-//            fprintf(stderr, "error trkid rel\n");
-
 #if WANT_MULTITOUCH
+    if (ioctl(uinput_fd,UI_SET_ABSBIT,ABS_MT_TRACKING_ID) < 0)
+            fprintf(stderr, "error trkid rel\n");
+
+    if (ioctl(uinput_fd,UI_SET_ABSBIT,ABS_MT_PRESSURE) < 0)
+            fprintf(stderr, "error pressure rel\n");
+
     if (ioctl(uinput_fd,UI_SET_ABSBIT,ABS_MT_TOUCH_MAJOR) < 0)
             fprintf(stderr, "error tool rel\n");
 
@@ -585,10 +391,25 @@ int main(int argc, char** argv)
 	struct i2c_rdwr_ioctl_data i2c_ioctl_data;
 	struct i2c_msg i2c_msg;
 	int uart_fd, vdd_fd, xres_fd, wake_fd, i2c_fd, nbytes, i; 
-	char recv_buf[RECV_BUF_SIZE];
+	unsigned char recv_buf[RECV_BUF_SIZE];
 	char i2c_buf[16];
 	fd_set fdset;
 	struct timeval seltmout;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:")) != -1) {
+		if (opt == 'l' && ts_localiser_by_name(optarg) > TS_LOC_AREA) {
+			localiser = ts_localiser_by_name(optarg);
+			continue;
+		}
+		printf("Usage: %s [-l centroid|quadratic|gaussian|lm]\n", argv[0]);
+		printf("Without -l each touch uses the centroid, or the gaussian "
+			"peak near the edges and other touches\n");
+		return 1;
+	}
+
+	ts_locate_init();
+	ts_register_localiser(TS_LOC_LM, ts_locate_lm);
 
 	uart_fd = open("/dev/ctp_uart", O_RDONLY|O_NONBLOCK);
 	if(uart_fd<=0)
@@ -688,6 +509,7 @@ int main(int argc, char** argv)
 //			send_uevent(uinput_fd, EV_ABS, ABS_MT_TRACKING_ID, 1);
 			send_uevent(uinput_fd, EV_ABS, ABS_MT_TOUCH_MAJOR, 0);
 			send_uevent(uinput_fd, EV_SYN, SYN_MT_REPORT, 0);
+			prev_count = 0;
 #endif
 
 			send_uevent(uinput_fd, EV_SYN, SYN_REPORT, 0);
@@ -713,7 +535,7 @@ int main(int argc, char** argv)
 			printf("%2.2X ",recv_buf[i]);
 		printf("\n");	*/	
 
-		snarf2(recv_buf,nbytes);
+		ts_parse(&uart_parser, recv_buf, nbytes);
 
 	}
 
@@ -0,0 +1,46 @@
+/*
+ * Capture file format for raw /dev/ctp_uart data recorded by ts_srv and
+ * played back by ts_replay.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+#include <linux/types.h>
+
+// A capture file starts with a ts_capture_header and is followed by any
+// number of records.  Each record is a ts_capture_record followed by len
+// bytes exactly as they were returned by read() on the uart.  A record with
+// a len of 0 marks a select() timeout in the main loop so that liftoffs
+// happen at the same place during replay as they did on the device.
+#define TS_CAPTURE_MAGIC   0x50414354 // "TCAP"
+#define TS_CAPTURE_VERSION 1
+
+struct ts_capture_header {
+	__u32 magic;
+	__u32 version;
+};
+
+struct ts_capture_record {
+	// CLOCK_MONOTONIC time that the read or timeout happened
+	__u32 tv_sec;
+	__u32 tv_nsec;
+	// Number of uart bytes that follow this record
+	__u32 len;
+};
@@ -0,0 +1,715 @@
+/*
+ * This is a host tool that stands in for the cypress ctma395 touch screen.
+ * It plays scripted touches to ts_srv through a pty in place of
+ * /dev/ctp_uart, reads back what ts_srv reports and measures how long it
+ * took and how far off the reported touches were.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+/* Usage: ts_emu [-f script] [-e] [-s seed] [-v] ts_srv [ts_srv options]
+ * -f = script to play, see below.  A short script with one of each gesture
+ *      is played if none is given.
+ * -e = let ts_srv create a real uinput device and read it back through
+ *      evdev, this needs access to /dev/uinput and /dev/input.  Otherwise
+ *      ts_srv writes its events to a pipe.
+ * -s = seed for the noise
+ * -v = print every report as it arrives
+ *
+ * ts_emu starts ts_srv itself with -d pointing at the pty and, without -e,
+ * -i pointing at the pipe.  ts_srv's own options come after its path.
+ *
+ * Each report is compared with the last frame written to the pty.  Latency
+ * is the time from writing the frame to reading the report, so it includes
+ * the pty but not the time the real uart takes to send a frame.  The
+ * position error is against where the finger was in that frame, which means
+ * the lead of the predict filter shows up as error on drags.
+ *
+ * A script has one command per line, # starts a comment.  Locations are in
+ * screen pixels and times in milliseconds.
+ *   rate hz                    frames per second, 100 to start with
+ *   noise n                    random noise added to every point, 2 to start
+ *   idle ms                    frames with nothing touching
+ *   quiet ms                   no frames at all, like the touch screen does
+ *                              once everything has lifted off
+ *   tap x y ms                 one finger held still
+ *   drag x0 y0 x1 y1 ms        one finger moving in a straight line
+ *   pinch x y d0 d1 ms         two fingers either side of x y going from d0
+ *                              to d1 pixels apart
+ *   palm x y ms                a palm, only counted in palm reports
+ *   stylus x0 y0 x1 y1 ms      a stylus moving in a straight line
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include "ts_parser.h"
+
+// These have to match ts_srv.c, USERSPACE_270_ROTATE is not supported
+#define X_AXIS_POINTS 30
+#define Y_AXIS_POINTS 40
+#define X_RESOLUTION 1024
+#define Y_RESOLUTION 768
+#define DEVICE_NAME "HPTouchpad"
+
+#define MAX_CONTACTS 16
+// Fingers are remembered by their uid modulo this
+#define MAX_FINGERS 4096
+// Reported touches further than this from every finger are ghosts
+#define MATCH_RADIUS 100
+// Time allowed for ts_srv to start and to send its last reports
+#define START_TIMEOUT_MS 5000
+#define DRAIN_MS 200
+
+enum gesture_type { IDLE, TAP, DRAG, PINCH, PALM, STYLUS, GESTURE_TYPES };
+const char *gesture_names[GESTURE_TYPES] = {
+	"idle", "tap", "drag", "pinch", "palm", "stylus",
+};
+
+struct contact {
+	// Location in pixels
+	double x;
+	double y;
+	// Value at the center of the touch and its spread in matrix points
+	double amp;
+	double sigma;
+	// Palms aren't expected to be reported as a single touch
+	int palm;
+	// Unique for each finger in the script
+	int uid;
+};
+
+// What the last frame written to the pty contained
+struct frame_truth {
+	long long time;
+	int type;
+	int count;
+	struct contact contacts[MAX_CONTACTS];
+} truth;
+
+struct samples {
+	double *v;
+	int count;
+	int alloc;
+};
+
+// Everything is measured per gesture type
+struct samples report_latency[GESTURE_TYPES], down_latency[GESTURE_TYPES];
+struct samples lift_latency[GESTURE_TYPES], position_error[GESTURE_TYPES];
+unsigned int ghosts[GESTURE_TYPES], palm_reports[GESTURE_TYPES];
+unsigned int fingers[GESTURE_TYPES], missed[GESTURE_TYPES];
+
+int master_fd, event_fd = -1, verbose, protocol_b;
+unsigned int frames_sent, reports, bytes_dropped;
+double frame_us = 10000, noise = 2;
+int next_uid;
+
+// Time each finger first appeared, whether it has been reported yet and the
+// gesture it belongs to
+long long down_time[MAX_FINGERS];
+unsigned char down_seen[MAX_FINGERS], finger_type[MAX_FINGERS];
+// Set when the last finger lifted and nothing has been reported since
+long long lift_time;
+int lift_type;
+
+// Touches in the report being read
+struct reported {
+	int x;
+	int y;
+	int id;
+} slots[MAX_CONTACTS], current;
+// Set once anything is sent for the current touch, a liftoff is an empty
+// SYN_MT_REPORT
+int current_set;
+int slot, nreported;
+struct reported report[MAX_CONTACTS];
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void add_sample(struct samples *s, double v)
+{
+	if (s->count == s->alloc) {
+		s->alloc = s->alloc ? s->alloc * 2 : 256;
+		s->v = realloc(s->v, s->alloc * sizeof(*s->v));
+		if (s->v == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	s->v[s->count++] = v;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+	return (da > db) - (da < db);
+}
+
+static void print_samples(const char *name, struct samples *s)
+{
+	double total = 0;
+	int i;
+
+	if (!s->count)
+		return;
+	qsort(s->v, s->count, sizeof(*s->v), cmp_double);
+	for (i = 0; i < s->count; i++)
+		total += s->v[i];
+	printf("  %-20s avg %8.1f p50 %8.1f p90 %8.1f max %8.1f (%i)\n", name,
+		total / s->count, s->v[(s->count - 1) / 2],
+		s->v[(s->count - 1) * 9 / 10], s->v[s->count - 1], s->count);
+}
+
+static void render_frame(struct frame_truth *frame, unsigned char *buf,
+	int *len)
+{
+	// Draws the contacts of a frame into the matrix and packs it the way the
+	// touch screen sends it
+	double matrix[X_AXIS_POINTS][Y_AXIS_POINTS], ci, cj, d;
+	int i, j, k, v, pos = 0;
+
+	memset(matrix, 0, sizeof(matrix));
+	for (k = 0; k < frame->count; k++) {
+		// The inverse of the mapping in ts_srv's calc_point
+		ci = (Y_RESOLUTION - 1 - frame->contacts[k].y) *
+			(X_AXIS_POINTS - 1) / Y_RESOLUTION;
+		cj = (X_RESOLUTION - 1 - frame->contacts[k].x) *
+			(Y_AXIS_POINTS - 1) / X_RESOLUTION;
+		for (i = 0; i < X_AXIS_POINTS; i++)
+			for (j = 0; j < Y_AXIS_POINTS; j++) {
+				d = ((i - ci) * (i - ci) + (j - cj) * (j - cj)) /
+					(2 * frame->contacts[k].sigma *
+					frame->contacts[k].sigma);
+				if (d < 20)
+					matrix[i][j] += frame->contacts[k].amp * exp(-d);
+			}
+	}
+
+	for (i = 0; i < X_AXIS_POINTS; i++) {
+		buf[pos++] = 0xFF;
+		buf[pos++] = 0x43;
+		buf[pos++] = i | (i == 0 ? 0x80 : 0);
+		for (j = 0; j < Y_AXIS_POINTS; j++) {
+			v = matrix[i][j] + noise * rand() / RAND_MAX;
+			// 0xFF would start a new packet
+			buf[pos++] = v > 0xFE ? 0xFE : v;
+		}
+		buf[pos++] = 0;
+	}
+	buf[pos++] = 0xFF;
+	buf[pos++] = 0x47;
+	buf[pos++] = 2;
+	buf[pos++] = 0;
+	buf[pos++] = 0;
+	buf[pos++] = 0;
+	*len = pos;
+}
+
+static void match_report(long long time)
+{
+	// Compares a whole report from ts_srv with the last frame sent
+	int used[MAX_CONTACTS], i, k, best;
+	double dist, best_dist;
+	struct contact *c;
+
+	reports++;
+	if (truth.time)
+		add_sample(&report_latency[truth.type], time - truth.time);
+	if (verbose) {
+		printf("%lld us after %s frame:", truth.time ? time - truth.time : 0,
+			gesture_names[truth.type]);
+		for (i = 0; i < nreported; i++)
+			printf(" %i@%i,%i", report[i].id, report[i].x, report[i].y);
+		printf("\n");
+	}
+
+	if (!nreported && lift_time) {
+		add_sample(&lift_latency[lift_type], time - lift_time);
+		lift_time = 0;
+	}
+
+	// Match each finger to the nearest reported touch
+	memset(used, 0, sizeof(used));
+	for (k = 0; k < truth.count; k++) {
+		c = &truth.contacts[k];
+		best = -1;
+		best_dist = MATCH_RADIUS;
+		for (i = 0; i < nreported; i++) {
+			dist = hypot(report[i].x - c->x, report[i].y - c->y);
+			if (!used[i] && dist < best_dist) {
+				best = i;
+				best_dist = dist;
+			}
+		}
+		if (best < 0)
+			continue;
+		used[best] = 1;
+		if (c->palm) {
+			palm_reports[truth.type]++;
+			continue;
+		}
+		add_sample(&position_error[truth.type], best_dist);
+		if (!down_seen[c->uid % MAX_FINGERS]) {
+			down_seen[c->uid % MAX_FINGERS] = 1;
+			add_sample(&down_latency[truth.type],
+				time - down_time[c->uid % MAX_FINGERS]);
+		}
+	}
+	for (i = 0; i < nreported; i++)
+		if (!used[i])
+			ghosts[truth.type]++;
+}
+
+static void process_event(struct input_event *ev, long long time)
+{
+	// Collects touches until the end of a report, for both the A and the
+	// B multi-touch protocol
+	int i;
+
+	if (ev->type == EV_ABS) {
+		current_set = 1;
+		switch (ev->code) {
+			case ABS_MT_SLOT:
+				protocol_b = 1;
+				slot = ev->value < MAX_CONTACTS ? ev->value : 0;
+				break;
+			case ABS_MT_TRACKING_ID:
+				current.id = ev->value;
+				slots[slot].id = ev->value;
+				break;
+			case ABS_MT_POSITION_X:
+				current.x = ev->value;
+				slots[slot].x = ev->value;
+				break;
+			case ABS_MT_POSITION_Y:
+				current.y = ev->value;
+				slots[slot].y = ev->value;
+				break;
+		}
+	} else if (ev->type == EV_SYN && ev->code == SYN_MT_REPORT) {
+		if (current_set && nreported < MAX_CONTACTS)
+			report[nreported++] = current;
+		current_set = 0;
+	} else if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+		// With protocol B the slots hold the touches instead
+		if (protocol_b)
+			for (i = 0; i < MAX_CONTACTS; i++)
+				if (slots[i].id >= 0)
+					report[nreported++] = slots[i];
+		match_report(time);
+		nreported = 0;
+	}
+}
+
+static void read_events(void)
+{
+	static unsigned char buf[sizeof(struct input_event) * 64];
+	static int len;
+	struct input_event ev;
+	long long time = now_us();
+	int nbytes, pos;
+
+	nbytes = read(event_fd, buf + len, sizeof(buf) - len);
+	if (nbytes <= 0)
+		return;
+	len += nbytes;
+	for (pos = 0; pos + (int)sizeof(ev) <= len; pos += sizeof(ev)) {
+		memcpy(&ev, buf + pos, sizeof(ev));
+		process_event(&ev, time);
+	}
+	memmove(buf, buf + pos, len - pos);
+	len -= pos;
+}
+
+static void wait_until(long long deadline)
+{
+	// Reads back events until it is time for the next frame
+	struct pollfd pfd = { event_fd, POLLIN, 0 };
+	long long left;
+
+	while ((left = deadline - now_us()) > 0) {
+		if (poll(&pfd, 1, (left + 999) / 1000) > 0)
+			read_events();
+	}
+}
+
+static void send_frame(struct frame_truth *frame, long long deadline)
+{
+	// Reports that arrive until the deadline still belong to the frame
+	// before, so truth only changes once the frame is written
+	unsigned char buf[X_AXIS_POINTS * (TS_ROW_POINTS + 4) + 6];
+	int len, ret;
+
+	render_frame(frame, buf, &len);
+	wait_until(deadline);
+	// The uart drops data when nobody reads it, so does the pty
+	ret = write(master_fd, buf, len);
+	if (ret < len)
+		bytes_dropped += len - (ret > 0 ? ret : 0);
+	truth = *frame;
+	truth.time = now_us();
+	frames_sent++;
+}
+
+static void play_gesture(int type, double *args, int ms, long long *next)
+{
+	// Sends the frames for one gesture.  The first frame of a gesture is
+	// the touch down and the first frame after it the liftoff.
+	int frames = ms * 1000 / frame_us, f, k, uid = next_uid, idx;
+	double t, d;
+	struct frame_truth frame;
+
+	if (frames < 1)
+		frames = 1;
+	for (f = 0; f < frames; f++) {
+		t = frames > 1 ? (double)f / (frames - 1) : 0;
+		memset(&frame, 0, sizeof(frame));
+		frame.type = type;
+		switch (type) {
+			case TAP:
+				frame.contacts[frame.count++] =
+					(struct contact){ args[0], args[1], 80, 1.0, 0, uid };
+				break;
+			case DRAG:
+			case STYLUS:
+				frame.contacts[frame.count++] = (struct contact){
+					args[0] + (args[2] - args[0]) * t,
+					args[1] + (args[3] - args[1]) * t,
+					type == STYLUS ? 40 : 80,
+					type == STYLUS ? 0.6 : 1.1, 0, uid };
+				break;
+			case PINCH:
+				d = (args[2] + (args[3] - args[2]) * t) / 2;
+				frame.contacts[frame.count++] = (struct contact){
+					args[0] - d, args[1], 90, 1.0, 0, uid };
+				frame.contacts[frame.count++] = (struct contact){
+					args[0] + d, args[1], 90, 1.0, 0, uid + 1 };
+				break;
+			case PALM:
+				frame.contacts[frame.count++] = (struct contact){
+					args[0], args[1], 110, 3.5, 1, uid };
+				frame.contacts[frame.count++] = (struct contact){
+					args[0] + 60, args[1] - 40, 70, 2.5, 1, uid };
+				break;
+		}
+		send_frame(&frame, *next);
+		if (f == 0 && frame.count) {
+			// Count from when the frame was actually sent
+			for (k = 0; k < frame.count; k++) {
+				idx = frame.contacts[k].uid % MAX_FINGERS;
+				down_time[idx] = truth.time;
+				down_seen[idx] = 0;
+				finger_type[idx] = type;
+			}
+			lift_time = 0;
+		}
+		*next += frame_us;
+	}
+	if (type != PALM)
+		fingers[type] += frame.count;
+	next_uid = uid + frame.count;
+	if (type != IDLE) {
+		lift_time = *next;
+		lift_type = type;
+	}
+}
+
+static const char *default_script[] = {
+	"idle 300",
+	"tap 300 200 80",
+	"idle 100",
+	"drag 100 100 900 600 500",
+	"quiet 100",
+	"pinch 512 384 150 500 400",
+	"idle 100",
+	"palm 600 400 300",
+	"idle 100",
+	"stylus 200 600 700 300 400",
+	"quiet 100",
+	NULL,
+};
+
+static int play_line(char *line, int lineno, long long *next)
+{
+	// Runs one line of the script, returns -1 if it doesn't make sense
+	char cmd[16];
+	double args[5];
+	int n, type, want, ms;
+
+	if (strchr(line, '#'))
+		*strchr(line, '#') = 0;
+	n = sscanf(line, "%15s %lf %lf %lf %lf %lf", cmd, &args[0], &args[1],
+		&args[2], &args[3], &args[4]);
+	if (n <= 0)
+		return 0;
+
+	if (!strcmp(cmd, "rate") && n == 2 && args[0] >= 1) {
+		frame_us = 1000000 / args[0];
+		return 0;
+	}
+	if (!strcmp(cmd, "noise") && n == 2 && args[0] >= 0) {
+		noise = args[0];
+		return 0;
+	}
+	if (!strcmp(cmd, "quiet") && n == 2) {
+		// Reports from here on only come from ts_srv's liftoff timer
+		truth.time = 0;
+		truth.count = 0;
+		*next += args[0] * 1000;
+		wait_until(*next);
+		return 0;
+	}
+	for (type = 0; type < GESTURE_TYPES; type++)
+		if (!strcmp(cmd, gesture_names[type]))
+			break;
+	want = type == IDLE ? 2 : type == TAP || type == PALM ? 4 : 6;
+	if (type == GESTURE_TYPES || n != want) {
+		fprintf(stderr, "Line %i doesn't make sense: %s\n", lineno, line);
+		return -1;
+	}
+	ms = args[n - 2];
+	play_gesture(type, args, ms, next);
+	return 0;
+}
+
+static int find_evdev(void)
+{
+	// Looks for the input device ts_srv created through uinput
+	char path[32], name[64];
+	int i, fd;
+
+	for (i = 0; i < 64; i++) {
+		snprintf(path, sizeof(path), "/dev/input/event%i", i);
+		fd = open(path, O_RDONLY | O_NONBLOCK);
+		if (fd < 0)
+			continue;
+		if (ioctl(fd, EVIOCGNAME(sizeof(name)), name) >= 0 &&
+			!strncmp(name, DEVICE_NAME, sizeof(name)))
+			return fd;
+		close(fd);
+	}
+	return -1;
+}
+
+static pid_t start_ts_srv(char **argv, int argc, int use_evdev)
+{
+	// Starts ts_srv on the pty and waits until its uinput device is there
+	char **args, pipe_path[32];
+	int pipe_fds[2], slave_fd, i, n = 0, waited;
+	struct termios tio;
+	struct uinput_user_dev device;
+	struct pollfd pfd;
+	pid_t pid;
+
+	master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master_fd < 0 || grantpt(master_fd) || unlockpt(master_fd)) {
+		fprintf(stderr, "Unable to create a pty\n");
+		return -1;
+	}
+	// Keep the slave open in raw mode so bytes go through untouched and
+	// ts_srv can close and reopen it
+	slave_fd = open(ptsname(master_fd), O_RDWR | O_NOCTTY);
+	if (slave_fd < 0 || tcgetattr(slave_fd, &tio)) {
+		fprintf(stderr, "Unable to open %s\n", ptsname(master_fd));
+		return -1;
+	}
+	cfmakeraw(&tio);
+	tcsetattr(slave_fd, TCSANOW, &tio);
+	fcntl(master_fd, F_SETFL, fcntl(master_fd, F_GETFL) | O_NONBLOCK);
+
+	if (!use_evdev && pipe(pipe_fds)) {
+		fprintf(stderr, "Unable to create a pipe\n");
+		return -1;
+	}
+
+	args = calloc(argc + 5, sizeof(*args));
+	for (i = 0; i < argc; i++)
+		args[n++] = argv[i];
+	args[n++] = "-d";
+	args[n++] = ptsname(master_fd);
+	if (!use_evdev) {
+		snprintf(pipe_path, sizeof(pipe_path), "/dev/fd/%i", pipe_fds[1]);
+		args[n++] = "-i";
+		args[n++] = pipe_path;
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		close(master_fd);
+		if (!use_evdev)
+			close(pipe_fds[0]);
+		execv(args[0], args);
+		fprintf(stderr, "Unable to run %s\n", args[0]);
+		_exit(1);
+	}
+	free(args);
+	if (pid < 0)
+		return -1;
+
+	if (!use_evdev) {
+		close(pipe_fds[1]);
+		event_fd = pipe_fds[0];
+		// ts_srv writes the device setup first
+		pfd.fd = event_fd;
+		pfd.events = POLLIN;
+		n = 0;
+		while (n < (int)sizeof(device) &&
+			poll(&pfd, 1, START_TIMEOUT_MS) > 0 &&
+			(i = read(event_fd, (char *)&device + n,
+			sizeof(device) - n)) > 0)
+			n += i;
+		if (n < (int)sizeof(device))
+			event_fd = -1;
+	} else
+		for (waited = 0; waited < START_TIMEOUT_MS && event_fd < 0;
+			waited += 100) {
+			usleep(100000);
+			event_fd = find_evdev();
+		}
+	if (event_fd < 0) {
+		fprintf(stderr, "ts_srv didn't create its input device\n");
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	fcntl(event_fd, F_SETFL, fcntl(event_fd, F_GETFL) | O_NONBLOCK);
+	// Give ts_srv time to get to its main loop
+	usleep(DRAIN_MS * 1000);
+	return pid;
+}
+
+static void print_results(void)
+{
+	int type, uid;
+
+	for (uid = 0; uid < next_uid && uid < MAX_FINGERS; uid++)
+		if (!down_seen[uid] && finger_type[uid] != PALM)
+			missed[finger_type[uid]]++;
+
+	printf("frames sent:     %u (%u bytes dropped)\n", frames_sent,
+		bytes_dropped);
+	printf("reports:         %u\n", reports);
+	for (type = 0; type < GESTURE_TYPES; type++) {
+		if (!report_latency[type].count && !lift_latency[type].count &&
+			!fingers[type])
+			continue;
+		printf("%s:\n", gesture_names[type]);
+		if (fingers[type])
+			printf("  fingers            %u, %u never reported\n",
+				fingers[type], missed[type]);
+		print_samples("report latency us", &report_latency[type]);
+		print_samples("touch down us", &down_latency[type]);
+		print_samples("liftoff us", &lift_latency[type]);
+		print_samples("position error px", &position_error[type]);
+		if (ghosts[type])
+			printf("  ghost touches      %u\n", ghosts[type]);
+		if (type == PALM)
+			printf("  palm reports       %u\n", palm_reports[type]);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	int opt, use_evdev = 0, lineno = 0, i, ret = 0;
+	char *script = NULL, line[256];
+	unsigned int seed = 1;
+	long long next;
+	FILE *fp = NULL;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "+f:es:v")) != -1) {
+		switch (opt) {
+			case 'f':
+				script = optarg;
+				break;
+			case 'e':
+				use_evdev = 1;
+				break;
+			case 's':
+				seed = atoi(optarg);
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				optind = argc;
+				break;
+		}
+	}
+	if (optind >= argc) {
+		printf("Usage: %s [-f script] [-e] [-s seed] [-v] ts_srv "
+			"[ts_srv options]\n", argv[0]);
+		printf("-f to play a script instead of one of each gesture\n");
+		printf("-e to read the events back through evdev\n");
+		printf("-s to seed the noise\n");
+		printf("-v to print every report\n");
+		return -1;
+	}
+	if (script != NULL) {
+		fp = fopen(script, "r");
+		if (fp == NULL) {
+			fprintf(stderr, "Unable to open %s\n", script);
+			return -1;
+		}
+	}
+	srand(seed);
+	for (i = 0; i < MAX_CONTACTS; i++)
+		slots[i].id = -1;
+
+	pid = start_ts_srv(argv + optind, argc - optind, use_evdev);
+	if (pid < 0)
+		return -1;
+
+	next = now_us();
+	if (fp != NULL) {
+		while (!ret && fgets(line, sizeof(line), fp) != NULL)
+			ret = play_line(line, ++lineno, &next);
+		fclose(fp);
+	} else
+		for (i = 0; !ret && default_script[i] != NULL; i++) {
+			strcpy(line, default_script[i]);
+			ret = play_line(line, i + 1, &next);
+		}
+	wait_until(now_us() + DRAIN_MS * 1000);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	print_results();
+	return ret;
+}
@@ -0,0 +1,79 @@
+/*
+ * Queue for the input events of a frame, shared by ts_srv and the levmar
+ * variant of it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+
+#include <string.h>
+#include <unistd.h>
+
+#include "ts_events.h"
+
+int ts_flush_events(struct ts_events *events, int fd)
+{
+	int len = events->len * sizeof(struct input_event);
+	int i;
+
+	if (!events->len)
+		return 0;
+	events->len = 0;
+	if (events->sink != NULL) {
+		for (i = 0; i < len / (int)sizeof(struct input_event); i++)
+			events->sink(&events->buf[i]);
+		return 0;
+	}
+	if (write(fd, events->buf, len) != len)
+		return -1;
+	return 0;
+}
+
+int ts_queue_event(struct ts_events *events, int fd, __u16 type, __u16 code,
+	__s32 value)
+{
+	struct input_event *event;
+
+	if (events->len == TS_MAX_EVENTS && ts_flush_events(events, fd))
+		return -1;
+	event = &events->buf[events->len++];
+	memset(event, 0, sizeof(*event));
+	event->type = type;
+	event->code = code;
+	event->value = value;
+
+	if (type == EV_SYN && code == SYN_REPORT)
+		return ts_flush_events(events, fd);
+	return 0;
+}
+
+int ts_report_mt(struct ts_events *events, int fd, int tracking_id,
+	int touch_major, int x, int y, int pressure)
+{
+	if (ts_queue_event(events, fd, EV_ABS, ABS_MT_TRACKING_ID, tracking_id) ||
+		ts_queue_event(events, fd, EV_ABS, ABS_MT_TOUCH_MAJOR,
+			touch_major) ||
+		ts_queue_event(events, fd, EV_ABS, ABS_MT_POSITION_X, x) ||
+		ts_queue_event(events, fd, EV_ABS, ABS_MT_POSITION_Y, y) ||
+		ts_queue_event(events, fd, EV_ABS, ABS_MT_PRESSURE, pressure) ||
+		ts_queue_event(events, fd, EV_SYN, SYN_MT_REPORT, 0))
+		return -1;
+	return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * Queue for the input events of a frame, shared by ts_srv and the levmar
+ * variant of it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+
+#include <linux/input.h>
+
+// Enough for every event of a frame with TS_MAX_TOUCH touches
+#define TS_MAX_EVENTS 100
+
+// Events are queued up and written all at once at the end of the frame so a
+// frame costs one syscall instead of one per event.  When sink is set the
+// events are handed to it instead of being written to the fd.
+struct ts_events {
+	void (*sink)(struct input_event *event);
+	int len;
+	struct input_event buf[TS_MAX_EVENTS];
+};
+
+// Queues an event and writes the queue out after a SYN_REPORT or when it is
+// full.  Returns -1 if the write failed.
+int ts_queue_event(struct ts_events *events, int fd, __u16 type, __u16 code,
+	__s32 value);
+
+// Writes out every queued event.  Returns -1 if the write failed, the events
+// are dropped either way.
+int ts_flush_events(struct ts_events *events, int fd);
+
+// Queues a protocol A touch, the caller still has to queue the SYN_REPORT
+int ts_report_mt(struct ts_events *events, int fd, int tracking_id,
+	int touch_major, int x, int y, int pressure);
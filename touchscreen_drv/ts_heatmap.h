@@ -0,0 +1,78 @@
+/*
+ * Layout of the shared memory ring that ts_srv publishes every frame and its
+ * touches to.  Clients get the ring with the H socket command.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+
+#include <linux/types.h>
+
+// The ring is shared memory that ts_srv creates the first time a client asks
+// for it.  The reply to the H socket command carries its fd, which the client
+// maps read only with mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0).  size
+// is in the header at the start of the ring.
+//
+// Frame n goes in slot n % frames.  ts_srv sets seq to 2n + 1 before it
+// writes the slot and to 2n + 2 once it is done.  A reader copies the slot
+// and checks that seq was 2n + 2 both before and after the copy.  A higher
+// seq means the reader fell behind and frame n was overwritten.
+#define TS_HEATMAP_MAGIC   0x50414D48 // "HMAP"
+#define TS_HEATMAP_VERSION 2
+#define TS_HEATMAP_FRAMES  64
+#define TS_HEATMAP_ROWS    30
+#define TS_HEATMAP_COLS    40
+#define TS_HEATMAP_TOUCHES 10
+
+struct ts_heatmap_touch {
+	__s32 tracking_id;
+	// Reported location, or where the touch will be once it is reported
+	__s32 x;
+	__s32 y;
+	__s32 pressure;
+	__s32 touch_major;
+	// Highest value of the touch in the matrix
+	__s32 peak;
+	// Milliseconds left before a new, weak touch is reported, 0 once it is
+	__s32 delay;
+};
+
+struct ts_heatmap_frame {
+	__u32 seq;
+	// CLOCK_MONOTONIC time that the frame was processed
+	__u32 tv_sec;
+	__u32 tv_nsec;
+	__u32 touch_count;
+	struct ts_heatmap_touch touches[TS_HEATMAP_TOUCHES];
+	// The matrix that touches were found in, after any baseline was removed
+	__u8 matrix[TS_HEATMAP_ROWS][TS_HEATMAP_COLS];
+};
+
+struct ts_heatmap {
+	__u32 magic;
+	__u32 version;
+	// Total size of the shared memory
+	__u32 size;
+	__u32 frames;
+	// Number of frames written so far, the newest is head - 1
+	volatile __u32 head;
+	__u32 reserved;
+	struct ts_heatmap_frame frame[TS_HEATMAP_FRAMES];
+};
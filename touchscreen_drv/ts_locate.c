@@ -0,0 +1,362 @@
+/*
+ * Peak finding and touch localisers shared by ts_srv and the levmar variant
+ * of it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "ts_locate.h"
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+
+// Peaks are bucketed by value >> PEAK_BUCKET_SHIFT as they are found, and
+// kept as row << PEAK_ROW_SHIFT | column until they are sorted
+#define PEAK_BUCKET_SHIFT 4
+#define PEAK_BUCKETS (256 >> PEAK_BUCKET_SHIFT)
+#define PEAK_ROW_SHIFT 6
+
+unsigned short ts_weight_table[256];
+// Natural log of each value in Q10, values of 0 are taken as 1
+#define LOG_SHIFT 10
+static int log_table[256];
+
+static int locate_centroid(unsigned char matrix[TS_ROWS][TS_COLS],
+	int peak_i, int peak_j, int radius, int *i, int *j);
+static int locate_quadratic(unsigned char matrix[TS_ROWS][TS_COLS],
+	int peak_i, int peak_j, int radius, int *i, int *j);
+static int locate_gaussian(unsigned char matrix[TS_ROWS][TS_COLS],
+	int peak_i, int peak_j, int radius, int *i, int *j);
+
+static struct {
+	const char *name;
+	ts_localise_fn fn;
+} localisers[TS_LOC_COUNT] = {
+	[TS_LOC_AREA] = { "area", NULL },
+	[TS_LOC_CENTROID] = { "centroid", locate_centroid },
+	[TS_LOC_QUADRATIC] = { "quadratic", locate_quadratic },
+	[TS_LOC_GAUSSIAN] = { "gaussian", locate_gaussian },
+	[TS_LOC_LM] = { "lm", NULL },
+};
+
+void ts_locate_init(void)
+{
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		ts_weight_table[i] = pow(i, 1.5) * (1 << TS_WEIGHT_SHIFT);
+		log_table[i] = log(MAX(i, 1)) * (1 << LOG_SHIFT) + 0.5;
+	}
+}
+
+static void row_max(const unsigned char *row, unsigned char *out)
+{
+	// Highest of each point and its neighbours on the row
+#if defined(__ARM_NEON__)
+	vst1q_u8(&out[1], vmaxq_u8(vmaxq_u8(vld1q_u8(&row[0]),
+		vld1q_u8(&row[1])), vld1q_u8(&row[2])));
+	vst1q_u8(&out[17], vmaxq_u8(vmaxq_u8(vld1q_u8(&row[16]),
+		vld1q_u8(&row[17])), vld1q_u8(&row[18])));
+	// Overlaps the last store so nothing is read past the row
+	vst1q_u8(&out[23], vmaxq_u8(vmaxq_u8(vld1q_u8(&row[22]),
+		vld1q_u8(&row[23])), vld1q_u8(&row[24])));
+#else
+	int j;
+	for (j = 1; j < TS_COLS - 1; j++)
+		out[j] = MAX(MAX(row[j - 1], row[j]), row[j + 1]);
+#endif
+	out[0] = MAX(row[0], row[1]);
+	out[TS_COLS - 1] = MAX(row[TS_COLS - 2], row[TS_COLS - 1]);
+}
+
+static void peak_mask(const unsigned char *row, const unsigned char *above,
+	const unsigned char *at, const unsigned char *below,
+	unsigned char threshold, unsigned char *mask)
+{
+	// Marks the points of the row that are above threshold and that no
+	// point around is higher than, from the row maximums of the row and the
+	// rows either side of it
+#if defined(__ARM_NEON__)
+	uint8x16_t thresh = vdupq_n_u8(threshold), value, highest;
+	int j;
+
+	for (j = 0; j < TS_COLS; j += 16) {
+		// The last 8 points are done with the 16 ending at the row end
+		if (j + 16 > TS_COLS)
+			j = TS_COLS - 16;
+		value = vld1q_u8(&row[j]);
+		highest = vmaxq_u8(vmaxq_u8(vld1q_u8(&above[j]), vld1q_u8(&at[j])),
+			vld1q_u8(&below[j]));
+		vst1q_u8(&mask[j], vandq_u8(vceqq_u8(value, highest),
+			vcgtq_u8(value, thresh)));
+	}
+#else
+	int j;
+	for (j = 0; j < TS_COLS; j++)
+		mask[j] = (row[j] > threshold) &
+			(row[j] == MAX(MAX(above[j], at[j]), below[j]));
+#endif
+}
+
+int ts_find_peaks(unsigned char matrix[TS_ROWS][TS_COLS], int threshold,
+	struct ts_peak *peaks, int max)
+{
+	// Local maximums are found for the whole matrix at once, the cost
+	// doesn't depend on how much of it is touched.  They are put in buckets
+	// by strength as they are found so that only peaks in the same bucket
+	// need to be sorted.
+	unsigned char highest[TS_ROWS][TS_COLS], mask[TS_COLS];
+	unsigned short found[TS_ROWS * TS_COLS];
+	unsigned long long marked;
+	int start[PEAK_BUCKETS], i, j, k, count = 0, value;
+	struct ts_peak peak;
+
+	if (threshold > 255)
+		return 0;
+	if (threshold < 0)
+		threshold = 0;
+	memset(start, 0, sizeof(start));
+	for (i = 0; i < TS_ROWS; i++)
+		row_max(matrix[i], highest[i]);
+	for (i = 0; i < TS_ROWS && count < max; i++) {
+		peak_mask(matrix[i], highest[MAX(i - 1, 0)], highest[i],
+			highest[MIN(i + 1, TS_ROWS - 1)], threshold, mask);
+		for (j = 0; j < TS_COLS && count < max; j++) {
+			// Most of the row has no peaks, skip 8 points at a time
+			if (!(j & 7)) {
+				memcpy(&marked, &mask[j], sizeof(marked));
+				if (!marked) {
+					j += 7;
+					continue;
+				}
+			}
+			if (mask[j]) {
+				found[count++] = (i << PEAK_ROW_SHIFT) | j;
+				start[matrix[i][j] >> PEAK_BUCKET_SHIFT]++;
+			}
+		}
+	}
+
+	// Each bucket starts after the stronger buckets
+	for (k = PEAK_BUCKETS - 1, i = 0; k >= 0; k--) {
+		j = start[k];
+		start[k] = i;
+		i += j;
+	}
+	for (k = 0; k < count; k++) {
+		i = found[k] >> PEAK_ROW_SHIFT;
+		j = found[k] & ((1 << PEAK_ROW_SHIFT) - 1);
+		peak.value = matrix[i][j];
+		peak.i = i;
+		peak.j = j;
+		peaks[start[peak.value >> PEAK_BUCKET_SHIFT]++] = peak;
+	}
+
+	// Only moves peaks within their bucket
+	for (k = 1; k < count; k++) {
+		peak = peaks[k];
+		value = peak.value;
+		for (i = k; i > 0 && peaks[i - 1].value < value; i--)
+			peaks[i] = peaks[i - 1];
+		peaks[i] = peak;
+	}
+	return count;
+}
+
+int ts_select_peaks(struct ts_peak *peaks, int count, int radius, int max)
+{
+	int k, l, kept = 0;
+
+	for (k = 0; k < count && kept < max; k++) {
+		for (l = 0; l < kept; l++)
+			if (abs(peaks[k].i - peaks[l].i) < radius &&
+				abs(peaks[k].j - peaks[l].j) < radius)
+				break;
+		if (l == kept)
+			peaks[kept++] = peaks[k];
+	}
+	return kept;
+}
+
+int ts_window_start(int peak, int radius, int points)
+{
+	return MIN(MAX(peak - radius, 0), points - 1 - radius * 2);
+}
+
+static int locate_centroid(unsigned char matrix[TS_ROWS][TS_COLS],
+	int peak_i, int peak_j, int radius, int *i, int *j)
+{
+	int starti = ts_window_start(peak_i, radius, TS_ROWS);
+	int startj = ts_window_start(peak_j, radius, TS_COLS);
+	unsigned int weight, total = 0, isum = 0, jsum = 0;
+	int k, l;
+
+	for (k = starti; k <= starti + radius * 2; k++) {
+		for (l = startj; l <= startj + radius * 2; l++) {
+			weight = ts_weight_table[matrix[k][l]];
+			total += weight;
+			isum += weight * k;
+			jsum += weight * l;
+		}
+	}
+	if (!total)
+		return -1;
+	*i = ((unsigned long long)isum << TS_LOC_SHIFT) / total;
+	*j = ((unsigned long long)jsum << TS_LOC_SHIFT) / total;
+	return 0;
+}
+
+static int axis_vertex(const int *table, const unsigned char *peak,
+	int step, int pos, int points)
+{
+	// Offset in Q8 of the top of the parabola through the peak and the
+	// points step either side of it, no more than half a point either way.
+	// A peak on the edge has no point on one side so the parabola goes
+	// through the next two points in instead.
+	int at = table[peak[0]], before, after, curve, offset, s;
+
+	if (pos == 0 || pos == points - 1) {
+		s = pos ? -step : step;
+		before = table[peak[s]];
+		after = table[peak[2 * s]];
+		curve = at - 2 * before + after;
+		if (curve >= 0)
+			return 0; // Flat, or the touch is off the edge
+		offset = (1 << TS_LOC_SHIFT) +
+			((at - after) << (TS_LOC_SHIFT - 1)) / curve;
+		if (pos)
+			offset = -offset;
+	} else {
+		before = table[peak[-step]];
+		after = table[peak[step]];
+		curve = before - 2 * at + after;
+		if (curve >= 0)
+			return 0; // Flat, or the middle isn't the highest
+		offset = ((before - after) << (TS_LOC_SHIFT - 1)) / curve;
+	}
+	return MIN(MAX(offset, -(1 << (TS_LOC_SHIFT - 1))),
+		1 << (TS_LOC_SHIFT - 1));
+}
+
+static int locate_parabola(unsigned char matrix[TS_ROWS][TS_COLS],
+	int peak_i, int peak_j, const int *table, int *i, int *j)
+{
+	// The fit is done on each axis on its own
+	*i = (peak_i << TS_LOC_SHIFT) + axis_vertex(table,
+		&matrix[peak_i][peak_j], TS_COLS, peak_i, TS_ROWS);
+	*j = (peak_j << TS_LOC_SHIFT) + axis_vertex(table,
+		&matrix[peak_i][peak_j], 1, peak_j, TS_COLS);
+	return 0;
+}
+
+static int locate_quadratic(unsigned char matrix[TS_ROWS][TS_COLS],
+	int peak_i, int peak_j, int radius, int *i, int *j)
+{
+	static int value_table[256];
+
+	(void)radius;
+	if (!value_table[255]) {
+		int k;
+		for (k = 0; k < 256; k++)
+			value_table[k] = k;
+	}
+	return locate_parabola(matrix, peak_i, peak_j, value_table, i, j);
+}
+
+static int locate_gaussian(unsigned char matrix[TS_ROWS][TS_COLS],
+	int peak_i, int peak_j, int radius, int *i, int *j)
+{
+	(void)radius;
+	return locate_parabola(matrix, peak_i, peak_j, log_table, i, j);
+}
+
+int ts_gaussian_residual(unsigned char matrix[TS_ROWS][TS_COLS],
+	int peak_i, int peak_j)
+{
+	// A gaussian touch is the same shape along one axis wherever it is on
+	// the other, so each corner of the 3x3 points around the peak is the
+	// product of the two neighbours next to it over the peak.
+	int at = matrix[peak_i][peak_j], k, l, ni, nj, diff;
+	unsigned int error = 0, total = at * at;
+
+	if (!at)
+		return 1 << TS_RESIDUAL_SHIFT;
+	for (l = -1; l <= 1; l += 2)
+		if (peak_j + l >= 0 && peak_j + l < TS_COLS)
+			total += matrix[peak_i][peak_j + l] *
+				matrix[peak_i][peak_j + l];
+	for (k = -1; k <= 1; k += 2) {
+		if (peak_i + k < 0 || peak_i + k >= TS_ROWS)
+			continue;
+		ni = matrix[peak_i + k][peak_j];
+		total += ni * ni;
+		for (l = -1; l <= 1; l += 2) {
+			if (peak_j + l < 0 || peak_j + l >= TS_COLS)
+				continue;
+			nj = matrix[peak_i][peak_j + l];
+			diff = matrix[peak_i + k][peak_j + l] - (ni * nj + at / 2) / at;
+			error += diff * diff;
+			total += matrix[peak_i + k][peak_j + l] *
+				matrix[peak_i + k][peak_j + l];
+		}
+	}
+	return ((unsigned long long)error << TS_RESIDUAL_SHIFT) / total;
+}
+
+int ts_localise(int localiser, unsigned char matrix[TS_ROWS][TS_COLS],
+	int peak_i, int peak_j, int radius, int *i, int *j)
+{
+	if (localiser < 0 || localiser >= TS_LOC_COUNT ||
+		localisers[localiser].fn == NULL)
+		return -1;
+	return localisers[localiser].fn(matrix, peak_i, peak_j, radius, i, j);
+}
+
+void ts_register_localiser(int localiser, ts_localise_fn fn)
+{
+	if (localiser > TS_LOC_AREA && localiser < TS_LOC_COUNT)
+		localisers[localiser].fn = fn;
+}
+
+const char *ts_localiser_name(int localiser)
+{
+	if (localiser < 0 || localiser >= TS_LOC_COUNT)
+		return NULL;
+	return localisers[localiser].name;
+}
+
+int ts_localiser_by_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < TS_LOC_COUNT; i++)
+		if (!strcmp(localisers[i].name, name))
+			return i;
+	return -1;
+}
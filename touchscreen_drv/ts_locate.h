@@ -0,0 +1,105 @@
+/*
+ * Peak finding and touch localisers shared by ts_srv and the levmar variant
+ * of it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+
+// Every localiser finds where a touch really is from the matrix around its
+// highest point.  Locations are in Q8 fixed point matrix points, row i and
+// column j, the same as LOC_SHIFT in ts_srv.  A driver may pick a different
+// localiser for every frame, or every touch.
+#define TS_ROWS 30
+#define TS_COLS 40
+#define TS_LOC_SHIFT 8
+
+enum ts_localiser {
+	// Centroid of the whole touch area.  Only the driver's own area scan
+	// knows the area so ts_localise() never does this one.
+	TS_LOC_AREA,
+	// Centroid of the window within radius of the peak, each point weighted
+	// by value ^ 1.5
+	TS_LOC_CENTROID,
+	// Parabola through the peak and its two neighbours on each axis, or the
+	// next two points in on the edge
+	TS_LOC_QUADRATIC,
+	// Parabola through the logs of the same points, exact for a gaussian
+	// touch.  ts_gaussian_residual() tells how gaussian a touch is.
+	TS_LOC_GAUSSIAN,
+	// Levenberg-Marquardt fit of a gaussian to the window, only there once
+	// it is registered by a driver that links liblevmar
+	TS_LOC_LM,
+	TS_LOC_COUNT
+};
+
+struct ts_peak {
+	int value;
+	int i;
+	int j;
+};
+
+// Returns 0 and the location in i and j, or -1 if the touch couldn't be
+// located this way.  radius is only used by the localisers that look at a
+// window around the peak.
+typedef int (*ts_localise_fn)(unsigned char matrix[TS_ROWS][TS_COLS],
+	int peak_i, int peak_j, int radius, int *i, int *j);
+
+// Weight of each matrix value for centroids, value ^ 1.5 in Q4.  ts_srv
+// weighs its touch areas with it too.
+#define TS_WEIGHT_SHIFT 4
+extern unsigned short ts_weight_table[256];
+
+// Builds the tables the localisers use, call once before anything else
+void ts_locate_init(void);
+
+// Finds every point above threshold that no neighbour is higher than, up to
+// max of them, strongest first.  Returns how many were found.
+int ts_find_peaks(unsigned char matrix[TS_ROWS][TS_COLS], int threshold,
+	struct ts_peak *peaks, int max);
+
+// Drops peaks closer than radius points on both axes to a stronger peak
+// that was kept, which are most likely the same touch, and keeps no more
+// than max.  peaks has to be strongest first.  Returns how many are left.
+int ts_select_peaks(struct ts_peak *peaks, int count, int radius, int max);
+
+// First row or column of a window of radius around peak that is moved to
+// stay inside a matrix that many points across
+int ts_window_start(int peak, int radius, int points);
+
+// How far the 3x3 points around a peak are from a gaussian through the
+// peak and its neighbours, as the sum of the squared differences in Q10 of
+// the sum of the squared values.  Touches that run into each other, or
+// aren't round, are further off.
+#define TS_RESIDUAL_SHIFT 10
+int ts_gaussian_residual(unsigned char matrix[TS_ROWS][TS_COLS],
+	int peak_i, int peak_j);
+
+// Locates the touch at peak_i, peak_j with localiser.  Returns -1 and
+// leaves i and j alone if the localiser isn't available or failed.
+int ts_localise(int localiser, unsigned char matrix[TS_ROWS][TS_COLS],
+	int peak_i, int peak_j, int radius, int *i, int *j);
+
+// Adds a localiser that lives outside this library, such as TS_LOC_LM
+void ts_register_localiser(int localiser, ts_localise_fn fn);
+
+// Name of a localiser and the localiser with a name, -1 if there is none
+const char *ts_localiser_name(int localiser);
+int ts_localiser_by_name(const char *name);
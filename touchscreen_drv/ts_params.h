@@ -0,0 +1,89 @@
+/*
+ * Layout of the parameter file that holds the tunable settings of ts_srv in
+ * named profiles.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+
+#include <linux/types.h>
+
+// ts_srv maps TS_PARAMS_FILE and takes its settings from the active profile.
+// Profile 0 is finger mode and profile 1 is stylus mode, the rest can be
+// created and named through the socket.  Anything that changes the file
+// increments generation once it is done.  ts_srv checks generation before
+// each frame and copies the whole active profile when it has changed, so a
+// frame is always processed with a single set of settings.
+//
+// A file with the wrong magic, version or size is replaced with the default
+// profiles.
+#define TS_PARAMS_FILE "/data/ts_params"
+#define TS_PARAMS_MAGIC 0x4D524150 // "PARM"
+#define TS_PARAMS_VERSION 4
+#define TS_PARAMS_PROFILES 4
+#define TS_PARAMS_NAME_LEN 16
+
+// See the defaults in ts_srv.c for what each of these does
+struct ts_params {
+	char name[TS_PARAMS_NAME_LEN];
+	__s32 touch_initial_thresh;
+	__s32 touch_continue_thresh;
+	__s32 touch_delay_thresh;
+	__s32 touch_delay_ms;
+	__s32 large_area_unpress;
+	__s32 large_area_fringe;
+	__s32 max_delta;
+	__s32 min_prev_delta;
+	__s32 max_delta_angle_tan;
+	__s32 debounce_radius;
+	__s32 hover_debounce_radius;
+	__s32 hover_debounce_ms;
+	__s32 debounce_max_speed;
+	__s32 avg_window_ms;
+	__s32 avg_half_life_ms;
+	__s32 predict_filter;
+	__s32 predict_ms;
+	__s32 predict_alpha;
+	__s32 predict_beta;
+	__s32 predict_frame_us;
+	__s32 optimal_tracking;
+	__s32 baseline_rate_shift;
+	__s32 baseline_noise_mult;
+	__s32 baseline_update_max;
+	__s32 baseline_init_frames;
+	__s32 liftoff_timeout;
+	__s32 pixels_per_point;
+	__s32 vsync_resample;
+	__s32 resample_latency_ms;
+	__s32 resample_max_predict_ms;
+	__s32 localiser;
+};
+
+struct ts_params_file {
+	__u32 magic;
+	__u32 version;
+	__u32 size;
+	// Index of the profile in use
+	volatile __u32 active;
+	volatile __u32 generation;
+	__u32 reserved;
+	// Profiles with an empty name are unused
+	struct ts_params profile[TS_PARAMS_PROFILES];
+};
@@ -0,0 +1,133 @@
+/*
+ * Parser for the packets the cypress ctma395 sends over the uart, shared by
+ * ts_srv and the levmar variant of it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+
+#include <string.h>
+
+#include "ts_parser.h"
+
+static int packet_len(const unsigned char *cline)
+{
+	// Length of the packet with this header, 0 if it can never complete
+	if (cline[1] == 0x43)
+		return 3 + TS_ROW_POINTS + 1;
+	if (cline[1] == 0x47 && cline[2] && cline[2] + 4 <= TS_PACKET_MAX)
+		return cline[2] + 4;
+	return 0;
+}
+
+static void resync(struct ts_parser *parser)
+{
+	parser->resyncs++;
+	parser->cidx = 0;
+}
+
+int ts_parse(struct ts_parser *parser, const unsigned char *bytes, int size)
+{
+	const unsigned char *end = bytes + size, *ff, *data;
+	int len, need, scan, ret = 0;
+
+	while (bytes < end) {
+		if (!parser->cidx) {
+			// Skip to the start of the next packet
+			ff = memchr(bytes, 0xFF, end - bytes);
+			if (ff == NULL) {
+				parser->skipped_bytes += end - bytes;
+				break;
+			}
+			parser->skipped_bytes += ff - bytes;
+			bytes = ff;
+			parser->cline[parser->cidx++] = *bytes++;
+			// Until a row arrives any packet may be the start of the frame
+			if (!parser->in_frame)
+				parser->frame_time = parser->read_time;
+		}
+
+		// The header is always kept in cline
+		while (parser->cidx < 3 && bytes < end && *bytes != 0xFF)
+			parser->cline[parser->cidx++] = *bytes++;
+		if (bytes == end)
+			break;
+		if (parser->cidx < 3) {
+			resync(parser);
+			continue;
+		}
+
+		len = packet_len(parser->cline);
+		if (!len) {
+			// Nothing to do but wait for the next packet
+			ff = memchr(bytes, 0xFF, end - bytes);
+			if (ff == NULL)
+				break;
+			bytes = ff;
+			resync(parser);
+			continue;
+		}
+
+		// The last byte may be 0xFF, any other 0xFF starts a new packet.
+		// A frame packet of 5 bytes is too short for that.
+		need = len - parser->cidx;
+		scan = len > 5 ? need - 1 : need;
+		if (scan > end - bytes)
+			scan = end - bytes;
+		ff = memchr(bytes, 0xFF, scan);
+		if (ff != NULL) {
+			bytes = ff;
+			resync(parser);
+			continue;
+		}
+		if (need > end - bytes) {
+			memcpy(parser->cline + parser->cidx, bytes, end - bytes);
+			parser->cidx += end - bytes;
+			break;
+		}
+
+		if (parser->cidx == 3) {
+			// The whole payload is in this buffer
+			data = bytes;
+		} else {
+			memcpy(parser->cline + parser->cidx, bytes, need);
+			data = parser->cline + 3;
+		}
+		bytes += need;
+		parser->cidx = 0;
+
+		if (parser->cline[1] == 0x43) {
+			parser->in_frame = 1;
+			parser->row(parser->cline[2] & 0x1F, data,
+				parser->cline[2] & 0x80);
+		} else {
+			ret += parser->frame();
+			parser->in_frame = 0;
+		}
+	}
+
+	return ret;
+}
+
+void ts_parser_reset(struct ts_parser *parser)
+{
+	parser->cidx = 0;
+	parser->in_frame = 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * Parser for the packets the cypress ctma395 sends over the uart, shared by
+ * ts_srv and the levmar variant of it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+
+// The touch screen sends each row of the matrix as a row packet and marks
+// the end of the frame with a frame packet:
+//   0xFF 0x43 row 40 bytes of data 1 more byte
+//   0xFF 0x47 len len bytes
+// The row number is in the low 5 bits, 0x80 is set on the first row of a
+// frame.  0xFF only ever starts a packet, except as the last byte of one.  A
+// 0xFF anywhere else means the touch screen aborted the packet.
+#define TS_PACKET_MAX 64
+#define TS_ROW_POINTS 40
+
+struct ts_parser {
+	// Called with the 40 data bytes of each row.  data points straight into
+	// the buffer passed to ts_parse unless the packet was split across reads.
+	void (*row)(int row, const unsigned char *data, int first);
+	// Called at the end of each frame, the results are summed by ts_parse
+	int (*frame)(void);
+	// Start of a packet that was cut off at the end of the last buffer
+	unsigned char cline[TS_PACKET_MAX];
+	unsigned int cidx;
+	// Bytes thrown away while looking for the start of a packet
+	unsigned int skipped_bytes;
+	// Packets that were cut short by the touch screen
+	unsigned int resyncs;
+	// Time the bytes being parsed were read, set by the caller before each
+	// call to ts_parse.  Any clock will do, 0 means unknown.
+	long long read_time;
+	// read_time of the bytes that started the current frame, valid in the
+	// frame callback
+	long long frame_time;
+	// Set once a row of the current frame has arrived
+	int in_frame;
+};
+
+// Parses size bytes read from the uart, packets may be split anywhere
+// between calls.  Returns the sum of what the frame callback returned.
+int ts_parse(struct ts_parser *parser, const unsigned char *bytes, int size);
+
+// Throws away any partial packet, used when the uart is reopened
+void ts_parser_reset(struct ts_parser *parser);
@@ -0,0 +1,365 @@
+/*
+ * This is a host tool that replays uart data captured by ts_srv through the
+ * same parsing and touch processing code that runs on the device and
+ * reports how long it took.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+/* Usage: ts_replay [-s] [-g] [-a] [-p name=value] [-v period] [-t]
+ *        [-n loops] [-d] capture_file
+ * -s = use the stylus thresholds instead of the finger thresholds
+ * -g = match tracking IDs greedily, to compare against the optimal matching
+ * -a = use the average filters instead of the predict filter
+ * -p = change a setting of the profile in use, can be given more than once
+ * -v = resample to a display with vsyncs this many microseconds apart
+ * -t = print ts_srv's own statistics after the run
+ * -n = replay the capture this many times for a more stable benchmark
+ * -d = print every event that would have gone to uinput after the run
+ *
+ * Record a capture by building ts_srv with UART_CAPTURE set to 1.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ts_capture.h"
+#include "ts_locate.h"
+#include "ts_replay.h"
+
+struct replay_event {
+	unsigned int frame;
+	struct input_event event;
+};
+
+// Memory sink that stands in for /dev/uinput
+struct replay_event *events;
+unsigned int event_count, event_alloc;
+
+// Processing time of each frame in nanoseconds
+long long *frame_times;
+unsigned int frame_count, frame_alloc;
+unsigned int touch_count;
+struct timespec frame_start;
+
+static void *grow(void *ptr, unsigned int *alloc, size_t size)
+{
+	*alloc = *alloc ? *alloc * 2 : 4096;
+	ptr = realloc(ptr, *alloc * size);
+	if (ptr == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+static long long elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000LL +
+		(end->tv_nsec - start->tv_nsec);
+}
+
+void replay_event(struct input_event *event)
+{
+	if (event_count == event_alloc)
+		events = grow(events, &event_alloc, sizeof(*events));
+	events[event_count].frame = frame_count;
+	events[event_count].event = *event;
+	event_count++;
+}
+
+void replay_frame_begin(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &frame_start);
+}
+
+void replay_frame_end(int tpc)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (frame_count == frame_alloc)
+		frame_times = grow(frame_times, &frame_alloc, sizeof(*frame_times));
+	frame_times[frame_count++] = elapsed_ns(&frame_start, &now);
+	touch_count += tpc;
+}
+
+static unsigned char *load_capture(const char *path, long *size)
+{
+	FILE *fp;
+	unsigned char *data;
+	struct ts_capture_header *header;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "Unable to open %s\n", path);
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	*size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	data = malloc(*size);
+	if (data == NULL || fread(data, 1, *size, fp) != (size_t)*size) {
+		fprintf(stderr, "Unable to read %s\n", path);
+		fclose(fp);
+		free(data);
+		return NULL;
+	}
+	fclose(fp);
+
+	header = (struct ts_capture_header *)data;
+	if (*size < (long)sizeof(*header) || header->magic != TS_CAPTURE_MAGIC ||
+		header->version != TS_CAPTURE_VERSION) {
+		fprintf(stderr, "%s is not a ts_srv capture file\n", path);
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+static int replay_capture(unsigned char *data, long size, double *span,
+	int vsync_period)
+{
+	// Feeds every record to ts_srv exactly like its main loop would.  With
+	// a vsync period the first vsync is at the first record.
+	long pos = sizeof(struct ts_capture_header);
+	struct ts_capture_record rec, first = { 0, 0, 0 };
+	int records = 0;
+	long long time;
+
+	while (pos + (long)sizeof(rec) <= size) {
+		memcpy(&rec, data + pos, sizeof(rec));
+		pos += sizeof(rec);
+		if (pos + rec.len > size) {
+			fprintf(stderr, "Truncated record at offset %ld\n", pos);
+			break;
+		}
+		time = rec.tv_sec * 1000000LL + rec.tv_nsec / 1000;
+		if (!records++) {
+			first = rec;
+			if (vsync_period)
+				set_vsync(time, vsync_period);
+		}
+
+		// The vsync timer would have fired before this was read
+		if (vsync_period)
+			process_vsync(time);
+		if (rec.len)
+			process_uart_data(data + pos, rec.len, time);
+		else
+			process_uart_timeout();
+		pos += rec.len;
+	}
+	if (records)
+		*span = (rec.tv_sec - first.tv_sec) +
+			((double)rec.tv_nsec - first.tv_nsec) / 1000000000.0;
+	return records;
+}
+
+static int cmp_times(const void *a, const void *b)
+{
+	long long ta = *(const long long *)a, tb = *(const long long *)b;
+	return (ta > tb) - (ta < tb);
+}
+
+static long long percentile(long long *sorted, unsigned int count, int pct)
+{
+	unsigned int idx;
+
+	if (!count)
+		return 0;
+	idx = (count - 1) * pct / 100;
+	return sorted[idx];
+}
+
+static void print_events(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < event_count; i++)
+		printf("%u %u %u %d\n", events[i].frame, events[i].event.type,
+			events[i].event.code, events[i].event.value);
+}
+
+static void print_stats(double span, int loops, struct timespec *start,
+	struct timespec *end)
+{
+	unsigned int i, reports = 0, mt_reports = 0, tracking_ids = 0;
+	unsigned int new_ids = 0;
+	int last_id = -1;
+	long long total = 0;
+	double wall = elapsed_ns(start, end) / 1000000000.0;
+
+	for (i = 0; i < event_count; i++) {
+		if (events[i].event.type == EV_SYN &&
+			events[i].event.code == SYN_REPORT)
+			reports++;
+		else if (events[i].event.type == EV_SYN &&
+			events[i].event.code == SYN_MT_REPORT)
+			mt_reports++;
+		else if (events[i].event.type == EV_ABS &&
+			events[i].event.code == ABS_MT_TRACKING_ID) {
+			tracking_ids++;
+			// Tracking IDs only ever count up so a higher ID is a new touch
+			if (events[i].event.value > last_id) {
+				last_id = events[i].event.value;
+				new_ids++;
+			}
+		}
+	}
+	for (i = 0; i < frame_count; i++)
+		total += frame_times[i];
+	qsort(frame_times, frame_count, sizeof(*frame_times), cmp_times);
+
+	printf("frames:          %u (%d loop(s))\n", frame_count, loops);
+	if (span > 0)
+		printf("capture rate:    %.1f frames/sec\n",
+			frame_count / loops / span);
+	printf("replay rate:     %.1f frames/sec (%.3f s wall)\n",
+		wall > 0 ? frame_count / wall : 0, wall);
+	printf("calc_point rate: %.1f frames/sec\n",
+		total ? frame_count * 1000000000.0 / total : 0);
+	printf("frame time ns:   avg %lld p50 %lld p90 %lld p99 %lld max %lld\n",
+		frame_count ? total / frame_count : 0,
+		percentile(frame_times, frame_count, 50),
+		percentile(frame_times, frame_count, 90),
+		percentile(frame_times, frame_count, 99),
+		percentile(frame_times, frame_count, 100));
+	printf("touches found:   %u\n", touch_count);
+	printf("tracking IDs:    %u started\n", new_ids);
+	printf("events:          %u total, %u SYN_REPORT, %u SYN_MT_REPORT, "
+		"%u ABS_MT_TRACKING_ID\n", event_count, reports, mt_reports,
+		tracking_ids);
+}
+
+int main(int argc, char** argv)
+{
+	int opt, loops = 1, stylus = 0, dump = 0, greedy = 0, average = 0;
+	int ts_stats = 0, i, nsettings = 0, vsync_period = 0;
+	char *settings[32], *value;
+	char stats_buf[1024];
+	unsigned char *data;
+	long size;
+	double span = 0;
+	struct timespec start, end;
+
+	while ((opt = getopt(argc, argv, "sgap:v:tn:d")) != -1) {
+		switch (opt) {
+			case 's':
+				stylus = 1;
+				break;
+			case 'g':
+				greedy = 1;
+				break;
+			case 'a':
+				average = 1;
+				break;
+			case 'p':
+				if (nsettings < 32)
+					settings[nsettings++] = optarg;
+				break;
+			case 'v':
+				vsync_period = atoi(optarg);
+				break;
+			case 't':
+				ts_stats = 1;
+				break;
+			case 'n':
+				loops = atoi(optarg);
+				break;
+			case 'd':
+				dump = 1;
+				break;
+			default:
+				optind = argc;
+				break;
+		}
+	}
+	if (optind != argc - 1 || loops < 1 || vsync_period < 0) {
+		printf("Usage: %s [-s] [-g] [-a] [-p name=value] [-v period] [-t] "
+			"[-n loops] [-d] capture_file\n", argv[0]);
+		printf("-s to use stylus mode thresholds\n");
+		printf("-g to use greedy tracking ID matching\n");
+		printf("-a to use the average filters\n");
+		printf("-p to change a setting, see ts_params.h for the names\n");
+		printf("-v to resample to vsyncs period microseconds apart\n");
+		printf("-t to print ts_srv statistics\n");
+		printf("-n to replay the capture more than once\n");
+		printf("-d to print the generated events\n");
+		return -1;
+	}
+
+	if (vsync_period && !replay_vsync_resample) {
+		fprintf(stderr, "ts_srv was built without VSYNC_RESAMPLE\n");
+		return -1;
+	}
+	if (ts_stats && !replay_stats) {
+		fprintf(stderr, "ts_srv was built without TS_STATS\n");
+		return -1;
+	}
+
+	data = load_capture(argv[optind], &size);
+	if (data == NULL)
+		return -1;
+
+	ts_locate_init();
+	init_stats();
+	init_params();
+	set_ts_mode(stylus);
+	if (greedy)
+		set_param(NULL, "optimal_tracking", 0);
+	if (average)
+		set_param(NULL, "predict_filter", 0);
+	if (vsync_period)
+		set_param(NULL, "vsync_resample", 1);
+	for (i = 0; i < nsettings; i++) {
+		value = strchr(settings[i], '=');
+		if (value)
+			*value++ = 0;
+		if (value == NULL || set_param(NULL, settings[i], atoi(value))) {
+			fprintf(stderr, "Invalid setting %s\n", settings[i]);
+			free(data);
+			return -1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < loops; i++) {
+		// Start every loop from the same state ts_srv starts in
+		liftoff();
+		clear_arrays();
+		replay_capture(data, size, &span, vsync_period);
+		process_uart_timeout();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (dump)
+		print_events();
+	print_stats(span, loops, &start, &end);
+	if (ts_stats) {
+		format_stats(stats_buf, sizeof(stats_buf));
+		printf("%s", stats_buf);
+	}
+	free(data);
+	return 0;
+}
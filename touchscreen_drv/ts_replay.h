@@ -0,0 +1,65 @@
+/*
+ * Interface between ts_srv.c and the ts_replay host tool.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+#include <linux/input.h>
+
+// When ts_srv.c is built with TS_REPLAY=1 its main() is left out and every
+// event that would have been written to uinput is handed to replay_event()
+// instead.  replay_frame_begin() and replay_frame_end() bracket each call to
+// calc_point() so the replay tool can time the per-frame processing.
+void replay_event(struct input_event *event);
+void replay_frame_begin(void);
+void replay_frame_end(int tpc);
+
+// Entry points in ts_srv.c used by the replay tool.  These are the same
+// functions main() uses so a replay follows the exact path the device does.
+void clear_arrays(void);
+void liftoff(void);
+void set_ts_mode(int mode);
+void process_uart_timeout(void);
+// time is when the bytes were read in microseconds, the capture has it.
+// With THREADED_UART each frame goes through the reader's frame handover
+// and process_uart_frame() as it completes, like on the device, only no
+// frame is ever dropped.
+int process_uart_data(unsigned char *bytes, int nbytes, long long time);
+
+// Loads the default profiles without a parameter file.  set_param() changes
+// a setting of the active profile when profile is NULL, see ts_params.h for
+// the names.  It returns -1 for an unknown setting or a value out of range.
+void init_params(void);
+int set_param(const char *profile, const char *name, int value);
+
+// Starts resampling to vsyncs at time, period microseconds apart.
+// process_vsync() sends a report that is waiting for a vsync if the vsync is
+// at or before now.  Both do nothing when replay_vsync_resample is 0
+// because ts_srv.c was built without VSYNC_RESAMPLE.
+extern const int replay_vsync_resample;
+void set_vsync(long long time, int period);
+void process_vsync(long long now);
+
+// Clears ts_srv's statistics.  format_stats() formats them the same way the
+// T socket command does.  Neither does anything when replay_stats is 0
+// because ts_srv.c was built without TS_STATS.
+extern const int replay_stats;
+void init_stats(void);
+int format_stats(char *buf, int len);
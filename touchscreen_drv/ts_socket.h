@@ -0,0 +1,83 @@
+/*
+ * Control protocol spoken over /dev/socket/tsdriver by ts_srv and its clients,
+ * ts_srv_set and the power HAL.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+
+#include <linux/types.h>
+
+#define TS_SOCKET_LOCATION "/dev/socket/tsdriver"
+
+// Clients connect once and keep the connection open.  Every request is a
+// ts_msg header followed by len bytes of payload.  ts_srv answers every
+// request with a reply that has the same cmd and id, the status of the
+// request and any data that goes with it.  Replies come back in the order
+// the requests were sent.
+//
+// A connection that starts with anything other than TS_MSG_MAGIC is taken
+// to be an old client sending single byte commands.  Only O, C, F, S, M
+// and T are carried out for it, M and T are answered with just their data
+// and everything else gets no answer.
+#define TS_MSG_MAGIC 0xA5
+#define TS_MSG_MAX_PAYLOAD 1024
+
+struct ts_msg {
+	__u8 magic;
+	__u8 cmd;
+	// Picked by the client, copied into the reply
+	__u16 id;
+	// 0 in requests
+	__u16 status;
+	// Bytes of payload that follow the header
+	__u16 len;
+};
+
+// Commands
+#define TS_CMD_OPEN 'O' // Open the uart and power on the digitizer
+#define TS_CMD_CLOSE 'C' // Close the uart and power off the digitizer
+#define TS_CMD_FINGER 'F' // Set finger mode
+#define TS_CMD_STYLUS 'S' // Set stylus mode
+#define TS_CMD_MODE 'M' // Reply has 1 byte, 0 for finger and 1 for stylus mode
+#define TS_CMD_STATS 'T' // Reply has the statistics as text ending with a 0
+// Reply carries the fd of the heatmap ring in an SCM_RIGHTS message, see
+// ts_heatmap.h
+#define TS_CMD_HEATMAP 'H'
+// Payload is empty to list the profiles, the active one is marked with a *,
+// or the name of a profile to get all of its settings.  Reply is text ending
+// with a 0.  See ts_params.h.
+#define TS_CMD_PROFILES 'P'
+// Payload is "profile setting value" as text.  A new profile name creates
+// the profile as a copy of the active one.
+#define TS_CMD_WRITE_PARAM 'W'
+// Payload is the name of the profile to use from the next frame on
+#define TS_CMD_USE_PROFILE 'U'
+// Payload is "time period" as text, the CLOCK_MONOTONIC time of a vsync and
+// the time between vsyncs, both in microseconds.  A period of 0 stops
+// resampling to the display.  Only needs to be sent again when the display
+// timing changes, see vsync_resample in ts_srv.c.
+#define TS_CMD_VSYNC 'V'
+
+// Reply status
+#define TS_MSG_OK 0
+#define TS_MSG_UNKNOWN 1 // Unknown command
+#define TS_MSG_BAD_REQUEST 2 // Payload too long or not what the command takes
+#define TS_MSG_UNAVAILABLE 3 // Not built into this ts_srv
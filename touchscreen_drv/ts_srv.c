@@ -44,11 +44,38 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
 #include "digitizer.h"
+#include "ts_parser.h"
+#include "ts_locate.h"
+#include "ts_track.h"
+#include "ts_events.h"
+#include "ts_socket.h"
+#include "ts_heatmap.h"
+#include "ts_params.h"
+#if !TS_REPLAY
+#include <cutils/ashmem.h>
+#endif
+#include "ts_capture.h"
+#if TS_REPLAY
+#include "ts_replay.h"
+#endif
 
 #if 1
 // This is for Android
@@ -57,8 +84,8 @@
 // This is for webos and possibly other Linuxes
 #define UINPUT_LOCATION "/dev/input/uinput"
 #endif
+#define UART_LOCATION "/dev/ctp_uart"
 
-#define TS_SOCKET_LOCATION "/dev/socket/tsdriver"
 // Set to 1 to enable socket debug information
 #define DEBUG_SOCKET 0
 
@@ -75,20 +102,79 @@
 // A value of 2 should remove most unwanted output
 #define RAW_DATA_THRESHOLD 0
 
+// Set to 1 to keep counters and histograms of what ts_srv is doing.  They
+// can be read with the T socket command.
+#define TS_STATS 1
+#define STATS_BUCKETS 24
+
 // Set to 1 to see event logging
 #define EVENT_DEBUG 0
 // Set to 1 to enable tracking ID logging
 #define TRACK_ID_DEBUG 0
 
+// Set to 1 to track the baseline and noise level of each point in the matrix
+// on frames with no touches.  The baseline is taken off every point before
+// any thresholds are applied, and points that are no further above it than
+// a multiple of the noise are zeroed.  The thresholds keep their meaning on
+// a clean screen while offsets and noise are kept out of the touches.
+#define BASELINE_TRACKING 1
+// Baselines and noise levels are stored in Q8, anything coarser loses the
+// small steps of the noise level to rounding
+#define BASELINE_SHIFT 8
+// The baseline and noise move 1 / 2^n of the way to the current frame on
+// each frame with no touches
+#define BASELINE_RATE_SHIFT 5
+// Frames used to learn the baseline when the uart is opened.  Nothing is
+// reported for these frames and they are used even if something is touching
+// the screen, otherwise an offset that is there from the start would look
+// like a touch forever and never be learned.
+#define BASELINE_INIT_FRAMES 8
+#define BASELINE_INIT_SHIFT 2
+// Points no more than this many noise levels above the baseline are zeroed
+#define BASELINE_NOISE_MULT 3
+// Frames with any point further than this above its baseline, once past the
+// noise gate, are not used to update the baseline, something may be
+// approaching the screen
+#define BASELINE_UPDATE_MAX 8
+
+// Set to 1 to find touch areas as each row of the matrix arrives instead of
+// waiting for the whole frame.
+#define ROW_STREAMING 1
+
+// Set to 1 to read the uart on its own thread.  The reader assembles whole
+// frames and hands them to the main loop so the uart keeps being drained
+// while a slow frame is processed on the other core.  If the main loop falls
+// behind, stale frames are dropped in favour of the newest one.  Rows are
+// only streamed into the touch areas once the main loop takes the frame.
+#define THREADED_UART 1
+
+// Set to 1 to record everything read from the uart to UART_CAPTURE_FILE.
+// The capture can be played back on a Linux box with ts_replay.
+#define UART_CAPTURE 0
+#define UART_CAPTURE_FILE "/data/ts_capture.bin"
+
+// Set to 1 to let clients map a ring of the latest frames and their touches
+// with the H socket command.  Nothing is copied until a client asks for it.
+#define HEATMAP_TAP 1
+#define HEATMAP_NAME "ts_srv heatmap"
+
 #define AVG_FILTER 1
 
 #define USERSPACE_270_ROTATE 0
 
 #define RECV_BUF_SIZE 1540
+// Time in microseconds after the last frame with touches that we lift off
 #define LIFTOFF_TIMEOUT 25000
-#define SOCKET_BUFFER_SIZE 10
+#define MAX_EPOLL_EVENTS 8
+// Clients that can be connected to the socket at once
+#define MAX_SOCKET_CLIENTS 8
+
+#define MAX_TOUCH TS_MAX_TOUCH // Max touches that will be reported
 
-#define MAX_TOUCH 10 // Max touches that will be reported
+// Set to 1 to match touches to the previous frame with the smallest total
+// distance instead of matching each touch to its closest previous touch.
+// Can be switched at runtime with the optimal_tracking parameter.
+#define OPTIMAL_TRACKING 1
 
 #define MAX_DELTA_FILTER 1 // Set to 1 to use max delta filtering
 // This value determines when a large distance change between one touch
@@ -102,27 +188,33 @@
 // This value is in pixels.
 #define MIN_PREV_DELTA 40
 // This is the angle, plus or minus that the previous direction must have
-// been traveling.  This angle is an arctangent. (atan2)
-#define MAX_DELTA_ANGLE 0.25
+// been traveling.  It is stored as the tangent of the angle in Q10 fixed
+// point so that it can be compared against integer cross and dot products
+// of the two directions.  261 is tan(0.25 radians) * 1024.
+#define MAX_DELTA_ANGLE_TAN 261
 #define MAX_DELTA_DEBUG 0 // Set to 1 to see debug logging for max delta
 
 // Any touch above this threshold is immediately reported to the system
 #define TOUCH_INITIAL_THRESHOLD 32
-int touch_initial_thresh = TOUCH_INITIAL_THRESHOLD;
 // Previous touches that have already been reported will continue to be
 // reported so long as they stay above this threshold
 #define TOUCH_CONTINUE_THRESHOLD 26
-int touch_continue_thresh = TOUCH_CONTINUE_THRESHOLD;
 // New touches above this threshold but below TOUCH_INITIAL_THRESHOLD will not
 // be reported unless the touch continues to appear.  This is designed to
 // filter out brief, low threshold touches that may not be valid.
 #define TOUCH_DELAY_THRESHOLD 28
-int touch_delay_thresh = TOUCH_DELAY_THRESHOLD;
-// Delay before a touch above TOUCH_DELAY_THRESHOLD but below
+// Delay in milliseconds before a touch above TOUCH_DELAY_THRESHOLD but below
 // TOUCH_INITIAL_THRESHOLD will be reported.  We will wait and see if this
 // touch continues to show up in future buffers before reporting the event.
-#define TOUCH_DELAY 5
-int touch_delay_count = TOUCH_DELAY;
+// These are half a frame short of whole frames at 100 frames per second so a
+// frame that comes a little early doesn't add a frame of delay.
+#if BASELINE_TRACKING
+// Offsets and noise are already gated by the baseline tracking so touches
+// near the threshold don't need to be held back as long.
+#define TOUCH_DELAY_MS 15
+#else
+#define TOUCH_DELAY_MS 45
+#endif
 // Threshold for end of a large area. This value needs to be set low enough
 // to filter out large touch areas and tends to be related to other touch
 // thresholds.
@@ -133,7 +225,7 @@ int touch_delay_count = TOUCH_DELAY;
 #define TOUCH_INITIAL_THRESHOLD_S  32
 #define TOUCH_CONTINUE_THRESHOLD_S 16
 #define TOUCH_DELAY_THRESHOLD_S    24
-#define TOUCH_DELAY_S               2
+#define TOUCH_DELAY_MS_S           15
 
 // Enables filtering of a single touch to make it easier to long press.
 // Keeps the initial touch point the same so long as it stays within
@@ -145,18 +237,82 @@ int touch_delay_count = TOUCH_DELAY;
 // Enables filtering after swiping to prevent the slight jitter that
 // sometimes happens while holding your finger still.  The radius is
 // really a square. We don't start debouncing a hover unless the touch point
-// stays within the radius for the number of cycles defined by
-// HOVER_DEBOUNCE_DELAY
+// stays within the radius for HOVER_DEBOUNCE_MS
 #define HOVER_DEBOUNCE_FILTER 1 // Set to 1 to enable hover debounce
 #define HOVER_DEBOUNCE_RADIUS 2 // Radius for hover debounce in pixels
-#define HOVER_DEBOUNCE_DELAY 30 // Count of delay before we start debouncing
+#define HOVER_DEBOUNCE_MS 300 // Time in the radius before we start debouncing
 #define HOVER_DEBOUNCE_DEBUG 0 // Set to 1 to enable hover debounce logging
 
+// A touch moving faster than this many pixels per second is let go by the
+// debounce and hover debounce filters even while it is inside their radius,
+// so a drag starts moving straight away.  The speed is taken over
+// AVG_WINDOW_MS so the jitter of a touch that is held still doesn't count.
+// 0 turns this off.
+#define DEBOUNCE_MAX_SPEED 500
+
+// The average filter weighs the locations of a touch over the last
+// AVG_WINDOW_MS, the weight halving every AVG_HALF_LIFE_MS.  When the scan
+// rate drops fewer frames are averaged instead of lagging further behind.
+#define AVG_WINDOW_MS 25
+#define AVG_HALF_LIFE_MS 10
+
+// Number of frames of touches that are kept for the filters.  The filters
+// look back through them by time so this only has to cover AVG_WINDOW_MS
+// at the fastest scan rate.
+#define TOUCH_HISTORY 8
+
+// Replaces the average, debounce and hover debounce filters with a filter
+// that tracks the speed of each touch and reports where it is going to be
+// PREDICT_MS from now to make up for the time it takes to get the touch to
+// the screen.  Touches are still debounced and hover debounced using the
+// radius and delay settings above.  Can be switched at runtime with the
+// predict_filter parameter.
+#define PREDICT_FILTER 1
+#define PREDICT_MS 8 // How far ahead to report touches in milliseconds
+// Time between frames in microseconds.  Only used when the frames have no
+// times, the speed of a touch is kept per this much time either way.
+#define PREDICT_FRAME_US 10000
+// Gains of the filter in Q8.  Alpha is how much of the difference between
+// the expected and the measured location goes to the location and beta how
+// much goes to the speed.  beta = alpha^2 / (2 - alpha) is critically
+// damped so it doesn't overshoot when the finger stops.
+#define PREDICT_SHIFT 8
+#define PREDICT_ALPHA 154 // 0.6
+#define PREDICT_BETA   66 // 0.257
+
+// Set to 1 to send the time the first byte of each frame was read from the
+// uart as MSC_TIMESTAMP before every SYN_REPORT for that frame, so the
+// framework gets the real sample time instead of the time of the write to
+// uinput.  The value is in microseconds and wraps like the kernel's does.
+#define MSC_TIMESTAMPS 1
+
+// Set to 1 to build in resampling to the display.  While the vsync_resample
+// parameter is on and the framework has sent the vsync time and period with
+// TS_CMD_VSYNC, moving touches are reported once per display frame, moved to
+// where they were RESAMPLE_LATENCY_MS before the vsync.  The location comes
+// from the two frames around that time, or is extrapolated from the last two
+// frames by no more than RESAMPLE_MAX_PREDICT_MS.  Touching down and lifting
+// off are still reported as soon as the frame comes in so taps don't wait.
+#define VSYNC_RESAMPLE 1
+#define RESAMPLE_LATENCY_MS 5
+#define RESAMPLE_MAX_PREDICT_MS 8
+
 // This is used to help calculate ABS_TOUCH_MAJOR
 // This is roughly the value of 1024 / 40 or 768 / 30
 #define PIXELS_PER_POINT 25
 
-// This enables slots for the type B multi-touch protocol.
+// Localiser that finds the center of each touch, see ts_locate.h.
+// TS_LOC_AREA is the centroid of the whole touch area, the others only look
+// at the points within LOCALISER_RADIUS of the highest point so touches that
+// run into each other don't pull on each other.  TS_LOC_LM isn't built into
+// ts_srv and falls back to the area centroid.  Can be switched at runtime
+// with the localiser parameter.
+#define LOCALISER TS_LOC_AREA
+#define LOCALISER_RADIUS 2
+
+// This enables slots for the type B multi-touch protocol.  Only the values
+// of a touch that changed since the last frame are sent, so touches that
+// aren't moving cost nothing.
 // The kernel must support slots (ABS_MT_SLOT). The TouchPad 2.6.35 kernel
 // doesn't seem to handle liftoffs with protocol B properly so leave it off
 // for now.
@@ -166,9 +322,6 @@ int touch_delay_count = TOUCH_DELAY;
 #define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
 #define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
 #define isBetween(A, B, C) ( ((A-B) > 0) && ((A-C) < 0) )
-// We square MAX_DELTA to prevent the need to use sqrt
-#define MAX_DELTA_SQ (MAX_DELTA * MAX_DELTA)
-#define MIN_PREV_DELTA_SQ (MIN_PREV_DELTA * MIN_PREV_DELTA)
 
 #define X_AXIS_POINTS  30
 #define Y_AXIS_POINTS  40
@@ -178,25 +331,57 @@ int touch_delay_count = TOUCH_DELAY;
 #if USERSPACE_270_ROTATE
 #define X_RESOLUTION  768
 #define Y_RESOLUTION 1024
-#define X_LOCATION_VALUE ((float)X_RESOLUTION) / ((float)X_AXIS_MINUS1)
-#define Y_LOCATION_VALUE ((float)Y_RESOLUTION) / ((float)Y_AXIS_MINUS1)
 #else
 #define X_RESOLUTION 1024
 #define Y_RESOLUTION  768
-#define X_LOCATION_VALUE ((float)X_RESOLUTION) / ((float)Y_AXIS_MINUS1)
-#define Y_LOCATION_VALUE ((float)Y_RESOLUTION) / ((float)X_AXIS_MINUS1)
 #endif // USERSPACE_270_ROTATE
 
+// Matrix locations are kept in Q8 fixed point (1/256th of a point).
+#define LOC_SHIFT 8
+// Convert a Q8 matrix location in to pixels, rounding down or up.
+#define LOC_TO_PIXELS(loc, res, points) \
+	(((loc) * (res)) / ((points) << LOC_SHIFT))
+#define LOC_TO_PIXELS_UP(loc, res, points) \
+	(((loc) * (res) + ((points) << LOC_SHIFT) - 1) / ((points) << LOC_SHIFT))
+
 #define X_RESOLUTION_MINUS1 X_RESOLUTION - 1
 #define Y_RESOLUTION_MINUS1 Y_RESOLUTION - 1
 
+// Flags for the points in area_stack.  Fringe points are only added to the
+// weight of a touch and counted points are already part of it.
+#define AREA_FRINGE_FLAG  0x8000
+#define AREA_COUNTED_FLAG 0x4000
+#define AREA_POINT_MASK   0x3FFF
+
+struct touch_area {
+	// Sum of the weights of all points in the touch, each weight rounded
+	// down to a whole number.  This is also used as the pressure.
+	unsigned int weight;
+	// First and second moments of the Q4 weights, used for the center point
+	// and the shape of the touch.
+	unsigned int isum;
+	unsigned int jsum;
+	unsigned long long iisum;
+	unsigned long long jjsum;
+	unsigned long long ijsum;
+	// Bounding box of the touch, not including the fringe
+	int mini;
+	int maxi;
+	int minj;
+	int maxj;
+	// The highest value in the touch and where it was found
+	int highest_val;
+	int peak_i;
+	int peak_j;
+};
+
 struct touchpoint {
 	// Power or weight of the touch, used for calculating the center point.
 	int pw;
 	// These store the average of the locations in the digitizer matrix that
-	// make up the touch.  Used for calculating the center point.
-	float i;
-	float j;
+	// make up the touch in Q8.  Used for calculating the center point.
+	int i;
+	int j;
 #if USE_B_PROTOCOL
 	// Slot used for the B protocol touch events.
 	int slot;
@@ -207,7 +392,8 @@ struct touchpoint {
 	int prev_loc;
 #if MAX_DELTA_FILTER
 	// Direction and distance between this touch and the previous touch.
-	float direction;
+	int dir_x;
+	int dir_y;
 	int distance;
 #endif
 	// Size of the touch area.
@@ -221,40 +407,352 @@ struct touchpoint {
 	int unfiltered_y;
 	// The highest value found in the digitizer matrix of this touch area.
 	int highest_val;
-	// Delay count for touches that do not have a very high highest_val.
+	// Microseconds left before a touch that does not have a very high
+	// highest_val is reported.
 	int touch_delay;
 #if HOVER_DEBOUNCE_FILTER
-	// Location that we are tracking for hover debounce
+	// Location that we are tracking for hover debounce and the microseconds
+	// left before it starts
 	int hover_x;
 	int hover_y;
 	int hover_delay;
 #endif
+#if PREDICT_FILTER
+	// Estimated location in Q8 pixels and speed in Q8 pixels per
+	// predict_frame_us
+	int est_x;
+	int est_y;
+	int vel_x;
+	int vel_y;
+	// Touch down location while the touch is being debounced
+	int debounce_x;
+	int debounce_y;
+#endif
 };
 
-// This array contains the current touches (tpoint), previous touches
-// (prevtpoint) and the touches from 2 times ago (prev2tpoint)
-struct touchpoint tp[3][MAX_TOUCH];
-// These indexes locate the appropriate set of touches in tp
-int tpoint, prevtpoint, prev2tpoint;
+// This ring contains the touches of the last TOUCH_HISTORY frames, the
+// current touches are at tpoint and the previous touches at prevtpoint.  The
+// prev_loc of a touch is its index in the set before.
+struct touchpoint tp[TOUCH_HISTORY][MAX_TOUCH];
+int tpoint, prevtpoint;
+// Filter clock time of each set of touches in tp
+long long tp_time[TOUCH_HISTORY];
+#if VSYNC_RESAMPLE
+// CLOCK_MONOTONIC time in microseconds of each set of touches in tp
+long long tp_sample_time[TOUCH_HISTORY];
+#endif
 
-// Used for reading data from the digitizer
-unsigned char cline[64];
-// Index used for cline
-unsigned int cidx = 0;
+// Settings used for the current frame.  The defines above are the defaults
+// of the finger and stylus profiles, see ts_params.h.
+struct ts_params params;
+// We square max_delta to prevent the need to use sqrt
+int max_delta_sq, min_prev_delta_sq;
+// The mapped parameter file, or params_store if it couldn't be mapped
+struct ts_params_file params_store;
+struct ts_params_file *params_file = &params_store;
+// Generation of params_file that params was copied from
+unsigned int params_generation;
+void check_params(void);
+
+// Used for reading data from the digitizer, each row goes to consume_row
+// and the end of each frame to consume_frame
+void consume_row(int row, const unsigned char *data, int first);
+int parsed_frame(void);
+#if THREADED_UART
+// The uart reader thread hands frames to process_uart_frame instead
+void reader_row(int row, const unsigned char *data, int first);
+int reader_frame(void);
+int process_uart_frame(void);
+#if UART_CAPTURE && !TS_REPLAY
+void reader_capture_timeout(void);
+#endif
+#endif
+struct ts_parser uart_parser = {
+#if THREADED_UART && TS_REPLAY
+	// The replay has no reader thread but hands frames over the same way
+	.row = reader_row,
+	.frame = reader_frame,
+#else
+	.row = consume_row,
+	.frame = parsed_frame,
+#endif
+};
+// CLOCK_MONOTONIC time in microseconds that the first byte of the frame
+// being processed was read, 0 while there is no frame
+long long frame_time;
+long long last_frame_time;
+// Microseconds since the frame before, used by the time based filters
+int frame_dt;
+// Advances by frame_dt every frame, so it keeps going without frame times
+long long filter_time;
+#if VSYNC_RESAMPLE
+// Time of a vsync and the display frame period in microseconds as sent by
+// the framework.  A period of 0 means there is nothing to resample to.
+long long vsync_time;
+int vsync_period;
+// Set while the touches of the last frame are waiting for resample_next
+int resample_pending;
+long long resample_next;
+int resample_timer_fd = -1;
+// Number of touches in the last frame and tracking IDs of the touches that
+// were in the last report
+int resample_tpc;
+int resample_ids[MAX_TOUCH];
+int resample_count;
+#endif
 // Contains all of the data from the digitizer
 unsigned char matrix[X_AXIS_POINTS][Y_AXIS_POINTS];
-// Indicates if a point in the digitizer matrix has already been scanned.
-int invalid_matrix[X_AXIS_POINTS][Y_AXIS_POINTS];
+// Label of the touch that each point in the digitizer matrix belongs to.
+// Only labels above label_base belong to the current frame.
+unsigned short area_label[X_AXIS_POINTS][Y_AXIS_POINTS];
+unsigned int label_base = 0;
+// Points still to be checked while finding a touch area
+unsigned short area_stack[X_AXIS_POINTS * Y_AXIS_POINTS];
+#if ROW_STREAMING
+// Groups of connected points at or above LARGE_AREA_UNPRESS in the rows of
+// the frame received so far.  Groups that join up are merged with
+// union-find.  There can't be more than one new group for every other
+// point.
+#define MAX_STREAM_LABELS (X_AXIS_POINTS * Y_AXIS_POINTS / 2)
+struct stream_label {
+	unsigned short parent;
+	unsigned char taken;
+	struct touch_area area;
+};
+struct stream_label stream_labels[MAX_STREAM_LABELS];
+unsigned int stream_label_count;
+// Label + 1 of each point in the rows received so far, 0 if none
+unsigned short stream_point[X_AXIS_POINTS][Y_AXIS_POINTS];
+// Next row we expect to receive, -1 if this frame can't be streamed
+int stream_next_row = -1;
+// Rows with a point above stream_thresh
+unsigned int stream_active_rows;
+int stream_thresh;
+#endif
+#if BASELINE_TRACKING
+// Matrix as it came from the uart
+unsigned char raw_matrix[X_AXIS_POINTS][Y_AXIS_POINTS];
+// Baseline and noise level of each point in Q8
+unsigned short baseline[X_AXIS_POINTS][Y_AXIS_POINTS];
+unsigned short noise[X_AXIS_POINTS][Y_AXIS_POINTS];
+// Amount taken off each point, the baseline, and how far above it a point
+// has to be to count, BASELINE_NOISE_MULT * noise
+unsigned char baseline_level[X_AXIS_POINTS][Y_AXIS_POINTS];
+unsigned char baseline_gate[X_AXIS_POINTS][Y_AXIS_POINTS];
+// Frames seen since the baseline was reset
+int baseline_frames;
+#endif
 // File descriptor for uinput device
 int uinput_fd;
+#ifndef MSC_TIMESTAMP
+// Older kernel headers don't have it
+#define MSC_TIMESTAMP 0x05
+#endif
+// Can be changed on the command line, ts_emu points these at a pty and a pipe
+const char *uart_location = UART_LOCATION;
+const char *uinput_location = UINPUT_LOCATION;
+// Set once touches have been reported so that we know to send a liftoff
+int need_liftoff = 0;
+#if UART_CAPTURE
+// File descriptor for the uart capture file
+int capture_fd = -1;
+#endif
+// Events for the current frame that haven't been written to uinput yet.
+// Protocol B can lift off every slot and then report every touch in one
+// frame.
+#if TS_REPLAY
+struct ts_events uevents = { .sink = replay_event };
+// Lets ts_replay refuse options for parts that aren't built in
+const int replay_vsync_resample = VSYNC_RESAMPLE;
+const int replay_stats = TS_STATS;
+#else
+struct ts_events uevents;
+#endif
 #if USE_B_PROTOCOL
 // Indicates which slots are in use
 int slot_in_use[MAX_TOUCH];
+// Values last sent for each slot, -1 if nothing has been sent
+struct slot_state {
+	int tracking_id;
+	int touch_major;
+	int x;
+	int y;
+	int pw;
+} slot_sent[MAX_TOUCH];
+// Slot that was last selected with ABS_MT_SLOT, -1 if none yet
+int current_slot = -1;
+#endif
+long long monotonic_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+#if TS_STATS
+struct ts_stats {
+	struct timespec start;
+	struct timespec first_frame;
+	struct timespec last_frame;
+	struct timespec frame_start;
+	unsigned int uart_reads;
+	unsigned int uart_bytes;
+	unsigned int frames;
+	// Frames the uart reader replaced before the main loop could take them
+	unsigned int dropped_frames;
+	unsigned int liftoffs;
+	unsigned int tracking_ids;
+	// Tracking IDs started while other touches were already down
+	unsigned int tracking_id_churn;
+	unsigned int read_bytes[STATS_BUCKETS];
+	unsigned int frame_interval_us[STATS_BUCKETS];
+	unsigned int calc_point_ns[STATS_BUCKETS];
+	// From the first byte of a frame being read to its events being written
+	unsigned int frame_latency_us[STATS_BUCKETS];
+	unsigned int touches[MAX_TOUCH + 1];
+} stats;
+#endif
+
+#if TS_STATS
+long long stats_elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000LL +
+		(end->tv_nsec - start->tv_nsec);
+}
+
+void init_stats(void)
+{
+	// Called before the uart reader thread is started
+	memset(&stats, 0, sizeof(stats));
+	clock_gettime(CLOCK_MONOTONIC, &stats.start);
+}
+
+void stats_add(unsigned int *hist, unsigned long long value)
+{
+	// Bucket 0 counts zeros and bucket n counts values from 2^(n-1) up to
+	// 2^n - 1.  Anything bigger goes in the last bucket.
+	int bucket = 0;
+
+	while (value && bucket < STATS_BUCKETS - 1) {
+		value >>= 1;
+		bucket++;
+	}
+	// The uart reader thread adds to read_bytes
+	__sync_fetch_and_add(&hist[bucket], 1);
+}
+
+void stats_frame_begin(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &stats.frame_start);
+	if (stats.frames)
+		stats_add(stats.frame_interval_us, stats_elapsed_ns(
+			&stats.last_frame, &stats.frame_start) / 1000);
+	else
+		stats.first_frame = stats.frame_start;
+	stats.last_frame = stats.frame_start;
+}
+
+void stats_frame_end(int tpc)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stats_add(stats.calc_point_ns, stats_elapsed_ns(&stats.frame_start,
+		&now));
+#if !TS_REPLAY
+	// Replayed frames have the time they were captured
+	if (frame_time)
+		stats_add(stats.frame_latency_us, now.tv_sec * 1000000LL +
+			now.tv_nsec / 1000 - frame_time);
 #endif
+	stats.touches[tpc]++;
+	stats.frames++;
+}
+
+int format_hist(char *buf, int len, const char *name, unsigned int *hist,
+	int buckets)
+{
+	// Prints the name and the count in every bucket up to the last one that
+	// isn't empty
+	int i, last = 0, used;
+
+	for (i = 0; i < buckets; i++)
+		if (hist[i])
+			last = i + 1;
+	used = snprintf(buf, len, "%s", name);
+	for (i = 0; i < last && used < len; i++)
+		used += snprintf(buf + used, len - used, " %u", hist[i]);
+	if (used < len)
+		used += snprintf(buf + used, len - used, "\n");
+	return used;
+}
+
+int format_stats(char *buf, int len)
+{
+	// Formats the statistics as text with one "name value..." per line.
+	// Histograms named _log2 are in power of 2 buckets, see stats_add.
+	struct timespec now;
+	long long uptime_ms, frames_ms;
+	int used;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uptime_ms = stats_elapsed_ns(&stats.start, &now) / 1000000;
+	frames_ms = stats_elapsed_ns(&stats.first_frame, &stats.last_frame) /
+		1000000;
+	used = snprintf(buf, len,
+		"uptime_ms %lld\n"
+		"uart_reads %u\n"
+		"uart_bytes %u\n"
+		"skipped_bytes %u\n"
+		"resyncs %u\n"
+		"frames %u\n"
+		"dropped_frames %u\n"
+		"fps %lld\n"
+		"liftoffs %u\n"
+		"tracking_ids %u\n"
+		"tracking_id_churn %u\n",
+		uptime_ms, stats.uart_reads, stats.uart_bytes,
+		uart_parser.skipped_bytes, uart_parser.resyncs, stats.frames, stats.dropped_frames,
+		frames_ms ? (stats.frames - 1) * 1000LL / frames_ms : 0,
+		stats.liftoffs, stats.tracking_ids, stats.tracking_id_churn);
+	if (used < len)
+		used += format_hist(buf + used, len - used, "read_bytes_log2",
+			stats.read_bytes, STATS_BUCKETS);
+	if (used < len)
+		used += format_hist(buf + used, len - used, "frame_interval_us_log2",
+			stats.frame_interval_us, STATS_BUCKETS);
+	if (used < len)
+		used += format_hist(buf + used, len - used, "calc_point_ns_log2",
+			stats.calc_point_ns, STATS_BUCKETS);
+	if (used < len)
+		used += format_hist(buf + used, len - used, "frame_latency_us_log2",
+			stats.frame_latency_us, STATS_BUCKETS);
+	if (used < len)
+		used += format_hist(buf + used, len - used, "touches_per_frame",
+			stats.touches, MAX_TOUCH + 1);
+	return used < len ? used : len - 1;
+}
+#elif TS_REPLAY
+// Only so that ts_replay links, it doesn't ask for stats without TS_STATS
+void init_stats(void)
+{
+}
+
+int format_stats(char *buf, int len)
+{
+	(void)len;
+	buf[0] = 0;
+	return 0;
+}
+#endif // TS_STATS
 
 int send_uevent(int fd, __u16 type, __u16 code, __s32 value)
 {
-	struct input_event event;
+#if MSC_TIMESTAMPS
+	if (type == EV_SYN && code == SYN_REPORT && frame_time)
+		send_uevent(fd, EV_MSC, MSC_TIMESTAMP, (__s32)frame_time);
+#endif
 
 #if EVENT_DEBUG
 	char ctype[20], ccode[20];
@@ -268,6 +766,9 @@ int send_uevent(int fd, __u16 type, __u16 code, __s32 value)
 		case EV_SYN:
 			strcpy(ctype, "EV_SYN");
 			break;
+		case EV_MSC:
+			strcpy(ctype, "EV_MSC");
+			break;
 	}
 	switch (code) {
 		case ABS_MT_SLOT:
@@ -294,43 +795,95 @@ int send_uevent(int fd, __u16 type, __u16 code, __s32 value)
 		case BTN_TOUCH:
 			strcpy(ccode, "BTN_TOUCH");
 			break;
+		case MSC_TIMESTAMP:
+			strcpy(ccode, "MSC_TIMESTAMP");
+			break;
 	}
 	ALOGI("event type: '%s' code: '%s' value: %i \n", ctype, ccode, value);
 #endif
 
-	memset(&event, 0, sizeof(event));
-	event.type = type;
-	event.code = code;
-	event.value = value;
-
-	if (write(fd, &event, sizeof(event)) != sizeof(event)) {
-		ALOGE("Error on send_event %d", sizeof(event));
+	// Events are queued up and written all at once at the end of the frame
+	// so a frame costs one syscall instead of one per event.
+	if (ts_queue_event(&uevents, fd, type, code, value)) {
+		ALOGE("Error on send_event");
 		return -1;
 	}
-
 	return 0;
 }
 
+struct touchpoint *history_touch(struct touchpoint *t, int *set)
+{
+	// Steps back to the touch that t continued from in the frame before set
+	// and moves set to that frame.  NULL if t started in set or the history
+	// ran out.
+	if (t->prev_loc < 0)
+		return NULL;
+	*set = *set ? *set - 1 : TOUCH_HISTORY - 1;
+	if (*set == tpoint)
+		return NULL;
+	return &tp[*set][t->prev_loc];
+}
+
+#if DEBOUNCE_FILTER || HOVER_DEBOUNCE_FILTER
+int moving_fast(struct touchpoint *t)
+{
+	// Checks if the current touch t has moved faster than
+	// debounce_max_speed since the oldest frame within avg_window_ms.  A
+	// touch younger than half the window isn't moving as far as we know.
+	struct touchpoint *old = t, *prev;
+	int set = tpoint, old_set = tpoint;
+	long long window = params.avg_window_ms * 1000LL, age, dx, dy, max;
+
+	if (!params.debounce_max_speed)
+		return 0;
+	while ((prev = history_touch(old, &set)) != NULL &&
+		tp_time[tpoint] - tp_time[set] <= window) {
+		old = prev;
+		old_set = set;
+	}
+	age = tp_time[tpoint] - tp_time[old_set];
+	if (age * 2 < window || age <= 0)
+		return 0;
+	dx = t->unfiltered_x - old->unfiltered_x;
+	dy = t->unfiltered_y - old->unfiltered_y;
+	max = params.debounce_max_speed * age / 1000000;
+	return dx * dx + dy * dy > max * max;
+}
+#endif
+
 #if AVG_FILTER
+int avg_weight(long long age)
+{
+	// Weight of a location age microseconds old in Q10, halving every
+	// avg_half_life_ms and going in a straight line in between
+	long long half_life = params.avg_half_life_ms * 1000LL;
+	int halvings = age / half_life, weight;
+
+	if (halvings > 10)
+		return 0;
+	weight = 1024 >> halvings;
+	return weight - (weight / 2) * (age % half_life) / half_life;
+}
+
 void avg_filter(struct touchpoint *t) {
 #if DEBUG
 	ALOGD("before: x=%d, y=%d", t->x, t->y);
 #endif
-	float total_div = 6.0;
-	int xsum = 4 * t->unfiltered_x + 2 *
-		tp[prevtpoint][t->prev_loc].unfiltered_x;
-	int ysum = 4 * t->unfiltered_y + 2 *
-		tp[prevtpoint][t->prev_loc].unfiltered_y;
-
-	if(tp[prevtpoint][t->prev_loc].prev_loc > -1) {
-		xsum +=
-			tp[prev2tpoint][tp[prevtpoint][t->prev_loc].prev_loc].unfiltered_x;
-		ysum +=
-			tp[prev2tpoint][tp[prevtpoint][t->prev_loc].prev_loc].unfiltered_y;
-		total_div += 1.0;
-	}
-	t->x = xsum / total_div;
-	t->y = ysum / total_div;
+	struct touchpoint *prev = t;
+	int set = tpoint, weight;
+	long long age, xsum = 0, ysum = 0, total_weight = 0;
+
+	do {
+		age = tp_time[tpoint] - tp_time[set];
+		if (age > params.avg_window_ms * 1000LL)
+			break;
+		weight = avg_weight(age);
+		xsum += weight * prev->unfiltered_x;
+		ysum += weight * prev->unfiltered_y;
+		total_weight += weight;
+	} while ((prev = history_touch(prev, &set)) != NULL);
+	t->x = xsum / total_weight;
+	t->y = ysum / total_weight;
 #if DEBUG
 	ALOGD("|||| after: x=%d, y=%d\n", t->x, t->y);
 #endif
@@ -342,13 +895,13 @@ void hover_debounce(int i) {
 	int prev_loc = tp[tpoint][i].prev_loc;
 
 	tp[tpoint][i].hover_delay = tp[prevtpoint][prev_loc].hover_delay;
-	// Check to see if the current touch, previous touch, and prev2 touch are
-	// all within the HOVER_DEBOUNCE_RADIUS
+	// Check to see if the current touch has stayed within the
+	// HOVER_DEBOUNCE_RADIUS of the hover point without moving quickly
 	if (abs(tp[tpoint][i].x - tp[prevtpoint][prev_loc].hover_x) <
-		HOVER_DEBOUNCE_RADIUS &&
+		params.hover_debounce_radius &&
 		abs(tp[tpoint][i].y - tp[prevtpoint][prev_loc].hover_y) <
-		HOVER_DEBOUNCE_RADIUS) {
-		if (!tp[tpoint][i].hover_delay) {
+		params.hover_debounce_radius && !moving_fast(&tp[tpoint][i])) {
+		if (tp[tpoint][i].hover_delay <= 0) {
 			tp[tpoint][i].x = tp[prevtpoint][prev_loc].hover_x;
 			tp[tpoint][i].y = tp[prevtpoint][prev_loc].hover_y;
 #if HOVER_DEBOUNCE_DEBUG
@@ -357,13 +910,14 @@ void hover_debounce(int i) {
 		} else {
 			// We're still within the radius but haven't been in the radius
 			// long enough.
-			tp[tpoint][i].hover_delay--;
+			tp[tpoint][i].hover_delay -= frame_dt;
 #if HOVER_DEBOUNCE_DEBUG
-			ALOGD("Hover delay of %i on tracking ID: %i\n",
+			ALOGD("Hover delay of %ius on tracking ID: %i\n",
 				tp[tpoint][i].hover_delay, tp[tpoint][i].tracking_id);
 #endif
 		}
-		if (tp[prevtpoint][prev_loc].hover_delay == 1) {
+		if (tp[prevtpoint][prev_loc].hover_delay > 0 &&
+			tp[tpoint][i].hover_delay <= 0) {
 			// Do not bring forward the hover points... we will hover from
 			// here.  This prevents some jerking backwards as we switch between
 			// hovering and not hovering.
@@ -373,37 +927,186 @@ void hover_debounce(int i) {
 			tp[tpoint][i].hover_y = tp[prevtpoint][prev_loc].hover_y;
 		}
 	} else {
-		// We have moved too far for hover debouce, reset the delay counter.
-		tp[tpoint][i].hover_delay = HOVER_DEBOUNCE_DELAY;
+		// We have moved too far for hover debouce, reset the delay.
+		tp[tpoint][i].hover_delay = params.hover_debounce_ms * 1000;
 	}
 }
 #endif // HOVER_DEBOUNCE_FILTER
 
+int predict_clamp(int value, int max)
+{
+	// Keeps a predicted or resampled location on the screen
+	if (value < 0)
+		return 0;
+	if (value > max)
+		return max;
+	return value;
+}
+
+#if PREDICT_FILTER
+void predict_start(struct touchpoint *t)
+{
+	// A new touch starts out still, at the place it touched down
+	t->est_x = t->x << PREDICT_SHIFT;
+	t->est_y = t->y << PREDICT_SHIFT;
+	t->vel_x = 0;
+	t->vel_y = 0;
+	t->debounce_x = t->x;
+	t->debounce_y = t->y;
+}
+
+void predict_filter_touch(struct touchpoint *t)
+{
+	// Alpha-beta filter that tracks the position and velocity of each touch
+	// and reports where the touch will be predict_ms from now.  This is a
+	// steady state Kalman filter, the gains are fixed so it is cheap enough
+	// to run on every touch.  Holding a touch still for a long press or a
+	// hover is handled here as well so the other filters aren't needed.
+	struct touchpoint *prev = &tp[prevtpoint][t->prev_loc];
+	int pred_x, pred_y, res_x, res_y, ahead;
+
+	// Move the previous estimate forward to this frame and correct it with
+	// the new location.  The speed is per predict_frame_us so frames that
+	// arrive early or late move the estimate by the right amount.
+	pred_x = prev->est_x + (long long)prev->vel_x * frame_dt /
+		params.predict_frame_us;
+	pred_y = prev->est_y + (long long)prev->vel_y * frame_dt /
+		params.predict_frame_us;
+	res_x = (t->unfiltered_x << PREDICT_SHIFT) - pred_x;
+	res_y = (t->unfiltered_y << PREDICT_SHIFT) - pred_y;
+	t->est_x = pred_x + ((res_x * params.predict_alpha) >> PREDICT_SHIFT);
+	t->est_y = pred_y + ((res_y * params.predict_alpha) >> PREDICT_SHIFT);
+	t->vel_x = prev->vel_x + (((long long)res_x * params.predict_beta *
+		params.predict_frame_us / frame_dt) >> PREDICT_SHIFT);
+	t->vel_y = prev->vel_y + (((long long)res_y * params.predict_beta *
+		params.predict_frame_us / frame_dt) >> PREDICT_SHIFT);
+
+#if DEBOUNCE_FILTER
+	// Keep the touch where it landed until it leaves DEBOUNCE_RADIUS so it is
+	// easy to long press.  Once it leaves it is never debounced again.
+	t->debounce_x = prev->debounce_x;
+	t->debounce_y = prev->debounce_y;
+	if (t->debounce_x > -20) {
+		if (abs(t->unfiltered_x - t->debounce_x) <= params.debounce_radius &&
+			abs(t->unfiltered_y - t->debounce_y) <= params.debounce_radius &&
+			!moving_fast(t)) {
+			t->est_x = t->unfiltered_x << PREDICT_SHIFT;
+			t->est_y = t->unfiltered_y << PREDICT_SHIFT;
+			t->vel_x = 0;
+			t->vel_y = 0;
+			t->x = t->debounce_x;
+			t->y = t->debounce_y;
+			return;
+		}
+		t->debounce_x = -100; // Invalidate
+	}
+#endif // DEBOUNCE_FILTER
+
+#if HOVER_DEBOUNCE_FILTER
+	// A touch that stays within HOVER_DEBOUNCE_RADIUS for
+	// HOVER_DEBOUNCE_MS is held still to hide the jitter
+	t->hover_x = prev->hover_x;
+	t->hover_y = prev->hover_y;
+	t->hover_delay = prev->hover_delay;
+	if (abs(t->unfiltered_x - t->hover_x) < params.hover_debounce_radius &&
+		abs(t->unfiltered_y - t->hover_y) < params.hover_debounce_radius &&
+		!moving_fast(t)) {
+		if (t->hover_delay <= 0) {
+			t->vel_x = 0;
+			t->vel_y = 0;
+			t->x = t->hover_x;
+			t->y = t->hover_y;
+			return;
+		}
+		t->hover_delay -= frame_dt;
+	} else {
+		t->hover_x = t->unfiltered_x;
+		t->hover_y = t->unfiltered_y;
+		t->hover_delay = params.hover_debounce_ms * 1000;
+	}
+#endif // HOVER_DEBOUNCE_FILTER
+
+	// Report where the touch is expected to be predict_ms from now
+	ahead = params.predict_ms * 1000;
+	t->x = predict_clamp((t->est_x + (long long)t->vel_x * ahead /
+		params.predict_frame_us + (1 << (PREDICT_SHIFT - 1))) >> PREDICT_SHIFT,
+		X_RESOLUTION_MINUS1);
+	t->y = predict_clamp((t->est_y + (long long)t->vel_y * ahead /
+		params.predict_frame_us + (1 << (PREDICT_SHIFT - 1))) >> PREDICT_SHIFT,
+		Y_RESOLUTION_MINUS1);
+}
+#endif // PREDICT_FILTER
+
 #if USE_B_PROTOCOL
+void send_slot_value(int slot, __u16 code, int value, int *sent)
+{
+	// Sends a value for a slot only if it is different from the value that
+	// was last sent for that slot.  ABS_MT_SLOT is only sent when we switch
+	// to a different slot.
+	if (*sent == value)
+		return;
+	if (current_slot != slot) {
+		send_uevent(uinput_fd, EV_ABS, ABS_MT_SLOT, slot);
+		current_slot = slot;
+	}
+	send_uevent(uinput_fd, EV_ABS, code, value);
+	*sent = value;
+}
+
 void liftoff_slot(int slot) {
-	// Sends a liftoff indicator for a specific slot
+	// Sends a liftoff indicator for a specific slot and frees it
 #if EVENT_DEBUG
 	ALOGD("liftoff slot function, lifting off slot: %i\n", slot);
 #endif
-	// According to the Linux kernel documentation, this is the right events
-	// to send for protocol B, but the TouchPad 2.6.35 kernel doesn't seem to
-	// handle them correctly.
-	send_uevent(uinput_fd, EV_ABS, ABS_MT_SLOT, slot);
-	send_uevent(uinput_fd, EV_ABS, ABS_MT_TRACKING_ID, -1);
+	send_slot_value(slot, ABS_MT_TRACKING_ID, -1,
+		&slot_sent[slot].tracking_id);
+	// Everything has to be sent again for the next touch in this slot
+	slot_sent[slot].touch_major = -1;
+	slot_sent[slot].x = -1;
+	slot_sent[slot].y = -1;
+	slot_sent[slot].pw = -1;
+	slot_in_use[slot] = 0;
 }
-#endif // USE_B_PROTOCOL
 
-void liftoff(void)
+void report_slot(struct touchpoint *t)
 {
-#if USE_B_PROTOCOL
-	// Send liftoffs for any slots that haven't been lifted off
-	int i;
+	// Sends only the parts of the touch that changed since the last frame.
+	// Stationary touches send nothing at all.
+	struct slot_state *sent = &slot_sent[t->slot];
+
+	send_slot_value(t->slot, ABS_MT_TRACKING_ID, t->tracking_id,
+		&sent->tracking_id);
+	send_slot_value(t->slot, ABS_MT_TOUCH_MAJOR, t->touch_major,
+		&sent->touch_major);
+	send_slot_value(t->slot, ABS_MT_POSITION_X, t->x, &sent->x);
+	send_slot_value(t->slot, ABS_MT_POSITION_Y, t->y, &sent->y);
+	send_slot_value(t->slot, ABS_MT_PRESSURE, t->pw, &sent->pw);
+}
+
+int liftoff_slots(void)
+{
+	// Lifts off every slot that is in use, returns the number lifted
+	int i, count = 0;
+
 	for (i=0; i<MAX_TOUCH; i++) {
 		if (slot_in_use[i]) {
-			slot_in_use[i] = 0;
 			liftoff_slot(i);
+			count++;
 		}
 	}
+	return count;
+}
+#endif // USE_B_PROTOCOL
+
+void liftoff(void)
+{
+#if TS_STATS
+	stats.liftoffs++;
+#endif
+#if USE_B_PROTOCOL
+	// Send liftoffs for any slots that haven't been lifted off.  This is
+	// what releases slots that are left over when the frames stop coming.
+	liftoff_slots();
 #endif
 	// Sends liftoff events - nothing is touching the screen
 #if EVENT_DEBUG
@@ -413,310 +1116,817 @@ void liftoff(void)
 	send_uevent(uinput_fd, EV_SYN, SYN_MT_REPORT, 0);
 #endif
 	send_uevent(uinput_fd, EV_SYN, SYN_REPORT, 0);
+#if VSYNC_RESAMPLE
+	resample_pending = 0;
+	resample_count = 0;
+#endif
 }
 
-void determine_area_loc_fringe(float *isum, float *jsum, int *tweight, int i,
-	int j, int cur_touch_id){
-	float powered;
-
-	// Set fringe point to used for this touch point
-	invalid_matrix[i][j] = cur_touch_id;
+void next_area_label(void)
+{
+	// Moves to a new set of labels for this frame.  Labels from earlier
+	// frames are always smaller than label_base so the labels never need to
+	// be cleared unless the counter wraps.
+	label_base += MAX_TOUCH + 1;
+	if (label_base > 65535 - (MAX_TOUCH + 1)) {
+		memset(&area_label, 0, sizeof(area_label));
+		label_base = MAX_TOUCH + 1;
+	}
+}
 
+void add_area_point(struct touch_area *area, int i, int j, int fringe)
+{
 	// Track touch values to help determine the pixel x, y location
-	powered = pow(matrix[i][j], 1.5);
-	*tweight += powered;
-	*isum += powered * i;
-	*jsum += powered * j;
-
-	// Check the nearby points to see if they are above LARGE_AREA_FRINGE
-	// but still decreasing in value to ensure that they are part of the same
-	// touch and not a nearby, pinching finger.
-	if (i > 0 && invalid_matrix[i-1][j] != cur_touch_id)
-	{
-		if (matrix[i-1][j] >= LARGE_AREA_FRINGE &&
-			matrix[i-1][j] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i - 1, j,
-				cur_touch_id);
-	}
-	if (i < X_AXIS_MINUS1 && invalid_matrix[i+1][j] != cur_touch_id)
-	{
-		if (matrix[i+1][j] >= LARGE_AREA_FRINGE &&
-			matrix[i+1][j] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i + 1, j,
-				cur_touch_id);
-	}
-	if (j > 0 && invalid_matrix[i][j-1] != cur_touch_id) {
-		if (matrix[i][j-1] >= LARGE_AREA_FRINGE &&
-			matrix[i][j-1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i, j - 1,
-				cur_touch_id);
-	}
-	if (j < Y_AXIS_MINUS1 && invalid_matrix[i][j+1] != cur_touch_id)
-	{
-		if (matrix[i][j+1] >= LARGE_AREA_FRINGE &&
-			matrix[i][j+1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i, j + 1,
-				cur_touch_id);
-	}
-	if (i > 0 && j > 0 && invalid_matrix[i-1][j-1] != cur_touch_id)
-	{
-		if (matrix[i-1][j-1] >= LARGE_AREA_FRINGE &&
-			matrix[i-1][j-1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i - 1, j - 1,
-				cur_touch_id);
-	}
-	if (i < X_AXIS_MINUS1 && j > 0 && invalid_matrix[i+1][j-1] != cur_touch_id)
-	{
-		if (matrix[i+1][j-1] >= LARGE_AREA_FRINGE &&
-			matrix[i+1][j-1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i + 1, j - 1,
-				cur_touch_id);
+	unsigned int powered = ts_weight_table[matrix[i][j]];
+	area->weight += powered >> TS_WEIGHT_SHIFT;
+	area->isum += powered * i;
+	area->jsum += powered * j;
+	area->iisum += powered * i * i;
+	area->jjsum += powered * j * j;
+	area->ijsum += powered * i * j;
+
+	if (fringe)
+		return;
+
+	// Track the size of the touch for TOUCH_MAJOR
+	if (i < area->mini)
+		area->mini = i;
+	if (i > area->maxi)
+		area->maxi = i;
+	if (j < area->minj)
+		area->minj = j;
+	if (j > area->maxj)
+		area->maxj = j;
+
+	// Track the highest value of the touch to determine which threshold
+	// applies.
+	if (matrix[i][j] > area->highest_val) {
+		area->highest_val = matrix[i][j];
+		area->peak_i = i;
+		area->peak_j = j;
 	}
-	if (j < Y_AXIS_MINUS1 && i > 0 && invalid_matrix[i-1][j+1] != cur_touch_id)
-	{
-		if (matrix[i-1][j+1] >= LARGE_AREA_FRINGE &&
-			matrix[i-1][j+1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i - 1, j + 1,
-				cur_touch_id);
+}
+
+void grow_area(unsigned short label, int top, struct touch_area *area)
+{
+	// Works through the points on area_stack.  Nearby points are part of
+	// the touch if they are above LARGE_AREA_UNPRESS.  Points above
+	// LARGE_AREA_FRINGE are also added to the weight of the touch so long as
+	// they keep decreasing in value, otherwise we have 2 fingers pinched
+	// close together.  Fringe points don't count towards the size or the
+	// highest value of the touch.  Points are labelled when they are pushed
+	// so the stack can never hold more than every point in the matrix.
+	static const int di[8] = { -1, 1, 0, 0, -1, 1, -1, 1 };
+	static const int dj[8] = { 0, 0, -1, 1, -1, -1, 1, 1 };
+	int i, j, k, ni, nj, val, flags;
+
+	while (top) {
+		flags = area_stack[--top] & ~AREA_POINT_MASK;
+		i = (area_stack[top] & AREA_POINT_MASK) / Y_AXIS_POINTS;
+		j = (area_stack[top] & AREA_POINT_MASK) % Y_AXIS_POINTS;
+		val = matrix[i][j];
+
+		if (!(flags & AREA_COUNTED_FLAG))
+			add_area_point(area, i, j, flags & AREA_FRINGE_FLAG);
+
+		for (k = 0; k < 8; k++) {
+			ni = i + di[k];
+			nj = j + dj[k];
+			if (ni < 0 || ni > X_AXIS_MINUS1 || nj < 0 || nj > Y_AXIS_MINUS1 ||
+				area_label[ni][nj] == label)
+				continue;
+			if (!(flags & AREA_FRINGE_FLAG) &&
+				matrix[ni][nj] >= params.large_area_unpress) {
+				area_label[ni][nj] = label;
+				area_stack[top++] = ni * Y_AXIS_POINTS + nj;
+			} else if (matrix[ni][nj] >= params.large_area_fringe &&
+				matrix[ni][nj] < val) {
+				area_label[ni][nj] = label;
+				area_stack[top++] = (ni * Y_AXIS_POINTS + nj) |
+					AREA_FRINGE_FLAG;
+			}
+		}
 	}
-	if (j < Y_AXIS_MINUS1 && i < X_AXIS_MINUS1 &&
-		invalid_matrix[i+1][j+1] != cur_touch_id)
-	{
-		if (matrix[i+1][j+1] >= LARGE_AREA_FRINGE &&
-			matrix[i+1][j+1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i + 1, j + 1,
-				cur_touch_id);
+}
+
+void determine_area(int i, int j, unsigned short label,
+	struct touch_area *area)
+{
+	// Finds all of the points that make up the touch starting at i, j.
+	memset(area, 0, sizeof(*area));
+	area->mini = area->maxi = area->peak_i = i;
+	area->minj = area->maxj = area->peak_j = j;
+	area->highest_val = matrix[i][j];
+
+	area_label[i][j] = label;
+	area_stack[0] = i * Y_AXIS_POINTS + j;
+	grow_area(label, 1, area);
+}
+
+int row_active(int i, int thresh)
+{
+	// Returns 1 if the row of the matrix has at least one point above
+	// thresh.  Only these rows can start a new touch.
+	if (thresh < 0)
+		return 1;
+	if (thresh > 255)
+		return 0;
+
+#if defined(__ARM_NEON__)
+	// Each row is 40 bytes, so it is checked as 16 + 16 + 8 bytes.  Take the
+	// max across the row and only compare that against the threshold.
+	uint8x16_t max16 = vmaxq_u8(vld1q_u8(&matrix[i][0]),
+		vld1q_u8(&matrix[i][16]));
+	uint8x8_t max8 = vmax_u8(vmax_u8(vget_low_u8(max16),
+		vget_high_u8(max16)), vld1_u8(&matrix[i][32]));
+	uint8x8_t above = vcgt_u8(max8, vdup_n_u8(thresh));
+	// Fold the 8 compare results in to the low 4 bytes
+	above = vpmax_u8(above, above);
+	return vget_lane_u32(vreinterpret_u32_u8(above), 0) != 0;
+#else
+	int j;
+	for (j = 0; j < Y_AXIS_POINTS; j++)
+		if (matrix[i][j] > thresh)
+			return 1;
+	return 0;
+#endif
+}
+
+unsigned int find_active_rows(int thresh)
+{
+	// Returns a bitmask of the rows in the matrix that have at least one
+	// point above thresh.
+	unsigned int active_rows = 0;
+	int i;
+
+	for (i = 0; i < X_AXIS_POINTS; i++)
+		if (row_active(i, thresh))
+			active_rows |= 1 << i;
+	return active_rows;
+}
+
+#if ROW_STREAMING
+unsigned int stream_find(unsigned int l)
+{
+	// Finds the label that a group of connected points was merged in to
+	while (stream_labels[l].parent != l) {
+		stream_labels[l].parent =
+			stream_labels[stream_labels[l].parent].parent;
+		l = stream_labels[l].parent;
 	}
+	return l;
 }
 
-void determine_area_loc(float *isum, float *jsum, int *tweight, int i, int j,
-	int *mini, int *maxi, int *minj, int *maxj, int cur_touch_id,
-	int *highest_val){
-	float powered;
+void stream_union(unsigned int a, unsigned int b)
+{
+	// Merges two groups of connected points, keeping the older label
+	a = stream_find(a);
+	b = stream_find(b);
+	if (a < b)
+		stream_labels[b].parent = a;
+	else if (b < a)
+		stream_labels[a].parent = b;
+}
 
-	// Invalidate this touch point so that we don't process it later
-	invalid_matrix[i][j] = cur_touch_id;
+void stream_row(int row, int first)
+{
+	// Called as soon as each row of the matrix arrives.  Points at or above
+	// LARGE_AREA_UNPRESS are grouped with the connected points in the
+	// previous rows and their weights are added up straight away so that
+	// most of the work for a frame is done while the rest of the frame is
+	// still coming in over the uart.
+	int j, k, run = 0;
+
+	if (first) {
+		stream_next_row = 0;
+		stream_label_count = 0;
+		stream_active_rows = 0;
+		stream_thresh = params.touch_continue_thresh;
+	}
+	if (row >= X_AXIS_POINTS || row != stream_next_row) {
+		// Rows arrived out of order, calc_point will scan the whole matrix
+		stream_next_row = -1;
+		return;
+	}
+	stream_next_row++;
 
-	// Track the size of the touch for TOUCH_MAJOR
-	if (i < *mini)
-		*mini = i;
-	if (i > *maxi)
-		*maxi = i;
-	if (j < *minj)
-		*minj = j;
-	if (j > *maxj)
-		*maxj = j;
+	if (row_active(row, stream_thresh))
+		stream_active_rows |= 1 << row;
 
-	// Track the highest value of the touch to determine which threshold
-	// applies.
-	if (matrix[i][j] > *highest_val)
-		*highest_val = matrix[i][j];
+	for (j = 0; j < Y_AXIS_POINTS; j++) {
+		if (matrix[row][j] < params.large_area_unpress) {
+			stream_point[row][j] = 0;
+			run = 0;
+			continue;
+		}
+		if (!run) {
+			// Start a new label for this run of points
+			run = ++stream_label_count;
+			stream_labels[run - 1].parent = run - 1;
+			stream_labels[run - 1].taken = 0;
+			memset(&stream_labels[run - 1].area, 0,
+				sizeof(stream_labels[run - 1].area));
+			stream_labels[run - 1].area.mini = row;
+			stream_labels[run - 1].area.maxi = row;
+			stream_labels[run - 1].area.minj = j;
+			stream_labels[run - 1].area.maxj = j;
+		}
+		stream_point[row][j] = run;
+		add_area_point(&stream_labels[run - 1].area, row, j, 0);
+
+		// Join up with any touching points in the row above
+		if (row > 0) {
+			for (k = MAX(j - 1, 0); k <= MIN(j + 1, Y_AXIS_MINUS1); k++)
+				if (stream_point[row - 1][k])
+					stream_union(run - 1, stream_point[row - 1][k] - 1);
+		}
+	}
+}
 
-	// Track touch values to help determine the pixel x, y location
-	powered = pow(matrix[i][j], 1.5);
-	*tweight += powered;
-	*isum += powered * i;
-	*jsum += powered * j;
-
-	// Check nearby points to see if they are above LARGE_AREA_UNPRESS
-	// or if they are above LARGE_AREA_FRINGE but the next nearby point is
-	// decreasing in value.  If the value is not decreasing and below
-	// LARGE_AREA_UNPRESS then we have 2 fingers pinched close together.
-	if (i > 0 && invalid_matrix[i-1][j] != cur_touch_id)
-	{
-		if (matrix[i-1][j] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i - 1, j, mini, maxi, minj,
-			maxj, cur_touch_id, highest_val);
-		else if (matrix[i-1][j] >= LARGE_AREA_FRINGE &&
-			matrix[i-1][j] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i - 1, j,
-				cur_touch_id);
-	}
-	if (i < X_AXIS_MINUS1 && invalid_matrix[i+1][j] != cur_touch_id)
-	{
-		if (matrix[i+1][j] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i + 1, j, mini, maxi, minj,
-			maxj, cur_touch_id, highest_val);
-		else if (matrix[i+1][j] >= LARGE_AREA_FRINGE &&
-			matrix[i+1][j] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i + 1, j,
-				cur_touch_id);
-	}
-	if (j > 0 && invalid_matrix[i][j-1] != cur_touch_id)
-	{
-		if (matrix[i][j-1] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i, j - 1, mini, maxi, minj,
-				maxj, cur_touch_id, highest_val);
-		else if (matrix[i][j-1] >= LARGE_AREA_FRINGE &&
-			matrix[i][j-1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i, j - 1,
-				cur_touch_id);
-	}
-	if (j < Y_AXIS_MINUS1 && invalid_matrix[i][j+1] != cur_touch_id)
-	{
-		if (matrix[i][j+1] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i, j + 1, mini, maxi, minj,
-				maxj, cur_touch_id, highest_val);
-		else if (matrix[i][j+1] >= LARGE_AREA_FRINGE &&
-			matrix[i][j+1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i, j + 1,
-				cur_touch_id);
-	}
-	if (i > 0 && j > 0 && invalid_matrix[i-1][j-1] != cur_touch_id)
-	{
-		if (matrix[i-1][j-1] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i - 1, j - 1, mini, maxi,
-				minj, maxj, cur_touch_id, highest_val);
-		else if (matrix[i-1][j-1] >= LARGE_AREA_FRINGE &&
-			matrix[i-1][j-1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i - 1, j - 1,
-				cur_touch_id);
-	}
-	if (i < X_AXIS_MINUS1 && j > 0 && invalid_matrix[i+1][j-1] != cur_touch_id)
-	{
-		if (matrix[i+1][j-1] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i + 1, j - 1, mini, maxi,
-				minj, maxj, cur_touch_id, highest_val);
-		else if (matrix[i+1][j-1] >= LARGE_AREA_FRINGE &&
-			matrix[i+1][j-1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i + 1, j - 1,
-				cur_touch_id);
-	}
-	if (j < Y_AXIS_MINUS1 && i > 0 && invalid_matrix[i-1][j+1] != cur_touch_id)
-	{
-		if (matrix[i-1][j+1] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i - 1, j + 1, mini, maxi,
-				minj, maxj, cur_touch_id, highest_val);
-		else if (matrix[i-1][j+1] >= LARGE_AREA_FRINGE &&
-			matrix[i-1][j+1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i - 1, j + 1,
-				cur_touch_id);
-	}
-	if (j < Y_AXIS_MINUS1 && i < X_AXIS_MINUS1 &&
-		invalid_matrix[i+1][j+1] != cur_touch_id)
-	{
-		if (matrix[i+1][j+1] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i + 1, j + 1, mini, maxi,
-				minj, maxj, cur_touch_id, highest_val);
-		else if (matrix[i+1][j+1] >= LARGE_AREA_FRINGE &&
-			matrix[i+1][j+1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i + 1, j + 1,
-				cur_touch_id);
+int stream_complete(void)
+{
+	// Returns 1 if every row of the frame was labelled as it arrived.  The
+	// labels of each group of connected points are then merged together.
+	unsigned int l, root;
+	struct touch_area *dst, *src;
+
+	if (stream_next_row != X_AXIS_POINTS ||
+		stream_thresh != params.touch_continue_thresh) {
+		stream_next_row = -1;
+		return 0;
+	}
+	stream_next_row = -1;
+
+	for (l = 0; l < stream_label_count; l++) {
+		root = stream_find(l);
+		if (root == l)
+			continue;
+		dst = &stream_labels[root].area;
+		src = &stream_labels[l].area;
+		dst->weight += src->weight;
+		dst->isum += src->isum;
+		dst->jsum += src->jsum;
+		dst->iisum += src->iisum;
+		dst->jjsum += src->jjsum;
+		dst->ijsum += src->ijsum;
+		dst->mini = MIN(dst->mini, src->mini);
+		dst->maxi = MAX(dst->maxi, src->maxi);
+		dst->minj = MIN(dst->minj, src->minj);
+		dst->maxj = MAX(dst->maxj, src->maxj);
+		if (src->highest_val > dst->highest_val) {
+			dst->highest_val = src->highest_val;
+			dst->peak_i = src->peak_i;
+			dst->peak_j = src->peak_j;
+		}
 	}
+	return 1;
 }
 
-void process_new_tpoint(struct touchpoint *t, int *tracking_id) {
-	// Handles setting up a brand new touch point
-	if (t->highest_val > touch_delay_thresh) {
-		t->tracking_id = *tracking_id;
-		*tracking_id += 1;
-		if (t->highest_val <= touch_initial_thresh)
-			t->touch_delay = touch_delay_count;
-	} else {
-		t->highest_val = 0;
+int stream_take_area(int i, int j, unsigned short label,
+	struct touch_area *area)
+{
+	// Builds the touch starting at i, j out of the points that were grouped
+	// as the rows arrived, so only the fringe is left to be found.  Returns
+	// 0 if the point already belongs to a touch.
+	unsigned int root;
+	int ii, jj, top = 0;
+
+	if (matrix[i][j] < params.large_area_unpress) {
+		// This can only happen when the touch threshold is below
+		// LARGE_AREA_UNPRESS.  The groups weren't built for this so find the
+		// touch the slow way and mark the groups it grew in to as used.
+		if (area_label[i][j] > label_base)
+			return 0;
+		determine_area(i, j, label, area);
+		for (ii = area->mini; ii <= area->maxi; ii++)
+			for (jj = area->minj; jj <= area->maxj; jj++)
+				if (area_label[ii][jj] == label && stream_point[ii][jj])
+					stream_labels[stream_find(stream_point[ii][jj] - 1)].
+						taken = 1;
+		return 1;
+	}
+
+	root = stream_find(stream_point[i][j] - 1);
+	if (stream_labels[root].taken)
+		return 0;
+	stream_labels[root].taken = 1;
+	*area = stream_labels[root].area;
+
+	// The points in the group are already counted, push them so that
+	// grow_area only adds the fringe around them.
+	for (ii = area->mini; ii <= area->maxi; ii++) {
+		for (jj = area->minj; jj <= area->maxj; jj++) {
+			if (stream_point[ii][jj] &&
+				stream_find(stream_point[ii][jj] - 1) == root) {
+				area_label[ii][jj] = label;
+				area_stack[top++] = (ii * Y_AXIS_POINTS + jj) |
+					AREA_COUNTED_FLAG;
+			}
+		}
 	}
+	grow_area(label, top, area);
+	return 1;
 }
+#endif // ROW_STREAMING
 
-int calc_point(void)
+#if BASELINE_TRACKING
+void baseline_row(int row, const unsigned char *data)
 {
-	int i, j, k;
-	int tweight = 0;
-	int tpc = 0;
-	float isum = 0, jsum = 0;
-	float avgi, avgj;
-	static int previoustpc, tracking_id = 0;
-#if DEBOUNCE_FILTER
-	int new_debounce_touch = 0;
-	static int initialx, initialy;
+	// Writes a row from the uart into the matrix with the baseline of each
+	// point taken off, zeroing points that don't clear the noise gate.  The
+	// raw row is kept for updating the baseline.
+	memcpy(raw_matrix[row], data, Y_AXIS_POINTS);
+#if defined(__ARM_NEON__)
+	uint8x16_t d16;
+	uint8x8_t d8;
+
+	d16 = vqsubq_u8(vld1q_u8(&data[0]), vld1q_u8(&baseline_level[row][0]));
+	vst1q_u8(&matrix[row][0], vandq_u8(d16,
+		vcgtq_u8(d16, vld1q_u8(&baseline_gate[row][0]))));
+	d16 = vqsubq_u8(vld1q_u8(&data[16]), vld1q_u8(&baseline_level[row][16]));
+	vst1q_u8(&matrix[row][16], vandq_u8(d16,
+		vcgtq_u8(d16, vld1q_u8(&baseline_gate[row][16]))));
+	d8 = vqsub_u8(vld1_u8(&data[32]), vld1_u8(&baseline_level[row][32]));
+	vst1_u8(&matrix[row][32], vand_u8(d8,
+		vcgt_u8(d8, vld1_u8(&baseline_gate[row][32]))));
+#else
+	int j, d;
+	for (j = 0; j < Y_AXIS_POINTS; j++) {
+		d = data[j] - baseline_level[row][j];
+		matrix[row][j] = d > baseline_gate[row][j] ? d : 0;
+	}
 #endif
+}
 
-	if (tp[tpoint][0].x < -20) {
-		// We had a total liftoff
-		previoustpc = 0;
-#if DEBOUNCE_FILTER
-		new_debounce_touch = 1;
-#endif
-	} else {
-		// Re-assign array indexes
-		prev2tpoint = prevtpoint;
-		prevtpoint = tpoint;
-		tpoint++;
-		if (tpoint > 2)
-			tpoint = 0;
+void update_baseline(int rate_shift)
+{
+	// Moves the baseline and noise level of every point 1 / 2^rate_shift of
+	// the way towards the current frame.  A rate_shift of 0 starts over from
+	// the current frame.
+	int i, j, diff, gate;
+
+	for (i = 0; i < X_AXIS_POINTS; i++) {
+		for (j = 0; j < Y_AXIS_POINTS; j++) {
+			diff = (raw_matrix[i][j] << BASELINE_SHIFT) - baseline[i][j];
+			if (!rate_shift) {
+				baseline[i][j] = raw_matrix[i][j] << BASELINE_SHIFT;
+				noise[i][j] = 0;
+			} else if (diff < 0) {
+				// Drop quickly so that a finger that was learned as part
+				// of the baseline doesn't leave a dead spot behind
+				baseline[i][j] += diff >> BASELINE_INIT_SHIFT;
+				noise[i][j] += (-diff - noise[i][j]) >> rate_shift;
+			} else {
+				baseline[i][j] += diff >> rate_shift;
+				noise[i][j] += (abs(diff) - noise[i][j]) >> rate_shift;
+			}
+			baseline_level[i][j] = baseline[i][j] >> BASELINE_SHIFT;
+			gate = (params.baseline_noise_mult * noise[i][j]) >>
+				BASELINE_SHIFT;
+			baseline_gate[i][j] = gate > 255 ? 255 : gate;
+		}
 	}
+}
+#endif // BASELINE_TRACKING
 
-	// Scan the digitizer data and generate a list of touches
-	memset(&invalid_matrix, 0, sizeof(invalid_matrix));
+#if RAW_DATA_DEBUG
+void dump_raw_data(void)
+{
+	int i, j;
 	for(i=0; i < X_AXIS_POINTS; i++) {
 		for(j=0; j < Y_AXIS_POINTS; j++) {
-#if RAW_DATA_DEBUG
 			if (matrix[i][j] < RAW_DATA_THRESHOLD)
 				ALOGD("   ");
 			else
 				ALOGD("%2.2X ", matrix[i][j]);
-#endif
-			if (tpc < MAX_TOUCH && matrix[i][j] > touch_continue_thresh &&
-				!invalid_matrix[i][j]) {
-
-				isum = 0;
-				jsum = 0;
-				tweight = 0;
-				int mini = i, maxi = i, minj = j, maxj = j;
-				int highest_val = matrix[i][j];
-				determine_area_loc(&isum, &jsum, &tweight, i, j, &mini,
-					&maxi, &minj, &maxj, tpc + 1, &highest_val);
-
-				avgi = isum / (float)tweight;
-				avgj = jsum / (float)tweight;
-				maxi = maxi - mini;
-				maxj = maxj - minj;
-
-				tp[tpoint][tpc].pw = tweight;
-				tp[tpoint][tpc].i = avgi;
-				tp[tpoint][tpc].j = avgj;
-				tp[tpoint][tpc].touch_major = MAX(maxi, maxj) *
-					PIXELS_PER_POINT;
-				tp[tpoint][tpc].tracking_id = -1;
-#if USE_B_PROTOCOL
-				tp[tpoint][tpc].slot = -1;
-#endif
-				tp[tpoint][tpc].prev_loc = -1;
+		}
+		ALOGD(" |\n"); // end of row
+	}
+	ALOGD("end of raw data\n"); // helps separate one frame from the next
+}
+#endif // RAW_DATA_DEBUG
+
+#if MAX_DELTA_FILTER
+int same_direction(struct touchpoint *t, struct touchpoint *prev)
+{
+	// Checks that the angle between the direction of this touch and the
+	// previous touch is within MAX_DELTA_ANGLE.  The cross product is
+	// |a||b|sin and the dot product is |a||b|cos so comparing them gives the
+	// tangent of the angle without any trig.
+	int cross = t->dir_x * prev->dir_y - t->dir_y * prev->dir_x;
+	int dot = t->dir_x * prev->dir_x + t->dir_y * prev->dir_y;
+
+	return dot > 0 && abs(cross) * 1024 < dot * params.max_delta_angle_tan;
+}
+#endif // MAX_DELTA_FILTER
+
+void track_points(struct touchpoint *set, int count,
+	struct ts_track_point *points)
+{
+	// Touches are tracked by where they really are, not by where a filter
+	// moved them to
+	int i;
+
+	for (i=0; i<count; i++) {
+		points[i].x = set[i].unfiltered_x;
+		points[i].y = set[i].unfiltered_y;
+		points[i].valid = set[i].highest_val != 0;
+	}
+}
+
+void match_closest(int tpc, int previoustpc, int *match_loc,
+	int *match_distance)
+{
+	// Matches each touch to the closest previous touch.  If two touches are
+	// closest to the same previous touch only the closer one keeps it.
+	struct ts_track_point cur[MAX_TOUCH], prev[MAX_TOUCH];
+
+	track_points(tp[tpoint], tpc, cur);
+	track_points(tp[prevtpoint], previoustpc, prev);
+	ts_match_closest(cur, tpc, prev, previoustpc, match_loc,
+		match_distance);
+}
+
+#if OPTIMAL_TRACKING
+#if MAX_DELTA_FILTER
+int within_max_delta(struct touchpoint *t, struct touchpoint *prev,
+	int distance)
+{
+	// Same test the max delta filter uses to decide if a touch is still the
+	// same finger as the previous touch.
+	struct touchpoint dir;
+
+	if (distance <= max_delta_sq)
+		return 1;
+	if (prev->distance <= min_prev_delta_sq)
+		return 0;
+	dir.dir_x = t->x - prev->x;
+	dir.dir_y = t->y - prev->y;
+	return same_direction(&dir, prev);
+}
+
+int max_delta_allowed(int cur, int prev, int distance, void *data)
+{
+	(void)data;
+	return within_max_delta(&tp[tpoint][cur], &tp[prevtpoint][prev],
+		distance);
+}
+#endif // MAX_DELTA_FILTER
+
+void match_optimal(int tpc, int previoustpc, int *match_loc,
+	int *match_distance)
+{
+	// Matches touches to previous touches so that as many touches as
+	// possible keep their tracking ID and the total squared distance moved
+	// is as small as possible.  Pairs that the max delta filter would split
+	// up are never matched.
+	struct ts_track_point cur[MAX_TOUCH], prev[MAX_TOUCH];
+
+	track_points(tp[tpoint], tpc, cur);
+	track_points(tp[prevtpoint], previoustpc, prev);
+	ts_match_optimal(cur, tpc, prev, previoustpc, match_loc,
+		match_distance,
+#if MAX_DELTA_FILTER
+		max_delta_allowed,
+#else
+		NULL,
+#endif
+		NULL);
+}
+#endif // OPTIMAL_TRACKING
+
+void process_new_tpoint(struct touchpoint *t, int *tracking_id) {
+	// Handles setting up a brand new touch point
+	if (t->highest_val > params.touch_delay_thresh) {
+		t->tracking_id = *tracking_id;
+		*tracking_id += 1;
+		if (t->highest_val <= params.touch_initial_thresh)
+			t->touch_delay = params.touch_delay_ms * 1000;
+	} else {
+		t->highest_val = 0;
+	}
+}
+
+void add_touch(struct touch_area *area, struct touchpoint *t)
+{
+	// Fills in a new touch from the touch area that was found for it.  The
+	// moments are divided by the whole number weight, like the old floating
+	// point code did, so that touch locations don't move.
+	t->pw = area->weight;
+	t->i = ((unsigned long long)area->isum << LOC_SHIFT) /
+		(area->weight << TS_WEIGHT_SHIFT);
+	t->j = ((unsigned long long)area->jsum << LOC_SHIFT) /
+		(area->weight << TS_WEIGHT_SHIFT);
+	if (params.localiser != TS_LOC_AREA)
+		ts_localise(params.localiser, matrix, area->peak_i, area->peak_j,
+			LOCALISER_RADIUS, &t->i, &t->j);
+	t->touch_major = MAX(area->maxi - area->mini, area->maxj - area->minj) *
+		params.pixels_per_point;
+	t->tracking_id = -1;
+#if USE_B_PROTOCOL
+	t->slot = -1;
+#endif
+	t->prev_loc = -1;
 #if USERSPACE_270_ROTATE
-				tp[tpoint][tpc].x = tp[tpoint][tpc].i * X_LOCATION_VALUE;
-				tp[tpoint][tpc].y = Y_RESOLUTION_MINUS1 - tp[tpoint][tpc].j *
-					Y_LOCATION_VALUE;
+	t->x = LOC_TO_PIXELS(t->i, X_RESOLUTION, X_AXIS_MINUS1);
+	t->y = Y_RESOLUTION_MINUS1 - LOC_TO_PIXELS_UP(t->j, Y_RESOLUTION,
+		Y_AXIS_MINUS1);
 #else
-				tp[tpoint][tpc].x = X_RESOLUTION_MINUS1 - tp[tpoint][tpc].j *
-					X_LOCATION_VALUE;
-				tp[tpoint][tpc].y = Y_RESOLUTION_MINUS1 - tp[tpoint][tpc].i *
-					Y_LOCATION_VALUE;
+	t->x = X_RESOLUTION_MINUS1 - LOC_TO_PIXELS_UP(t->j, X_RESOLUTION,
+		Y_AXIS_MINUS1);
+	t->y = Y_RESOLUTION_MINUS1 - LOC_TO_PIXELS_UP(t->i, Y_RESOLUTION,
+		X_AXIS_MINUS1);
 #endif // USERSPACE_270_ROTATE
-				// It is possible for x and y to be negative with the math
-				// above so we force them to 0 if they are negative.
-				if (tp[tpoint][tpc].x < 0)
-					tp[tpoint][tpc].x = 0;
-				if (tp[tpoint][tpc].y < 0)
-					tp[tpoint][tpc].y = 0;
-				tp[tpoint][tpc].unfiltered_x = tp[tpoint][tpc].x;
-				tp[tpoint][tpc].unfiltered_y = tp[tpoint][tpc].y;
-				tp[tpoint][tpc].highest_val = highest_val;
-				tp[tpoint][tpc].touch_delay = 0;
+	// It is possible for x and y to be negative with the math above so we
+	// force them to 0 if they are negative.
+	if (t->x < 0)
+		t->x = 0;
+	if (t->y < 0)
+		t->y = 0;
+	t->unfiltered_x = t->x;
+	t->unfiltered_y = t->y;
+	t->highest_val = area->highest_val;
+	t->touch_delay = 0;
 #if HOVER_DEBOUNCE_FILTER
-				tp[tpoint][tpc].hover_x = tp[tpoint][tpc].x;
-				tp[tpoint][tpc].hover_y = tp[tpoint][tpc].y;
-				tp[tpoint][tpc].hover_delay = HOVER_DEBOUNCE_DELAY;
+	t->hover_x = t->x;
+	t->hover_y = t->y;
+	t->hover_delay = params.hover_debounce_ms * 1000;
 #endif
-				tpc++;
-			}
+#if PREDICT_FILTER
+	predict_start(t);
+#endif
+}
+
+void report_touch(struct touchpoint *t)
+{
+#if EVENT_DEBUG
+	ALOGD("send event for tracking ID: %i\n", t->tracking_id);
+#endif
+#if USE_B_PROTOCOL
+	report_slot(t);
+#else
+	send_uevent(uinput_fd, EV_ABS, ABS_MT_TRACKING_ID, t->tracking_id);
+	send_uevent(uinput_fd, EV_ABS, ABS_MT_TOUCH_MAJOR, t->touch_major);
+	send_uevent(uinput_fd, EV_ABS, ABS_MT_POSITION_X, t->x);
+	send_uevent(uinput_fd, EV_ABS, ABS_MT_POSITION_Y, t->y);
+	send_uevent(uinput_fd, EV_ABS, ABS_MT_PRESSURE, t->pw);
+	send_uevent(uinput_fd, EV_SYN, SYN_MT_REPORT, 0);
+#endif
+}
+
+void report_frame(int tpc)
+{
+	// Report touches, a touch that didn't meet the threshold waits until
+	// its touch_delay has run out
+	int k;
+
+	for (k = 0; k < tpc; k++)
+		if (tp[tpoint][k].highest_val && !tp[tpoint][k].touch_delay)
+			report_touch(&tp[tpoint][k]);
+#if USE_B_PROTOCOL
+	// Nothing needs to be sent if none of the touches changed
+	if (uevents.len) {
+#else
+	if (tpc > 0) {
+#endif
+		send_uevent(uinput_fd, EV_SYN, SYN_REPORT, 0);
+	}
+}
+
+#if VSYNC_RESAMPLE
+void set_vsync(long long time, int period)
+{
+	// The framework tells us when a vsync happened and how far apart they
+	// are.  Later vsyncs are worked out from these.
+	vsync_time = time;
+	vsync_period = period;
+#if DEBUG_SOCKET
+	ALOGD("vsync at %lld every %ius\n", time, period);
+#endif
+}
+
+void resample_arm(long long now)
+{
+	// Waits for the first vsync after now
+	struct itimerspec its;
+
+	if (resample_pending && resample_next > now)
+		return;
+	resample_next = vsync_time + ((now - vsync_time) / vsync_period + 1) *
+		vsync_period;
+	if (resample_next <= now)
+		resample_next += vsync_period;
+	resample_pending = 1;
+	if (resample_timer_fd < 0)
+		return;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = resample_next / 1000000;
+	its.it_value.tv_nsec = (resample_next % 1000000) * 1000;
+	if (timerfd_settime(resample_timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		ALOGE("Unable to set resample timer\n");
+}
+
+int resample_defer(int tpc)
+{
+	// Decides if the touches of this frame wait for the next vsync.  Only a
+	// frame with the same touches as the last report does, a touch down or
+	// a liftoff goes out straight away.
+	int i, k, count = 0, same = 1;
+
+	resample_tpc = tpc;
+	if (!params.vsync_resample || !vsync_period)
+		same = 0;
+#if !TS_REPLAY
+	// Without the timer the report would never go out
+	if (resample_timer_fd < 0)
+		same = 0;
+#endif
+	for (k = 0; k < tpc; k++) {
+		if (!tp[tpoint][k].highest_val || tp[tpoint][k].touch_delay)
+			continue;
+		for (i = 0; i < resample_count; i++)
+			if (resample_ids[i] == tp[tpoint][k].tracking_id)
+				break;
+		if (i == resample_count)
+			same = 0;
+		count++;
+	}
+	if (same && count && count == resample_count) {
+#if TS_REPLAY
+		resample_arm(frame_time);
+#else
+		resample_arm(monotonic_us());
+#endif
+		return 1;
+	}
+
+	resample_pending = 0;
+	resample_count = 0;
+	for (k = 0; k < tpc; k++)
+		if (tp[tpoint][k].highest_val && !tp[tpoint][k].touch_delay)
+			resample_ids[resample_count++] = tp[tpoint][k].tracking_id;
+	return 0;
+}
+
+int resample_axis(int cur, int prev, long long ahead, long long dt, int max)
+{
+	// Moves cur along the line from prev by ahead out of dt
+	return predict_clamp(cur + (cur - prev) * ahead / dt, max);
+}
+
+void resample_report(long long vsync)
+{
+	// Reports the touches of the last frame where they were
+	// resample_latency_ms before vsync.  Between the last two frames the
+	// location is interpolated, after them it is extrapolated but only so
+	// far.
+	struct touchpoint t, *prev;
+	long long target, dt, ahead, saved_time = frame_time;
+	int k, set;
+
+	resample_pending = 0;
+	target = vsync - params.resample_latency_ms * 1000;
+	for (k = 0; k < resample_tpc; k++) {
+		t = tp[tpoint][k];
+		if (!t.highest_val || t.touch_delay)
+			continue;
+		set = tpoint;
+		prev = history_touch(&tp[tpoint][k], &set);
+		dt = prev ? tp_sample_time[tpoint] - tp_sample_time[set] : 0;
+		if (dt > 0) {
+			ahead = target - tp_sample_time[tpoint];
+			ahead = MAX(ahead, -dt);
+			ahead = MIN(ahead, MIN(params.resample_max_predict_ms * 1000,
+				dt / 2));
+			t.x = resample_axis(t.x, prev->x, ahead, dt, X_RESOLUTION_MINUS1);
+			t.y = resample_axis(t.y, prev->y, ahead, dt, Y_RESOLUTION_MINUS1);
 		}
-#if RAW_DATA_DEBUG
-		ALOGD(" |\n"); // end of row
+		report_touch(&t);
+	}
+	// The report is stamped with the time it stands for
+	frame_time = target;
+	send_uevent(uinput_fd, EV_SYN, SYN_REPORT, 0);
+	frame_time = saved_time;
+}
+
+void process_vsync(long long now)
+{
+	// Sends the report that was waiting for a vsync once it is due
+	if (resample_pending && now >= resample_next)
+		resample_report(resample_next);
+}
+#elif TS_REPLAY
+// Only so that ts_replay links, it never resamples without VSYNC_RESAMPLE
+void set_vsync(long long time, int period)
+{
+	(void)time;
+	(void)period;
+}
+
+void process_vsync(long long now)
+{
+	(void)now;
+}
+#endif // VSYNC_RESAMPLE
+
+int calc_point(void)
+{
+	int i, j;
+	int tpc = 0;
+	unsigned int active_rows;
+	struct touch_area area;
+#if ROW_STREAMING
+	int streamed;
 #endif
+	static int previoustpc, tracking_id = 0;
+#if DEBOUNCE_FILTER
+	int new_debounce_touch = 0;
+	static int initialx, initialy;
+#endif
+
+	if (tp[tpoint][0].x < -20) {
+		// We had a total liftoff
+		previoustpc = 0;
+#if DEBOUNCE_FILTER
+		new_debounce_touch = 1;
+#endif
+	} else {
+		// Move on to the next set of touches in the ring
+		prevtpoint = tpoint;
+		tpoint++;
+		if (tpoint == TOUCH_HISTORY)
+			tpoint = 0;
 	}
+	tp_time[tpoint] = filter_time;
+#if VSYNC_RESAMPLE
+	tp_sample_time[tpoint] = frame_time ? frame_time : monotonic_us();
+	// A frame that waited for a vsync is replaced by this one
+	resample_pending = 0;
+#endif
+
 #if RAW_DATA_DEBUG
-	ALOGD("end of raw data\n"); // helps separate one frame from the next
+	dump_raw_data();
 #endif
 
+#if BASELINE_TRACKING
+	if (baseline_frames < params.baseline_init_frames) {
+		update_baseline(baseline_frames ? BASELINE_INIT_SHIFT : 0);
+		baseline_frames++;
+#if ROW_STREAMING
+		stream_complete();
+#endif
+		previoustpc = 0;
+		return 0;
+	}
+#endif
+
+#if ROW_STREAMING
+	streamed = stream_complete();
+	if (streamed)
+		active_rows = stream_active_rows;
+	else
+#endif
+	active_rows = find_active_rows(params.touch_continue_thresh);
+	if (!active_rows) {
+		// Nothing is above the threshold so there are no touches, skip
+		// straight to the end.
+#if BASELINE_TRACKING
+		if (!find_active_rows(params.baseline_update_max))
+			update_baseline(params.baseline_rate_shift);
+#endif
+#if USE_B_PROTOCOL
+		if (liftoff_slots())
+			send_uevent(uinput_fd, EV_SYN, SYN_REPORT, 0);
+#endif
+		previoustpc = 0;
+		return 0;
+	}
+
+	// Scan the digitizer data and generate a list of touches
+	next_area_label();
+	for(i=0; i < X_AXIS_POINTS; i++) {
+		if (!(active_rows & (1 << i)))
+			continue;
+		for(j=0; j < Y_AXIS_POINTS; j++) {
+			if (tpc >= MAX_TOUCH ||
+				matrix[i][j] <= params.touch_continue_thresh)
+				continue;
+#if ROW_STREAMING
+			if (streamed) {
+				if (!stream_take_area(i, j, label_base + tpc + 1, &area))
+					continue;
+			} else
+#endif
+			{
+				if (area_label[i][j] > label_base)
+					continue;
+				determine_area(i, j, label_base + tpc + 1, &area);
+			}
+			add_touch(&area, &tp[tpoint][tpc]);
+			tpc++;
+		}
+	}
+
 #if USE_B_PROTOCOL
 	// Set all previously used slots to -1 so we know if we need to lift any
 	// of them off after matching
@@ -727,61 +1937,35 @@ int calc_point(void)
 
 	// Match up tracking IDs
 	{
-		int smallest_distance[MAX_TOUCH], cur_distance;
-		int deltax, deltay;
+		int smallest_distance[MAX_TOUCH];
 		int smallest_distance_loc[MAX_TOUCH];
-		// Find closest points for each touch
-		for (i=0; i<tpc; i++) {
-			smallest_distance[i] = 1000000;
-			smallest_distance_loc[i] = -1;
-			for (j=0; j<previoustpc; j++) {
-				if (tp[prevtpoint][j].highest_val) {
-					deltax = tp[tpoint][i].unfiltered_x -
-						tp[prevtpoint][j].unfiltered_x;
-					deltay = tp[tpoint][i].unfiltered_y -
-						tp[prevtpoint][j].unfiltered_y;
-					cur_distance = (deltax * deltax) + (deltay * deltay);
-					if(cur_distance < smallest_distance[i]) {
-						smallest_distance[i] = cur_distance;
-						smallest_distance_loc[i] = j;
-					}
-				}
-			}
-		}
-
-		// Remove mapping for touches which aren't closest
-		for (i=0; i<tpc; i++) {
-			for (j=i + 1; j<tpc; j++) {
-				if (smallest_distance_loc[i] > -1 &&
-				   smallest_distance_loc[i] == smallest_distance_loc[j]) {
-					if (smallest_distance[i] < smallest_distance[j])
-						smallest_distance_loc[j] = -1;
-					else
-						smallest_distance_loc[i] = -1;
-				}
-			}
-		}
+#if OPTIMAL_TRACKING
+		if (params.optimal_tracking)
+			match_optimal(tpc, previoustpc, smallest_distance_loc,
+				smallest_distance);
+		else
+#endif
+			match_closest(tpc, previoustpc, smallest_distance_loc,
+				smallest_distance);
 
 		// Assign ids to closest touches
 		for (i=0; i<tpc; i++) {
 			if (smallest_distance_loc[i] > -1) {
 #if MAX_DELTA_FILTER
 				// Filter for impossibly large changes in touches
-				if (smallest_distance[i] > MAX_DELTA_SQ) {
+				if (smallest_distance[i] > max_delta_sq) {
 					int need_lift = 1;
 					// Check to see if the previous point was moving quickly
 					if (tp[prevtpoint][smallest_distance_loc[i]].distance >
-						MIN_PREV_DELTA_SQ) {
+						min_prev_delta_sq) {
 						// Check the direction of the previous point and see
 						// if we're continuing in roughly the same direction.
-						tp[tpoint][i].direction = atan2(
-						tp[tpoint][i].x -
-						tp[prevtpoint][smallest_distance_loc[i]].x,
-						tp[tpoint][i].y -
-						tp[prevtpoint][smallest_distance_loc[i]].y);
-						if (fabsf(tp[tpoint][i].direction -
-							tp[prevtpoint][smallest_distance_loc[i]].direction)
-							< MAX_DELTA_ANGLE) {
+						tp[tpoint][i].dir_x = tp[tpoint][i].x -
+							tp[prevtpoint][smallest_distance_loc[i]].x;
+						tp[tpoint][i].dir_y = tp[tpoint][i].y -
+							tp[prevtpoint][smallest_distance_loc[i]].y;
+						if (same_direction(&tp[tpoint][i],
+							&tp[prevtpoint][smallest_distance_loc[i]])) {
 #if MAX_DELTA_DEBUG
 							ALOGD("direction is close enough, no liftoff\n");
 #endif
@@ -813,8 +1997,12 @@ int calc_point(void)
 						ALOGD("sending max delta liftoff for slot: %i\n",
 							tp[prevtpoint][smallest_distance_loc[i]].slot);
 #endif // EVENT_DEBUG || MAX_DELTA_DEBUG
-						liftoff_slot(
-							tp[prevtpoint][smallest_distance_loc[i]].slot);
+						// The previous touch may still have been delayed
+						// and never got a slot
+						if (tp[prevtpoint][smallest_distance_loc[i]].slot >=
+							0)
+							liftoff_slot(
+								tp[prevtpoint][smallest_distance_loc[i]].slot);
 #endif // USE_B_PROTOCOL
 						process_new_tpoint(&tp[tpoint][i], &tracking_id);
 					}
@@ -822,7 +2010,7 @@ int calc_point(void)
 #endif // MAX_DELTA_FILTER
 				{
 #if TRACK_ID_DEBUG
-					ALOGD("Continue Map %d - %d,%d - %lf,%lf -> %lf,%lf\n",
+					ALOGD("Continue Map %d - %d,%d - %d,%d -> %d,%d\n",
 						tp[prevtpoint][smallest_distance_loc[i]].tracking_id,
 						smallest_distance_loc[i], i, tp[tpoint][i].i,
 						tp[tpoint][i].j,
@@ -832,33 +2020,47 @@ int calc_point(void)
 					tp[tpoint][i].tracking_id =
 						tp[prevtpoint][smallest_distance_loc[i]].tracking_id;
 					tp[tpoint][i].prev_loc = smallest_distance_loc[i];
-					tp[tpoint][i].touch_delay =
-						tp[prevtpoint][smallest_distance_loc[i]].touch_delay;
+					// The delay of a touch that is held back runs down by
+					// the time since the frame before
+					tp[tpoint][i].touch_delay = MAX(
+						tp[prevtpoint][smallest_distance_loc[i]].touch_delay -
+						frame_dt, 0);
 #if MAX_DELTA_FILTER
-					// Track distance and angle
+					// Track distance and direction
 					tp[tpoint][i].distance = smallest_distance[i];
-					tp[tpoint][i].direction = atan2(
-						tp[tpoint][i].x -
-						tp[prevtpoint][smallest_distance_loc[i]].x,
-						tp[tpoint][i].y -
-						tp[prevtpoint][smallest_distance_loc[i]].y);
+					tp[tpoint][i].dir_x = tp[tpoint][i].x -
+						tp[prevtpoint][smallest_distance_loc[i]].x;
+					tp[tpoint][i].dir_y = tp[tpoint][i].y -
+						tp[prevtpoint][smallest_distance_loc[i]].y;
 #endif // MAX_DELTA_FILTER
+#if PREDICT_FILTER
+					if (params.predict_filter)
+						predict_filter_touch(&tp[tpoint][i]);
+					else
+#endif // PREDICT_FILTER
+					{
 #if AVG_FILTER
-					avg_filter(&tp[tpoint][i]);
+						avg_filter(&tp[tpoint][i]);
 #endif // AVG_FILTER
 #if HOVER_DEBOUNCE_FILTER
-					hover_debounce(i);
+						hover_debounce(i);
 #endif // HOVER_DEBOUNCE_FILTER
+					}
 				}
 #if USE_B_PROTOCOL
-				tp[tpoint][i].slot =
-					tp[prevtpoint][smallest_distance_loc[i]].slot;
-				slot_in_use[tp[prevtpoint][smallest_distance_loc[i]].slot] = 1;
+				// Keep the slot unless the touch was just lifted off for
+				// moving too far
+				if (tp[tpoint][i].prev_loc >= 0 &&
+					tp[prevtpoint][smallest_distance_loc[i]].slot >= 0) {
+					tp[tpoint][i].slot =
+						tp[prevtpoint][smallest_distance_loc[i]].slot;
+					slot_in_use[tp[tpoint][i].slot] = 1;
+				}
 #endif
 			} else {
 				process_new_tpoint(&tp[tpoint][i], &tracking_id);
 #if TRACK_ID_DEBUG
-				ALOGD("New Mapping - %lf,%lf - tracking ID: %i\n",
+				ALOGD("New Mapping - %d,%d - tracking ID: %i\n",
 					tp[tpoint][i].i, tp[tpoint][i].j,
 					tp[tpoint][i].tracking_id);
 #endif
@@ -866,6 +2068,16 @@ int calc_point(void)
 		}
 	}
 
+#if TS_STATS
+	for (i=0; i<tpc; i++) {
+		if (tp[tpoint][i].prev_loc < 0 && tp[tpoint][i].highest_val) {
+			stats.tracking_ids++;
+			if (previoustpc)
+				stats.tracking_id_churn++;
+		}
+	}
+#endif
+
 #if USE_B_PROTOCOL
 	// Assign unused slots to touches that don't have a slot yet
 	for (i=0; i<tpc; i++) {
@@ -882,7 +2094,7 @@ int calc_point(void)
 					tp[tpoint][i].slot = j;
 					slot_in_use[j] = 1;
 #if TRACK_ID_DEBUG
-					ALOGD("new slot [%i] trackID: %i slot: %i | %lf , %lf\n",
+					ALOGD("new slot [%i] trackID: %i slot: %i | %d , %d\n",
 						i, tp[tpoint][i].tracking_id, tp[tpoint][i].slot,
 						tp[tpoint][i].i, tp[tpoint][i].j);
 #endif
@@ -899,18 +2111,18 @@ int calc_point(void)
 			ALOGD("lifting off slot %i - no longer in use\n", i);
 #endif
 			liftoff_slot(i);
-			slot_in_use[i] = 0;
 		}
 	}
 #endif // USE_B_PROTOCOL
 
 #if DEBOUNCE_FILTER
-	// The debounce filter only works on a single touch.
+	// The debounce filter only works on a single touch.  The predict filter
+	// debounces every touch itself.
 	// We record the initial touchdown point, calculate a radius in
 	// pixels and re-center the point if we're still within the
 	// radius.  Once we leave the radius, we invalidate so that we
 	// don't debounce again even if we come back to the radius.
-	if (tpc == 1) {
+	if (tpc == 1 && !params.predict_filter) {
 		if (new_debounce_touch) {
 			// We record the initial location of a new touch
 			initialx = tp[tpoint][0].x;
@@ -921,8 +2133,9 @@ int calc_point(void)
 		} else if (initialx > -20) {
 			// See if the current touch is still inside the debounce
 			// radius
-			if (abs(initialx - tp[tpoint][0].x) <= DEBOUNCE_RADIUS
-				&& abs(initialy - tp[tpoint][0].y) <= DEBOUNCE_RADIUS) {
+			if (abs(initialx - tp[tpoint][0].x) <= params.debounce_radius
+				&& abs(initialy - tp[tpoint][0].y) <= params.debounce_radius
+				&& !moving_fast(&tp[tpoint][0])) {
 				// Set the point to the original point - debounce!
 				tp[tpoint][0].x = initialx;
 				tp[tpoint][0].y = initialy;
@@ -939,34 +2152,11 @@ int calc_point(void)
 	}
 #endif
 
-	// Report touches
-	for (k = 0; k < tpc; k++) {
-		if (tp[tpoint][k].highest_val && !tp[tpoint][k].touch_delay) {
-#if EVENT_DEBUG
-			ALOGD("send event for tracking ID: %i\n",
-				tp[tpoint][k].tracking_id);
+#if VSYNC_RESAMPLE
+	// Touches that only moved are reported at the next vsync instead
+	if (!resample_defer(tpc))
 #endif
-#if USE_B_PROTOCOL
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_SLOT, tp[tpoint][k].slot);
-#endif
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_TRACKING_ID,
-				tp[tpoint][k].tracking_id);
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_TOUCH_MAJOR,
-				tp[tpoint][k].touch_major);
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_POSITION_X, tp[tpoint][k].x);
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_POSITION_Y, tp[tpoint][k].y);
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_PRESSURE, tp[tpoint][k].pw);
-#if !USE_B_PROTOCOL
-			send_uevent(uinput_fd, EV_SYN, SYN_MT_REPORT, 0);
-#endif
-		} else if (tp[tpoint][k].touch_delay) {
-			// This touch didn't meet the threshold so we don't report it yet
-			tp[tpoint][k].touch_delay--;
-		}
-	}
-	if (tpc > 0) {
-		send_uevent(uinput_fd, EV_SYN, SYN_REPORT, 0);
-	}
+		report_frame(tpc);
 	previoustpc = tpc; // Store the touch count for the next run
 	if (tracking_id >  2147483000)
 		tracking_id = 0; // Reset tracking ID counter if it gets too big
@@ -974,69 +2164,150 @@ int calc_point(void)
 }
 
 
-int cline_valid(unsigned int extras)
+#if HEATMAP_TAP && !TS_REPLAY
+// Shared memory ring of the latest frames, NULL until a client asks for it
+struct ts_heatmap *heatmap = NULL;
+int heatmap_fd = -1;
+
+int create_heatmap(void)
 {
-	if (cline[0] == 0xff && cline[1] == 0x43 && cidx == 44-extras) {
-		return 1;
+	// Returns the fd of the ring, it is created the first time
+	void *map;
+
+	if (heatmap_fd >= 0)
+		return heatmap_fd;
+	heatmap_fd = ashmem_create_region(HEATMAP_NAME, sizeof(*heatmap));
+	if (heatmap_fd < 0) {
+		ALOGE("Unable to create heatmap\n");
+		return -1;
 	}
-	if (cline[0] == 0xff && cline[1] == 0x47 && cidx > 4 &&
-		cidx == (cline[2]+4-extras)) {
-		return 1;
+	map = mmap(NULL, sizeof(*heatmap), PROT_READ|PROT_WRITE, MAP_SHARED,
+		heatmap_fd, 0);
+	if (map == MAP_FAILED) {
+		ALOGE("Unable to map heatmap\n");
+		close(heatmap_fd);
+		heatmap_fd = -1;
+		return -1;
 	}
-	return 0;
+	// Clients can only map it to read
+	ashmem_set_prot_region(heatmap_fd, PROT_READ);
+
+	heatmap = map;
+	heatmap->magic = TS_HEATMAP_MAGIC;
+	heatmap->version = TS_HEATMAP_VERSION;
+	heatmap->size = sizeof(*heatmap);
+	heatmap->frames = TS_HEATMAP_FRAMES;
+	return heatmap_fd;
 }
 
-void put_byte(unsigned char byte)
+void publish_heatmap(int tpc)
 {
-	if(cidx==0 && byte != 0xFF)
+	// Copies the matrix and touches of the frame that was just processed
+	// into the next slot of the ring
+	struct ts_heatmap_frame *frame;
+	struct ts_heatmap_touch *touch;
+	struct timespec now;
+	unsigned int n;
+	int k;
+
+	if (heatmap == NULL)
 		return;
+	n = heatmap->head;
+	frame = &heatmap->frame[n % TS_HEATMAP_FRAMES];
+	frame->seq = 2 * n + 1;
+	__sync_synchronize();
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	frame->tv_sec = now.tv_sec;
+	frame->tv_nsec = now.tv_nsec;
+	if (tpc > TS_HEATMAP_TOUCHES)
+		tpc = TS_HEATMAP_TOUCHES;
+	frame->touch_count = tpc;
+	for (k = 0; k < tpc; k++) {
+		touch = &frame->touches[k];
+		touch->tracking_id = tp[tpoint][k].tracking_id;
+		touch->x = tp[tpoint][k].x;
+		touch->y = tp[tpoint][k].y;
+		touch->pressure = tp[tpoint][k].pw;
+		touch->touch_major = tp[tpoint][k].touch_major;
+		touch->peak = tp[tpoint][k].highest_val;
+		touch->delay = (tp[tpoint][k].touch_delay + 999) / 1000;
+	}
+	memcpy(frame->matrix, matrix, sizeof(frame->matrix));
 
-	// Sometimes a send is aborted by the touch screen. all we get is an out of
-	// place 0xFF
-	if(byte == 0xFF && !cline_valid(1))
-		cidx = 0;
-
-	cline[cidx++] = byte;
+	__sync_synchronize();
+	frame->seq = 2 * n + 2;
+	heatmap->head = n + 1;
 }
+#endif // HEATMAP_TAP
 
-int consume_line(void)
+int consume_frame(void)
 {
-	int i,j,ret=0;
-
-	if(cline[1] == 0x47) {
-		// Calculate the data points. all transfers complete
-		ret = calc_point();
-	}
-
-	if(cline[1] == 0x43) {
-		// This is a start event. clear the matrix
-		if(cline[2] & 0x80) {
-			for(i=0; i < X_AXIS_POINTS; i++)
-				for(j=0; j < Y_AXIS_POINTS; j++)
-					matrix[i][j] = 0;
-		}
-
-		// Write the line into the matrix
-		for(i=0; i < Y_AXIS_POINTS; i++)
-			matrix[cline[2] & 0x1F][i] = cline[i+3];
-	}
-
-	cidx = 0;
-
+	// Calculate the data points. all transfers complete
+	int ret;
+
+	// Filters assume frames are predict_frame_us apart unless the times
+	// say otherwise.  A frame far off that is more likely a read that was
+	// held up than a real gap.
+	frame_dt = params.predict_frame_us;
+	if (frame_time && last_frame_time && frame_time > last_frame_time)
+		frame_dt = MIN(MAX(frame_time - last_frame_time,
+			params.predict_frame_us / 4), params.predict_frame_us * 4);
+	last_frame_time = frame_time;
+	filter_time += frame_dt;
+
+#if TS_REPLAY
+	replay_frame_begin();
+#endif
+#if TS_STATS
+	stats_frame_begin();
+#endif
+	ret = calc_point();
+#if TS_STATS
+	stats_frame_end(ret);
+#endif
+#if HEATMAP_TAP && !TS_REPLAY
+	publish_heatmap(ret);
+#endif
+#if TS_REPLAY
+	replay_frame_end(ret);
+#endif
+	// Rows of the next frame may be processed as soon as they arrive so
+	// new settings are picked up here, before any of them
+	check_params();
 	return ret;
 }
 
-int snarf2(unsigned char* bytes, int size)
+int parsed_frame(void)
+{
+	// Frame callback when the uart is parsed on the main loop
+	frame_time = uart_parser.frame_time;
+	return consume_frame();
+}
+
+void consume_row(int row, const unsigned char *data, int first)
 {
-	int i,ret=0;
+	int i,j;
 
-	for(i=0; i < size; i++) {
-		put_byte(bytes[i]);
-		if(cline_valid(0))
-			ret += consume_line();
+	// This is a start event. clear the matrix
+	if(first) {
+		for(i=0; i < X_AXIS_POINTS; i++)
+			for(j=0; j < Y_AXIS_POINTS; j++)
+				matrix[i][j] = 0;
 	}
 
-	return ret;
+	// Write the line into the matrix, the row number is 5 bits so it can
+	// point past the end of it if the packet is garbled
+	if(row >= X_AXIS_POINTS)
+		return;
+#if BASELINE_TRACKING
+	baseline_row(row, data);
+#else
+	memcpy(matrix[row], data, Y_AXIS_POINTS);
+#endif
+#if ROW_STREAMING
+	stream_row(row, first);
+#endif
 }
 
 void open_uinput(void)
@@ -1045,7 +2316,7 @@ void open_uinput(void)
 
 	memset(&device, 0, sizeof device);
 
-	uinput_fd=open(UINPUT_LOCATION,O_WRONLY);
+	uinput_fd=open(uinput_location,O_WRONLY);
 	strcpy(device.name,"HPTouchpad");
 
 	device.id.bustype=BUS_VIRTUAL;
@@ -1076,6 +2347,14 @@ void open_uinput(void)
 	if (ioctl(uinput_fd,UI_SET_EVBIT,EV_ABS) < 0)
 		ALOGE("error evbit rel\n");
 
+#if MSC_TIMESTAMPS
+	if (ioctl(uinput_fd,UI_SET_EVBIT,EV_MSC) < 0)
+		ALOGE("error evbit msc\n");
+
+	if (ioctl(uinput_fd,UI_SET_MSCBIT,MSC_TIMESTAMP) < 0)
+		ALOGE("error mscbit timestamp\n");
+#endif
+
 #if USE_B_PROTOCOL
 	if (ioctl(uinput_fd,UI_SET_ABSBIT,ABS_MT_SLOT) < 0)
 		ALOGE("error slot rel\n");
@@ -1107,7 +2386,7 @@ void clear_arrays(void)
 {
 	// Clears array (for after a total liftoff occurs)
 	int i, j;
-	for (i=0; i<3; i++) {
+	for (i=0; i<TOUCH_HISTORY; i++) {
 		for(j=0; j<MAX_TOUCH; j++) {
 			tp[i][j].pw = -1000;
 			tp[i][j].i = -1000;
@@ -1118,7 +2397,8 @@ void clear_arrays(void)
 			tp[i][j].tracking_id = -1;
 			tp[i][j].prev_loc = -1;
 #if MAX_DELTA_FILTER
-			tp[i][j].direction = 0;
+			tp[i][j].dir_x = 0;
+			tp[i][j].dir_y = 0;
 			tp[i][j].distance = 0;
 #endif
 			tp[i][j].touch_major = 0;
@@ -1131,15 +2411,146 @@ void clear_arrays(void)
 #if HOVER_DEBOUNCE_FILTER
 			tp[i][j].hover_x = -1000;
 			tp[i][j].hover_y = -1000;
-			tp[i][j].hover_delay = HOVER_DEBOUNCE_DELAY;
+			tp[i][j].hover_delay = params.hover_debounce_ms * 1000;
+#endif
+		}
+	}
+#if USE_B_PROTOCOL
+	// Every slot has been lifted off so anything sent to them before is
+	// forgotten
+	for (i=0; i<MAX_TOUCH; i++) {
+		slot_in_use[i] = 0;
+		slot_sent[i].tracking_id = -1;
+		slot_sent[i].touch_major = -1;
+		slot_sent[i].x = -1;
+		slot_sent[i].y = -1;
+		slot_sent[i].pw = -1;
+	}
+#endif
+}
+
+#if UART_CAPTURE
+void open_capture(void)
+{
+	struct ts_capture_header header;
+
+	// Only one thread writes to the capture, the uart reader when there
+	// is one, so records never interleave
+	capture_fd = open(UART_CAPTURE_FILE, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (capture_fd < 0) {
+		ALOGE("Could not open capture file %s\n", UART_CAPTURE_FILE);
+		return;
+	}
+
+	header.magic = TS_CAPTURE_MAGIC;
+	header.version = TS_CAPTURE_VERSION;
+	if (write(capture_fd, &header, sizeof(header)) != sizeof(header)) {
+		ALOGE("Error writing capture header\n");
+		close(capture_fd);
+		capture_fd = -1;
+	}
+}
+
+void capture_uart_data(unsigned char *bytes, int nbytes)
+{
+	// Records a read from the uart, a length of 0 records a timeout
+	unsigned char buf[sizeof(struct ts_capture_record) + RECV_BUF_SIZE];
+	struct ts_capture_record *rec = (struct ts_capture_record *)buf;
+	struct timespec now;
+	int len = sizeof(*rec) + nbytes;
+
+	if (capture_fd < 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rec->tv_sec = now.tv_sec;
+	rec->tv_nsec = now.tv_nsec;
+	rec->len = nbytes;
+	memcpy(buf + sizeof(*rec), bytes, nbytes);
+
+	if (write(capture_fd, buf, len) != len) {
+		ALOGE("Error writing capture, capture stopped\n");
+		close(capture_fd);
+		capture_fd = -1;
+	}
+}
+#endif // UART_CAPTURE
+
+void process_uart_timeout(void)
+{
+	// Timeout means no more data and probably need to lift off
+#if UART_CAPTURE && THREADED_UART && !TS_REPLAY
+	// Recorded by the reader so it lands in order with the reads
+	reader_capture_timeout();
+#elif UART_CAPTURE
+	capture_uart_data(NULL, 0);
+#endif
+	// The liftoff doesn't belong to any frame
+	frame_time = 0;
+	if (need_liftoff) {
+#if EVENT_DEBUG
+		ALOGD("timeout called liftoff\n");
 #endif
+		liftoff();
+		clear_arrays();
+		need_liftoff = 0;
+	}
+}
+
+void record_uart_read(unsigned char *bytes, int nbytes)
+{
+#if TS_STATS
+	// Runs on the uart reader thread while the main loop formats stats
+	__sync_fetch_and_add(&stats.uart_reads, 1);
+	__sync_fetch_and_add(&stats.uart_bytes, nbytes);
+	stats_add(stats.read_bytes, nbytes);
+#endif
+#if UART_CAPTURE
+	capture_uart_data(bytes, nbytes);
+#else
+	(void)bytes;
+#if !TS_STATS
+	(void)nbytes;
+#endif
+#endif
+}
+
+int process_touch_count(int tpc)
+{
+	if (!tpc) {
+		// Sometimes there's data but no valid touches due to threshold
+		if (need_liftoff) {
+#if EVENT_DEBUG
+			ALOGD("frame without touches called liftoff\n");
+#endif
+			liftoff();
+			clear_arrays();
+			need_liftoff = 0;
 		}
+		return 0;
 	}
+	need_liftoff = 1;
+	return 1;
+}
+
+int process_uart_data(unsigned char *bytes, int nbytes, long long time)
+{
+	// This is touch data from the uart that was read at time.  Returns 1 if
+	// a frame with touches was found.
+	record_uart_read(bytes, nbytes);
+	uart_parser.read_time = time;
+#if THREADED_UART && TS_REPLAY
+	// Each frame is processed as it is handed over, like on the device
+	ts_parse(&uart_parser, bytes, nbytes);
+	return need_liftoff;
+#else
+	return process_touch_count(ts_parse(&uart_parser, bytes, nbytes));
+#endif
 }
 
 void open_uart(int *uart_fd) {
 	struct hsuart_mode uart_mode;
-	*uart_fd = open("/dev/ctp_uart", O_RDONLY|O_NONBLOCK);
+	*uart_fd = open(uart_location, O_RDONLY|O_NONBLOCK);
 	if(*uart_fd <= 0) {
 		ALOGE("Could not open uart\n");
 		exit(0);
@@ -1178,20 +2589,292 @@ void create_ts_socket(int *socket_fd) {
 	chmod(TS_SOCKET_LOCATION, 438);
 }
 
-void set_ts_mode(int mode){
-	if (mode == 0) {
-		// Finger mode
-		touch_initial_thresh = TOUCH_INITIAL_THRESHOLD;
-		touch_continue_thresh = TOUCH_CONTINUE_THRESHOLD;
-		touch_delay_thresh = TOUCH_DELAY_THRESHOLD;
-		touch_delay_count = TOUCH_DELAY;
+// Current mode, 0 for finger and 1 for stylus.  Kept here so the mode can be
+// answered without reading the settings file.  Stays at the last of the two
+// used while any other profile is in use.
+int ts_mode = 0;
+
+// Name and allowed range of each setting in struct ts_params
+struct param_info {
+	const char *name;
+	int offset;
+	int min;
+	int max;
+};
+
+#define PARAM(field, min, max) \
+	{ #field, offsetof(struct ts_params, field), min, max }
+const struct param_info param_info[] = {
+	PARAM(touch_initial_thresh, 0, 255),
+	PARAM(touch_continue_thresh, 0, 255),
+	PARAM(touch_delay_thresh, 0, 255),
+	PARAM(touch_delay_ms, 0, 1000),
+	PARAM(large_area_unpress, 0, 255),
+	PARAM(large_area_fringe, 0, 255),
+	PARAM(max_delta, 0, 2048),
+	PARAM(min_prev_delta, 0, 2048),
+	PARAM(max_delta_angle_tan, 0, 1024),
+	PARAM(debounce_radius, 0, 1024),
+	PARAM(hover_debounce_radius, 0, 1024),
+	PARAM(hover_debounce_ms, 0, 100000),
+	PARAM(debounce_max_speed, 0, 100000),
+	PARAM(avg_window_ms, 0, 1000),
+	PARAM(avg_half_life_ms, 1, 1000),
+	PARAM(predict_filter, 0, 1),
+	PARAM(predict_ms, 0, 100),
+	PARAM(predict_alpha, 0, 1 << PREDICT_SHIFT),
+	PARAM(predict_beta, 0, 1 << PREDICT_SHIFT),
+	PARAM(predict_frame_us, 1000, 100000),
+	PARAM(optimal_tracking, 0, 1),
+	PARAM(baseline_rate_shift, 0, 15),
+	PARAM(baseline_noise_mult, 0, 16),
+	PARAM(baseline_update_max, 0, 255),
+	PARAM(baseline_init_frames, 0, 1000),
+	PARAM(liftoff_timeout, 1000, 1000000),
+	PARAM(pixels_per_point, 1, 1024),
+	PARAM(vsync_resample, 0, 1),
+	PARAM(resample_latency_ms, 0, 50),
+	PARAM(resample_max_predict_ms, 0, 50),
+	PARAM(localiser, 0, TS_LOC_COUNT - 1),
+};
+#define PARAM_COUNT (int)(sizeof(param_info) / sizeof(param_info[0]))
+
+static __s32 *param_ptr(struct ts_params *p, int idx) {
+	return (__s32 *)((char *)p + param_info[idx].offset);
+}
+
+void default_params(struct ts_params *p, int stylus) {
+	memset(p, 0, sizeof(*p));
+	strcpy(p->name, stylus ? "stylus" : "finger");
+	if (stylus) {
+		p->touch_initial_thresh = TOUCH_INITIAL_THRESHOLD_S;
+		p->touch_continue_thresh = TOUCH_CONTINUE_THRESHOLD_S;
+		p->touch_delay_thresh = TOUCH_DELAY_THRESHOLD_S;
+		p->touch_delay_ms = TOUCH_DELAY_MS_S;
 	} else {
-		// Stylus mode
-		touch_initial_thresh = TOUCH_INITIAL_THRESHOLD_S;
-		touch_continue_thresh = TOUCH_CONTINUE_THRESHOLD_S;
-		touch_delay_thresh = TOUCH_DELAY_THRESHOLD_S;
-		touch_delay_count = TOUCH_DELAY_S;
+		p->touch_initial_thresh = TOUCH_INITIAL_THRESHOLD;
+		p->touch_continue_thresh = TOUCH_CONTINUE_THRESHOLD;
+		p->touch_delay_thresh = TOUCH_DELAY_THRESHOLD;
+		p->touch_delay_ms = TOUCH_DELAY_MS;
 	}
+	p->large_area_unpress = LARGE_AREA_UNPRESS;
+	p->large_area_fringe = LARGE_AREA_FRINGE;
+	p->max_delta = MAX_DELTA;
+	p->min_prev_delta = MIN_PREV_DELTA;
+	p->max_delta_angle_tan = MAX_DELTA_ANGLE_TAN;
+	p->debounce_radius = DEBOUNCE_RADIUS;
+	p->hover_debounce_radius = HOVER_DEBOUNCE_RADIUS;
+	p->hover_debounce_ms = HOVER_DEBOUNCE_MS;
+	p->debounce_max_speed = DEBOUNCE_MAX_SPEED;
+	p->avg_window_ms = AVG_WINDOW_MS;
+	p->avg_half_life_ms = AVG_HALF_LIFE_MS;
+	p->predict_filter = PREDICT_FILTER;
+	p->predict_ms = PREDICT_MS;
+	p->predict_alpha = PREDICT_ALPHA;
+	p->predict_beta = PREDICT_BETA;
+	p->predict_frame_us = PREDICT_FRAME_US;
+	p->optimal_tracking = OPTIMAL_TRACKING;
+	p->baseline_rate_shift = BASELINE_RATE_SHIFT;
+	p->baseline_noise_mult = BASELINE_NOISE_MULT;
+	p->baseline_update_max = BASELINE_UPDATE_MAX;
+	p->baseline_init_frames = BASELINE_INIT_FRAMES;
+	p->liftoff_timeout = LIFTOFF_TIMEOUT;
+	p->pixels_per_point = PIXELS_PER_POINT;
+	p->vsync_resample = 0;
+	p->resample_latency_ms = RESAMPLE_LATENCY_MS;
+	p->resample_max_predict_ms = RESAMPLE_MAX_PREDICT_MS;
+	p->localiser = LOCALISER;
+}
+
+void reset_params(struct ts_params_file *file) {
+	memset(file, 0, sizeof(*file));
+	file->magic = TS_PARAMS_MAGIC;
+	file->version = TS_PARAMS_VERSION;
+	file->size = sizeof(*file);
+	default_params(&file->profile[0], 0);
+	default_params(&file->profile[1], 1);
+	file->active = 0;
+	file->generation = params_generation + 1;
+}
+
+void check_params(void) {
+	// Copies the active profile to params if anything changed in the file.
+	// Only ever called between frames.
+	unsigned int generation = params_file->generation;
+	unsigned int active = params_file->active;
+	__s32 *value;
+	int i;
+
+	if (generation == params_generation)
+		return;
+	params_generation = generation;
+	__sync_synchronize();
+	if (active >= TS_PARAMS_PROFILES ||
+		!params_file->profile[active].name[0])
+		active = 0;
+	params = params_file->profile[active];
+	params.name[TS_PARAMS_NAME_LEN - 1] = 0;
+	// Another process may have written the file, keep every setting in range
+	for (i = 0; i < PARAM_COUNT; i++) {
+		value = param_ptr(&params, i);
+		*value = MIN(MAX(*value, param_info[i].min), param_info[i].max);
+	}
+	max_delta_sq = params.max_delta * params.max_delta;
+	min_prev_delta_sq = params.min_prev_delta * params.min_prev_delta;
+	if (active < 2)
+		ts_mode = active;
+#if TS_SETTINGS_DEBUG
+	ALOGD("Using profile %s from generation %u\n", params.name, generation);
+#endif
+}
+
+void commit_params(void) {
+	// Publishes a change made to params_file and starts using it
+	__sync_synchronize();
+	params_file->generation++;
+	if (params_file != &params_store)
+		msync(params_file, sizeof(*params_file), MS_ASYNC);
+	check_params();
+}
+
+void init_params(void) {
+	// Starts from the default profiles without a parameter file
+	params_file = &params_store;
+	reset_params(params_file);
+	check_params();
+}
+
+#if !TS_REPLAY
+int open_params(void) {
+	// Maps the parameter file so the profiles are kept across restarts.
+	// Returns 1 if it was missing or invalid and has the default profiles
+	// now.
+	struct ts_params_file *file;
+	int fd, created = 0;
+
+	fd = open(TS_PARAMS_FILE, O_RDWR | O_CREAT, 0600);
+	if (fd < 0 || ftruncate(fd, sizeof(*file)) < 0) {
+		ALOGE("Unable to open %s, profiles will not be saved\n",
+			TS_PARAMS_FILE);
+		if (fd >= 0)
+			close(fd);
+		init_params();
+		return 1;
+	}
+	file = mmap(NULL, sizeof(*file), PROT_READ | PROT_WRITE, MAP_SHARED,
+		fd, 0);
+	close(fd);
+	if (file == MAP_FAILED) {
+		ALOGE("Unable to map %s, profiles will not be saved\n",
+			TS_PARAMS_FILE);
+		init_params();
+		return 1;
+	}
+	params_file = file;
+	if (file->magic != TS_PARAMS_MAGIC ||
+		file->version != TS_PARAMS_VERSION ||
+		file->size != sizeof(*file)) {
+		reset_params(file);
+		msync(file, sizeof(*file), MS_ASYNC);
+		created = 1;
+	}
+	params_generation = file->generation - 1;
+	check_params();
+	return created;
+}
+#endif // !TS_REPLAY
+
+int find_profile(const char *name) {
+	int i;
+
+	if (name == NULL)
+		return params_file->active < TS_PARAMS_PROFILES ?
+			params_file->active : 0;
+	for (i = 0; i < TS_PARAMS_PROFILES; i++)
+		if (params_file->profile[i].name[0] &&
+			!strncmp(params_file->profile[i].name, name,
+			TS_PARAMS_NAME_LEN))
+			return i;
+	return -1;
+}
+
+int set_param(const char *profile, const char *name, int value) {
+	// Changes one setting of a profile, NULL for the active one.  A profile
+	// that doesn't exist yet is created as a copy of the active profile.
+	// Returns -1 if the setting, value or profile isn't valid.
+	int i, idx;
+
+	for (i = 0; i < PARAM_COUNT; i++)
+		if (!strcmp(param_info[i].name, name))
+			break;
+	if (i == PARAM_COUNT || value < param_info[i].min ||
+		value > param_info[i].max)
+		return -1;
+
+	idx = find_profile(profile);
+	if (idx < 0) {
+		if (!profile[0] || strlen(profile) >= TS_PARAMS_NAME_LEN)
+			return -1;
+		for (idx = 0; idx < TS_PARAMS_PROFILES; idx++)
+			if (!params_file->profile[idx].name[0])
+				break;
+		if (idx == TS_PARAMS_PROFILES)
+			return -1;
+		params_file->profile[idx] = params;
+		memset(params_file->profile[idx].name, 0, TS_PARAMS_NAME_LEN);
+		strcpy(params_file->profile[idx].name, profile);
+	}
+	*param_ptr(&params_file->profile[idx], i) = value;
+#if TS_SETTINGS_DEBUG
+	ALOGD("Set %s to %i in profile %s\n", name, value,
+		params_file->profile[idx].name);
+#endif
+	commit_params();
+	return 0;
+}
+
+int use_profile(const char *name) {
+	// Switches to a profile from the next frame on, returns -1 if there is
+	// no profile with that name
+	int idx = find_profile(name);
+
+	if (idx < 0)
+		return -1;
+	params_file->active = idx;
+	commit_params();
+	return 0;
+}
+
+int format_profiles(const char *name, char *buf, int len) {
+	// Lists the profiles with the active one marked, or every setting of
+	// one profile.  Returns the length of the text or -1 if there is no
+	// such profile.
+	int i, idx, pos = 0;
+	struct ts_params *p;
+
+	if (!name[0]) {
+		for (i = 0; i < TS_PARAMS_PROFILES; i++)
+			if (params_file->profile[i].name[0])
+				pos += snprintf(buf + pos, len - pos, "%.*s%s\n",
+					TS_PARAMS_NAME_LEN,
+					params_file->profile[i].name,
+					i == find_profile(NULL) ? " *" : "");
+		return pos;
+	}
+	idx = find_profile(name);
+	if (idx < 0)
+		return -1;
+	p = &params_file->profile[idx];
+	for (i = 0; i < PARAM_COUNT && pos < len; i++)
+		pos += snprintf(buf + pos, len - pos, "%s %i\n",
+			param_info[i].name, *param_ptr(p, i));
+	return MIN(pos, len - 1);
+}
+
+void set_ts_mode(int mode){
+	// Finger and stylus mode are profiles 0 and 1
+	params_file->active = mode;
+	commit_params();
 }
 
 int read_settings_file(void) {
@@ -1252,76 +2935,525 @@ void write_settings_file(int setting) {
 	fclose(fp);
 }
 
-void process_socket_buffer(char buffer[], int buffer_len, int *uart_fd,
-	int accept_fd) {
-	// Processes data that is received from the socket
-	// O = open uart
-	// C = close uart
-	// F = finger mode
-	// S = stylus mode
-	// M = return current mode
-	int i, return_val, buf;
+#if THREADED_UART
+struct uart_frame {
+	unsigned char matrix[X_AXIS_POINTS][Y_AXIS_POINTS];
+	// Bit for each row that arrived
+	unsigned int rows;
+	// Row that started the frame and cleared the matrix, -1 if none did
+	int first;
+	// When the first byte of the frame was read
+	long long time;
+};
 
-	for (i=0; i<buffer_len; i++) {
-		buf = (int)buffer[i];
+// The reader fills one frame while the main loop processes another.  The
+// third is the newest complete frame and changes hands with an atomic swap
+// of frame_latest, so neither thread ever waits for the other.  FRAME_NEW is
+// set while the main loop has not taken the newest frame yet; if the reader
+// swaps in another frame first, the one it gets back was stale and is
+// dropped.
+#define FRAME_RING_SIZE 3
+#define FRAME_NEW 0x100
+struct uart_frame frame_ring[FRAME_RING_SIZE] = {
+	{ .first = -1 }, { .first = -1 }, { .first = -1 }
+};
+volatile int frame_latest = 1;
+// Only touched by the reader thread
+int frame_fill = 0;
+int reader_uart_fd = -1;
+// Only touched by the main loop
+int frame_process = 2;
+// Signalled by the reader each time it swaps in a frame
+int frame_event_fd = -1;
+// The main loop writes the uart fd to use to this pipe, or READER_CMD_TIMEOUT
+int reader_cmd_fd[2];
+// Has the reader record a timeout in the capture, never a valid fd or -1
+#define READER_CMD_TIMEOUT -2
+
+void reader_row(int row, const unsigned char *data, int first)
+{
+	// Runs on the reader thread instead of consume_row
+	struct uart_frame *frame = &frame_ring[frame_fill];
 
-		if (buf == 67 /* 'C' */ && *uart_fd >= 0) {
+	if(first) {
+		frame->rows = 0;
+		frame->first = row;
+	}
+	if(row < X_AXIS_POINTS) {
+		memcpy(frame->matrix[row], data, Y_AXIS_POINTS);
+		frame->rows |= 1 << row;
+	}
+}
+
+int reader_frame(void)
+{
+	// Runs on the reader thread instead of consume_frame
+#if !TS_REPLAY
+	uint64_t one = 1;
+#endif
+
+	frame_ring[frame_fill].time = uart_parser.frame_time;
+	// The frame has to be written out before it is handed over
+	__sync_synchronize();
+	frame_fill = __sync_lock_test_and_set(&frame_latest,
+		frame_fill | FRAME_NEW);
+#if TS_STATS
+	if (frame_fill & FRAME_NEW)
+		__sync_fetch_and_add(&stats.dropped_frames, 1);
+#endif
+	frame_fill &= ~FRAME_NEW;
+	frame_ring[frame_fill].rows = 0;
+	frame_ring[frame_fill].first = -1;
+#if TS_REPLAY
+	// A replay takes every frame straight away like a main loop that
+	// always keeps up, so nothing is dropped
+	process_uart_frame();
+#else
+	if (write(frame_event_fd, &one, sizeof(one)) != sizeof(one))
+		ALOGE("Unable to signal frame\n");
+#endif
+	return 0;
+}
+
+int process_uart_frame(void)
+{
+	// Takes the newest frame from the reader.  Returns 1 if it had touches.
+	struct uart_frame *frame;
+	int i;
+#if !TS_REPLAY
+	uint64_t count;
+
+	read(frame_event_fd, &count, sizeof(count));
+#endif
+	if (!(frame_latest & FRAME_NEW))
+		return 0;
+	// The last frame has to be finished with before it is handed back
+	__sync_synchronize();
+	frame_process = __sync_lock_test_and_set(&frame_latest, frame_process) &
+		~FRAME_NEW;
+	frame = &frame_ring[frame_process];
+
+	for(i=0; i < X_AXIS_POINTS; i++)
+		if(frame->rows & (1 << i))
+			consume_row(i, frame->matrix[i], i == frame->first);
+	frame_time = frame->time;
+	return process_touch_count(consume_frame());
+}
+#endif // THREADED_UART
+
+#if !TS_REPLAY
+#if THREADED_UART
+void *uart_reader(void *arg)
+{
+	// Does nothing but drain the uart and assemble frames so the uart
+	// fifo can never overrun while the main loop is busy
+	unsigned char recv_buf[RECV_BUF_SIZE];
+	struct pollfd fds[2];
+	int nbytes, new_fd;
+
+	fds[0].fd = reader_cmd_fd[0];
+	fds[0].events = POLLIN;
+	fds[1].events = POLLIN;
+	while(1) {
+		// poll ignores the uart while it is closed and the fd is -1
+		fds[1].fd = reader_uart_fd;
+		if (poll(fds, 2, -1) < 0) {
+			if (errno != EINTR)
+				ALOGE("Reader poll failed\n");
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			if (read(reader_cmd_fd[0], &new_fd, sizeof(new_fd)) !=
+				sizeof(new_fd))
+				continue;
+			if (new_fd == READER_CMD_TIMEOUT) {
+#if UART_CAPTURE
+				capture_uart_data(NULL, 0);
+#endif
+				continue;
+			}
+			// The old uart is closed here once nothing is reading it
+			if (reader_uart_fd >= 0 && reader_uart_fd != new_fd)
+				close(reader_uart_fd);
+			reader_uart_fd = new_fd;
+			frame_ring[frame_fill].rows = 0;
+			frame_ring[frame_fill].first = -1;
+			ts_parser_reset(&uart_parser);
+			continue;
+		}
+
+		if (!(fds[1].revents & POLLIN))
+			continue;
+		nbytes = read(reader_uart_fd, recv_buf, RECV_BUF_SIZE);
+		if (nbytes <= 0)
+			continue;
+		uart_parser.read_time = monotonic_us();
+		record_uart_read(recv_buf, nbytes);
+		ts_parse(&uart_parser, recv_buf, nbytes);
+	}
+
+	return arg;
+}
+
+void reader_set_uart(int uart_fd)
+{
+	// Hands the reader a newly opened uart, or -1 to have it close the uart
+	if (write(reader_cmd_fd[1], &uart_fd, sizeof(uart_fd)) != sizeof(uart_fd))
+		ALOGE("Unable to pass uart to reader\n");
+}
+
+#if UART_CAPTURE
+void reader_capture_timeout(void)
+{
+	// The capture is only written on the reader thread
+	int cmd = READER_CMD_TIMEOUT;
+
+	if (write(reader_cmd_fd[1], &cmd, sizeof(cmd)) != sizeof(cmd))
+		ALOGE("Unable to pass timeout to reader\n");
+}
+#endif
+
+void start_uart_reader(int uart_fd)
+{
+	pthread_t thread;
+
+	reader_uart_fd = uart_fd;
+	// The uart is only parsed on the reader thread from here on
+	uart_parser.row = reader_row;
+	uart_parser.frame = reader_frame;
+	frame_event_fd = eventfd(0, EFD_NONBLOCK);
+	if (frame_event_fd < 0 || pipe(reader_cmd_fd) < 0 ||
+		pthread_create(&thread, NULL, uart_reader, NULL)) {
+		ALOGE("Unable to start uart reader\n");
+		exit(0);
+	}
+}
+#endif // THREADED_UART
+
+int process_command(int cmd, const unsigned char *payload, int payload_len,
+	int *uart_fd, unsigned char *reply, int *reply_len, int *reply_fd) {
+	// Carries out a command from the socket, see ts_socket.h.  Any data
+	// for the reply goes in reply, an fd to pass to the client goes in
+	// reply_fd and the status is returned.
+	char args[TS_MSG_MAX_PAYLOAD + 1], profile[TS_PARAMS_NAME_LEN], name[32];
+	int value;
+	long long time;
+
+	*reply_len = 0;
+	*reply_fd = -1;
+
+	if (cmd == TS_CMD_PROFILES || cmd == TS_CMD_WRITE_PARAM ||
+		cmd == TS_CMD_USE_PROFILE || cmd == TS_CMD_VSYNC) {
+		// These take text arguments
+		if (payload_len)
+			memcpy(args, payload, payload_len);
+		args[payload_len] = 0;
+	} else if (payload_len)
+		return TS_MSG_BAD_REQUEST;
+
+
+	if (cmd == TS_CMD_CLOSE) {
+		if (*uart_fd >= 0) {
+#if THREADED_UART
+			reader_set_uart(-1);
+#else
 			close(*uart_fd);
+#endif
 			*uart_fd = -1;
 			touchscreen_power(0);
 #if DEBUG_SOCKET
 			ALOGD("uart closed\n");
 #endif
 		}
-		if (buf == 79 /* 'O' */ && *uart_fd < 0) {
+		return TS_MSG_OK;
+	}
+	if (cmd == TS_CMD_OPEN) {
+		if (*uart_fd < 0) {
 			open_uart(uart_fd);
+#if THREADED_UART
+			reader_set_uart(*uart_fd);
+#endif
+#if BASELINE_TRACKING
+			baseline_frames = 0;
+#endif
 			touchscreen_power(1);
 #if DEBUG_SOCKET
 			ALOGD("uart opened at %i\n", *uart_fd);
 #endif
 		}
-		if (buf == 70 /* 'F' */) {
-			set_ts_mode(0);
-			write_settings_file(0);
+		return TS_MSG_OK;
+	}
+	if (cmd == TS_CMD_FINGER || cmd == TS_CMD_STYLUS) {
+		set_ts_mode(cmd == TS_CMD_STYLUS);
+		write_settings_file(ts_mode);
 #if DEBUG_SOCKET
-			ALOGD("finger mode set\n");
+		ALOGD("%s mode set\n", ts_mode ? "stylus" : "finger");
 #endif
-		}
-		if (buf == 83 /* 'S' */) {
-			set_ts_mode(1);
-			write_settings_file(1);
+		return TS_MSG_OK;
+	}
+	if (cmd == TS_CMD_MODE) {
+		reply[0] = ts_mode;
+		*reply_len = 1;
+		return TS_MSG_OK;
+	}
+	if (cmd == TS_CMD_STATS) {
+#if TS_STATS
+		*reply_len = format_stats((char *)reply, TS_MSG_MAX_PAYLOAD) + 1;
+		return TS_MSG_OK;
+#else
+		return TS_MSG_UNAVAILABLE;
+#endif
+	}
+	if (cmd == TS_CMD_HEATMAP) {
+#if HEATMAP_TAP
+		*reply_fd = create_heatmap();
+		return *reply_fd >= 0 ? TS_MSG_OK : TS_MSG_UNAVAILABLE;
+#else
+		return TS_MSG_UNAVAILABLE;
+#endif
+	}
+	if (cmd == TS_CMD_PROFILES) {
+		value = format_profiles(args, (char *)reply, TS_MSG_MAX_PAYLOAD);
+		if (value < 0)
+			return TS_MSG_BAD_REQUEST;
+		*reply_len = value + 1;
+		return TS_MSG_OK;
+	}
+	if (cmd == TS_CMD_WRITE_PARAM) {
+		if (sscanf(args, "%15s %31s %i", profile, name, &value) != 3 ||
+			set_param(profile, name, value))
+			return TS_MSG_BAD_REQUEST;
+		return TS_MSG_OK;
+	}
+	if (cmd == TS_CMD_USE_PROFILE) {
+		if (use_profile(args))
+			return TS_MSG_BAD_REQUEST;
 #if DEBUG_SOCKET
-			ALOGD("stylus mode set\n");
+		ALOGD("Using profile %s\n", args);
 #endif
-		}
-		if (buf == 77 /* 'M' */) {
-			char current_mode[1];
-			int send_ret;
-
-			current_mode[0] = read_settings_file();
-			send_ret = send(accept_fd, (char*)current_mode,
-				sizeof(*current_mode), 0);
-			if (send_ret <= 0)
-				ALOGE("Unable to send data to socket\n");
+		return TS_MSG_OK;
+	}
+	if (cmd == TS_CMD_VSYNC) {
+#if VSYNC_RESAMPLE
+		if (sscanf(args, "%lld %i", &time, &value) != 2 || time < 0 ||
+			(value && (value < 1000 || value > 100000)))
+			return TS_MSG_BAD_REQUEST;
+		set_vsync(time, value);
+		return TS_MSG_OK;
+#else
+		(void)time;
+		return TS_MSG_UNAVAILABLE;
+#endif
+	}
+	return TS_MSG_UNKNOWN;
+}
+
+struct socket_client {
+	int fd;
+	// Set once the client has sent TS_MSG_MAGIC, clear for a client that
+	// sends single byte commands
+	int framed;
+	// Start of a request that has not all arrived yet
+	unsigned char buf[sizeof(struct ts_msg) + TS_MSG_MAX_PAYLOAD];
+	int len;
+} socket_clients[MAX_SOCKET_CLIENTS];
+
+void send_reply(int accept_fd, unsigned char *reply, int len, int reply_fd) {
+	// Replies are small enough to always fit in the socket buffer of a
+	// client that reads them.  A client that doesn't only loses its replies.
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { reply, len };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (reply_fd >= 0) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &reply_fd, sizeof(int));
+	}
+	if (sendmsg(accept_fd, &msg, MSG_NOSIGNAL) != len)
+		ALOGE("Unable to send reply to socket\n");
 #if DEBUG_SOCKET
-			else
-				ALOGD("Sent current mode of %i to socket\n",
-					(int)current_mode[0]);
+	else
+		ALOGD("Sent %i byte reply to socket\n", len);
+#endif
+}
+
+int process_socket_request(struct socket_client *client, int *uart_fd) {
+	// Handles one whole request at the start of the client's buffer.
+	// Returns the length of the request, 0 if it hasn't all arrived or -1
+	// if the client isn't following the protocol.
+	unsigned char reply[sizeof(struct ts_msg) + TS_MSG_MAX_PAYLOAD];
+	struct ts_msg *req = (struct ts_msg *)client->buf;
+	struct ts_msg *ack = (struct ts_msg *)reply;
+	int cmd, len, reply_fd;
+
+	if (!client->len)
+		return 0;
+	if (!client->framed) {
+		// An old client, the whole request is one byte and only the
+		// data goes back.  Old clients only knew these commands.
+		cmd = client->buf[0];
+		if (cmd != TS_CMD_OPEN && cmd != TS_CMD_CLOSE &&
+			cmd != TS_CMD_FINGER && cmd != TS_CMD_STYLUS &&
+			cmd != TS_CMD_MODE && cmd != TS_CMD_STATS)
+			return 1;
+		process_command(cmd, NULL, 0, uart_fd, reply, &len, &reply_fd);
+		if (len)
+			send_reply(client->fd, reply, len, -1);
+		return 1;
+	}
+
+	if (req->magic != TS_MSG_MAGIC)
+		return -1;
+	if (client->len < (int)sizeof(*req))
+		return 0;
+	if (req->len > TS_MSG_MAX_PAYLOAD)
+		return -1;
+	if (client->len < (int)sizeof(*req) + req->len)
+		return 0;
+
+	ack->magic = TS_MSG_MAGIC;
+	ack->cmd = req->cmd;
+	ack->id = req->id;
+	len = 0;
+	reply_fd = -1;
+	ack->status = process_command(req->cmd, client->buf + sizeof(*req),
+		req->len, uart_fd, reply + sizeof(*ack), &len, &reply_fd);
+	ack->len = len;
+#if DEBUG_SOCKET
+	ALOGD("Request %i '%c' status %i\n", req->id, req->cmd, ack->status);
+#endif
+	send_reply(client->fd, reply, sizeof(*ack) + len, reply_fd);
+	return sizeof(*req) + req->len;
+}
+
+void epoll_add(int epoll_fd, int fd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		ALOGE("Unable to add fd %i to epoll\n", fd);
+}
+
+void arm_liftoff_timer(int timer_fd)
+{
+	// Liftoff happens LIFTOFF_TIMEOUT after the last frame that had touches
+	// in it, no matter what else arrives on the uart in the meantime.
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = params.liftoff_timeout / 1000000;
+	its.it_value.tv_nsec = (params.liftoff_timeout % 1000000) * 1000;
+	if (timerfd_settime(timer_fd, 0, &its, NULL) < 0)
+		ALOGE("Unable to arm liftoff timer\n");
+}
+
+void accept_socket_client(int epoll_fd, int socket_fd)
+{
+	// Clients are non-blocking and go on the main loop so a slow client can
+	// never hold up the uart.  They stay connected until they hang up.
+	int accept_fd, i;
+
+	accept_fd = accept(socket_fd, NULL, NULL);
+	if (accept_fd < 0) {
+		ALOGE("Accept failed\n");
+		return;
+	}
+	for (i=0; i<MAX_SOCKET_CLIENTS; i++)
+		if (socket_clients[i].fd < 0)
+			break;
+	if (i == MAX_SOCKET_CLIENTS) {
+		ALOGE("Too many socket clients\n");
+		close(accept_fd);
+		return;
+	}
+	socket_clients[i].fd = accept_fd;
+	socket_clients[i].framed = -1;
+	socket_clients[i].len = 0;
+	fcntl(accept_fd, F_SETFL, fcntl(accept_fd, F_GETFL) | O_NONBLOCK);
+	epoll_add(epoll_fd, accept_fd);
+}
+
+void process_socket_client(int accept_fd, int *uart_fd)
+{
+	// Handles data from a client, the client is closed once it hangs up
+	struct socket_client *client = NULL;
+	int i, recv_ret, used;
+
+	for (i=0; i<MAX_SOCKET_CLIENTS && client == NULL; i++)
+		if (socket_clients[i].fd == accept_fd)
+			client = &socket_clients[i];
+	if (client == NULL)
+		return;
+
+	recv_ret = recv(accept_fd, client->buf + client->len,
+		sizeof(client->buf) - client->len, 0);
+	if (recv_ret > 0) {
+#if DEBUG_SOCKET
+		ALOGD("Socket received %i byte(s)\n", recv_ret);
 #endif
+		if (client->framed < 0)
+			client->framed = client->buf[0] == TS_MSG_MAGIC;
+		client->len += recv_ret;
+		while ((used = process_socket_request(client, uart_fd)) > 0) {
+			client->len -= used;
+			memmove(client->buf, client->buf + used, client->len);
 		}
-		buffer++;
+		if (!used)
+			return;
+		ALOGE("Bad socket request\n");
+	} else if (recv_ret < 0 && errno == EAGAIN) {
+		return;
+	} else if (recv_ret < 0) {
+		ALOGE("Receive error\n");
 	}
+#if DEBUG_SOCKET
+	else
+		ALOGD("Socket client closed\n");
+#endif
+	close(accept_fd);
+	client->fd = -1;
 }
 
 int main(int argc, char** argv)
 {
-	int uart_fd, nbytes, need_liftoff = 0, sel_ret, socket_fd;
+	int uart_fd, socket_fd, epoll_fd, timer_fd, power_fd;
+	int i, fd, nevents, opt;
+#if !THREADED_UART
+	int nbytes, old_uart_fd;
 	unsigned char recv_buf[RECV_BUF_SIZE];
-	fd_set fdset;
-	struct timeval seltmout;
+#endif
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	uint64_t expirations;
 	/* linux maximum priority is 99, nonportable */
 	struct sched_param sparam = { .sched_priority = 99 };
 
+	while ((opt = getopt(argc, argv, "d:i:")) != -1) {
+		switch (opt) {
+			case 'd':
+				uart_location = optarg;
+				break;
+			case 'i':
+				uinput_location = optarg;
+				break;
+			default:
+				printf("Usage: %s [-d uart] [-i uinput]\n", argv[0]);
+				return -1;
+		}
+	}
+
 	/* We set ts server priority to RT so that there is no delay in
 	 * in obtaining input and we are NEVER bumped from CPU until we
 	 * give it up ourselves. */
@@ -1334,114 +3466,139 @@ int main(int argc, char** argv)
 
 
 	open_uinput();
+	// The weights for the touch areas are the localisers' weights
+	ts_locate_init();
+#if TS_STATS
+	init_stats();
+#endif
+#if UART_CAPTURE
+	open_capture();
+#endif
 
-	read_settings_file();
+	// The parameter file remembers the active profile, the old settings
+	// file is only used to pick finger or stylus mode the first time
+	if (open_params())
+		read_settings_file();
 
 	// Lift off in case of driver crash or in case the driver was shut off to
 	// save power by closing the uart.
 	liftoff();
 	clear_arrays();
 
+	for (i=0; i<MAX_SOCKET_CLIENTS; i++)
+		socket_clients[i].fd = -1;
 	create_ts_socket(&socket_fd);
-
-	while(1) {
-		FD_ZERO(&fdset);
-		if (uart_fd >= 0)
-			FD_SET(uart_fd, &fdset);
-		if (socket_fd >= 0)
-			FD_SET(socket_fd, &fdset);
-		seltmout.tv_sec = 0;
-		/* 2x tmout */
-		seltmout.tv_usec = LIFTOFF_TIMEOUT;
-
-		sel_ret = select(MAX(uart_fd, socket_fd) + 1, &fdset, NULL, NULL,
-			&seltmout);
-		if (sel_ret == 0) {
-			/* Timeout means no more data and probably need to lift off */
-#if DEBUG
-			ALOGE("timeout! no data coming from uart\n");
+	fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK);
+
+	// Everything runs off one epoll loop: the uart (or frames from the uart
+	// reader thread), the liftoff timer, the digitizer power sequence, the
+	// vsync timer, the listening socket and any socket clients.
+	epoll_fd = epoll_create(MAX_EPOLL_EVENTS);
+	// Non-blocking because a frame handled earlier in the same batch of
+	// events re-arms the timer, which clears an expiry epoll already saw
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (epoll_fd < 0 || timer_fd < 0) {
+		ALOGE("Unable to create epoll or timer fd\n");
+		exit(0);
+	}
+	epoll_add(epoll_fd, timer_fd);
+	power_fd = touchscreen_power_fd();
+	if (power_fd >= 0)
+		epoll_add(epoll_fd, power_fd);
+#if VSYNC_RESAMPLE
+	// Non-blocking for the same reason as the liftoff timer, every frame
+	// re-arms it
+	resample_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (resample_timer_fd >= 0)
+		epoll_add(epoll_fd, resample_timer_fd);
+	else
+		ALOGE("Unable to create resample timer, not resampling\n");
 #endif
-
-			if (need_liftoff) {
-#if EVENT_DEBUG
-				ALOGD("timeout called liftoff\n");
+#if THREADED_UART
+	start_uart_reader(uart_fd);
+	epoll_add(epoll_fd, frame_event_fd);
+	// The reader thread keeps the top priority so it always gets to the
+	// uart first, the main loop runs just below it
+	sparam.sched_priority = 98;
+	if (sched_setscheduler(0, SCHED_FIFO, &sparam))
+		perror("Cannot set RT priority, ignoring: ");
+#else
+	if (uart_fd >= 0)
+		epoll_add(epoll_fd, uart_fd);
 #endif
-				liftoff();
-				clear_arrays();
-				need_liftoff = 0;
-			}
+	if (socket_fd >= 0)
+		epoll_add(epoll_fd, socket_fd);
 
-			FD_ZERO(&fdset);
-			if (uart_fd >= 0)
-				FD_SET(uart_fd, &fdset);
-			if (socket_fd >= 0)
-				FD_SET(socket_fd, &fdset);
-			/* Now enter indefinite sleep until input appears */
-			select(MAX(uart_fd, socket_fd) + 1, &fdset, NULL, NULL, NULL);
-			/* In case we were wrongly woken up check the event
-			 * count again */
+	while(1) {
+		nevents = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+		if (nevents < 0) {
+			if (errno != EINTR)
+				ALOGE("epoll_wait failed\n");
 			continue;
 		}
 
-		if (uart_fd >= 0 && FD_ISSET(uart_fd, &fdset)) {
-			// This is touch data from the uart
-			nbytes = read(uart_fd, recv_buf, RECV_BUF_SIZE);
+		for (i=0; i<nevents; i++) {
+			fd = events[i].data.fd;
 
-			if(nbytes <= 0)
-				continue;
+			if (fd == timer_fd) {
+				// A frame re-armed the timer since it expired
+				if (read(timer_fd, &expirations, sizeof(expirations)) !=
+					sizeof(expirations))
+					continue;
 #if DEBUG
-			ALOGD("Received %d bytes\n", nbytes);
-			int i;
-			for(i=0; i < nbytes; i++)
-				ALOGD("%2.2X ",recv_buf[i]);
-			ALOGD("\n");
-#endif
-			if (!snarf2(recv_buf,nbytes)) {
-				// Sometimes there's data but no valid touches due to threshold
-				if (need_liftoff) {
-#if EVENT_DEBUG
-					ALOGD("snarf2 called liftoff\n");
+				ALOGE("timeout! no frames coming from uart\n");
 #endif
-					liftoff();
-					clear_arrays();
-					need_liftoff = 0;
-				}
-			} else
-				need_liftoff = 1;
-		}
-
-		if (socket_fd >= 0 && FD_ISSET(socket_fd, &fdset)) {
-			// This is data from the socket
-			int accept_fd;
-			accept_fd = accept(socket_fd, NULL, NULL);
-			if (accept_fd >= 0) {
-				char recv_str[SOCKET_BUFFER_SIZE];
-				int recv_ret;
-
-				recv_ret = recv(accept_fd, recv_str, SOCKET_BUFFER_SIZE, 0);
-
-                                recv_str[recv_ret]=0; // add string terminator
+				process_uart_timeout();
+#if THREADED_UART
+			} else if (fd == frame_event_fd) {
+				if (process_uart_frame())
+					arm_liftoff_timer(timer_fd);
+#else
+			} else if (fd == uart_fd) {
+				nbytes = read(uart_fd, recv_buf, RECV_BUF_SIZE);
 
-				if (recv_ret > 0) {
-#if DEBUG_SOCKET
-					ALOGD("Socket received %i byte(s): '%s'\n", recv_ret,
-						recv_str);
+				if(nbytes <= 0)
+					continue;
+#if DEBUG
+				ALOGD("Received %d bytes\n", nbytes);
+				int j;
+				for(j=0; j < nbytes; j++)
+					ALOGD("%2.2X ",recv_buf[j]);
+				ALOGD("\n");
 #endif
-					process_socket_buffer(recv_str, recv_ret,
-						&uart_fd, accept_fd);
-				}
-				else {
-					if (recv_ret < 0)
-						ALOGE("Receive error\n");
-					else
-						ALOGD("No actual data to receive\n");
-				}
-				close(accept_fd);
+				if (process_uart_data(recv_buf, nbytes, monotonic_us()))
+					arm_liftoff_timer(timer_fd);
+#endif
+			} else if (fd == power_fd) {
+				touchscreen_power_step();
+#if VSYNC_RESAMPLE
+			} else if (fd == resample_timer_fd) {
+				if (read(resample_timer_fd, &expirations,
+					sizeof(expirations)) != sizeof(expirations))
+					continue; // A frame re-armed it since it expired
+				process_vsync(monotonic_us());
+#endif
+			} else if (fd == socket_fd) {
+				accept_socket_client(epoll_fd, socket_fd);
 			} else {
-				ALOGE("Accept failed\n");
+#if THREADED_UART
+				process_socket_client(fd, &uart_fd);
+#else
+				old_uart_fd = uart_fd;
+				process_socket_client(fd, &uart_fd);
+				if (uart_fd != old_uart_fd) {
+					// The uart was opened or closed, the rest of the
+					// events may be for an fd that is gone now.  Any that
+					// are still pending will show up again.
+					if (uart_fd >= 0)
+						epoll_add(epoll_fd, uart_fd);
+					break;
+				}
+#endif
 			}
 		}
 	}
 
 	return 0;
 }
+#endif // !TS_REPLAY
@@ -29,6 +29,13 @@
  * F = Finger
  * S = Stylus
  * M = return current Mode
+ * T = print driver sTatistics
+ * H = print the newest frame from the Heatmap ring
+ * P [profile] = list the Profiles or print the settings of one
+ * W profile setting value = Write a setting to a profile
+ * U profile = Use a profile
+ * V time period = tell the driver when a Vsync happened and the time between
+ *   vsyncs, in microseconds of CLOCK_MONOTONIC
  */
 
 #define LOG_TAG "ts_srv_set"
@@ -36,101 +43,250 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <unistd.h>
 
 #include "digitizer.h"
+#include "ts_socket.h"
+#include "ts_heatmap.h"
 
-#define TS_SOCKET_LOCATION "/dev/socket/tsdriver"
 #define TS_SOCKET_TIMEOUT 500000
-#define SOCKET_BUFFER_SIZE 1
+#define TS_REQUEST_ID 1
 
-int receive_ts_mode(int ts_fd) {
-	// Receives the mode from touchscreen socket
+int receive_ts_reply(int ts_fd, unsigned char *reply, int *reply_fd) {
+	// Receives the reply to our request from the touchscreen socket along
+	// with any fd that came with it.  Returns the status of the reply or a
+	// negative error.
 	struct timeval seltmout;
 	fd_set fdset;
-	int sel_ret, recv_ret;
-	char recv_str[SOCKET_BUFFER_SIZE];
-
-	seltmout.tv_sec = 0;
-	seltmout.tv_usec = TS_SOCKET_TIMEOUT;
-	FD_ZERO(&fdset);
-	FD_SET(ts_fd, &fdset);
-	sel_ret = select(ts_fd + 1, &fdset, NULL, NULL, &seltmout);
-	if (sel_ret == 0) {
-		ALOGE("Unable to retrieve current mode - timeout\n");
-		return -40;
-	} else {
-		recv_ret = recv(ts_fd, recv_str, SOCKET_BUFFER_SIZE, 0);
-		if (recv_ret > 0) {
-			if ((int)recv_str[0] == 0)
-				printf("Finger mode\n");
-			else if ((int)recv_str[0] == 1)
-				printf("Stylus mode\n");
-			else {
-				ALOGI("Unknown mode '%i'\n", (int)recv_str[0]);
-				return -60;
-			}
-			return 0;
-		} else {
-			ALOGE("Error receiving mode\n");
+	struct ts_msg *ack = (struct ts_msg *)reply;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int sel_ret, recv_ret, len = 0;
+
+	*reply_fd = -1;
+
+	while (len < (int)sizeof(*ack) || len < (int)sizeof(*ack) + ack->len) {
+		seltmout.tv_sec = 0;
+		seltmout.tv_usec = TS_SOCKET_TIMEOUT;
+		FD_ZERO(&fdset);
+		FD_SET(ts_fd, &fdset);
+		sel_ret = select(ts_fd + 1, &fdset, NULL, NULL, &seltmout);
+		if (sel_ret == 0) {
+			ALOGE("No reply from touchscreen - timeout\n");
+			return -40;
+		}
+		iov.iov_base = reply + len;
+		iov.iov_len = sizeof(*ack) + TS_MSG_MAX_PAYLOAD - len;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		recv_ret = recvmsg(ts_fd, &msg, 0);
+		if (recv_ret <= 0) {
+			ALOGE("Error receiving reply\n");
 			return -50;
 		}
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(reply_fd, CMSG_DATA(cmsg), sizeof(int));
+		len += recv_ret;
+		if (len >= (int)sizeof(*ack) && (ack->magic != TS_MSG_MAGIC ||
+			ack->id != TS_REQUEST_ID || ack->len > TS_MSG_MAX_PAYLOAD)) {
+			ALOGE("Bad reply from touchscreen\n");
+			return -60;
+		}
+	}
+	return ack->status;
+}
+
+int print_heatmap(int heatmap_fd) {
+	// Prints the newest frame in the heatmap ring
+	struct ts_heatmap *heatmap;
+	struct ts_heatmap_frame frame;
+	unsigned int n, i, j;
+
+	heatmap = mmap(NULL, sizeof(*heatmap), PROT_READ, MAP_SHARED,
+		heatmap_fd, 0);
+	close(heatmap_fd);
+	if (heatmap == MAP_FAILED) {
+		ALOGE("Unable to map heatmap\n");
+		return -80;
+	}
+	if (heatmap->magic != TS_HEATMAP_MAGIC ||
+		heatmap->version != TS_HEATMAP_VERSION ||
+		heatmap->size != sizeof(*heatmap)) {
+		ALOGE("Heatmap is not a version this tool understands\n");
+		munmap(heatmap, sizeof(*heatmap));
+		return -80;
+	}
+	if (!heatmap->head) {
+		// The ring was only just created, give ts_srv a frame
+		usleep(TS_SOCKET_TIMEOUT);
+		if (!heatmap->head) {
+			printf("No frames yet\n");
+			munmap(heatmap, sizeof(*heatmap));
+			return 0;
+		}
 	}
+
+	// Retry if ts_srv lapped us while the frame was copied
+	do {
+		n = heatmap->head - 1;
+		memcpy(&frame, &heatmap->frame[n % heatmap->frames], sizeof(frame));
+		__sync_synchronize();
+	} while (frame.seq != 2 * n + 2 ||
+		heatmap->frame[n % heatmap->frames].seq != frame.seq);
+	munmap(heatmap, sizeof(*heatmap));
+
+	printf("frame %u at %u.%09u, %u touch(es)\n", n, frame.tv_sec,
+		frame.tv_nsec, frame.touch_count);
+	for (i = 0; i < frame.touch_count && i < TS_HEATMAP_TOUCHES; i++)
+		printf("id %i x %i y %i pressure %i major %i peak %i delay %ims\n",
+			frame.touches[i].tracking_id, frame.touches[i].x,
+			frame.touches[i].y, frame.touches[i].pressure,
+			frame.touches[i].touch_major, frame.touches[i].peak,
+			frame.touches[i].delay);
+	for (i = 0; i < TS_HEATMAP_ROWS; i++) {
+		for (j = 0; j < TS_HEATMAP_COLS; j++)
+			printf("%3u", frame.matrix[i][j]);
+		printf("\n");
+	}
+	return 0;
 }
 
-int send_ts_socket(char *send_data) {
+int send_ts_socket(char cmd, const char *payload) {
 	// Connects to the touchscreen socket
 	struct sockaddr_un unaddr;
-	int ts_fd, len;
+	unsigned char reply[sizeof(struct ts_msg) + TS_MSG_MAX_PAYLOAD + 1];
+	unsigned char request[sizeof(struct ts_msg) + TS_MSG_MAX_PAYLOAD];
+	struct ts_msg *req = (struct ts_msg *)request;
+	struct ts_msg *ack = (struct ts_msg *)reply;
+	char *data = (char *)reply + sizeof(*ack);
+	int ts_fd, len, ret, reply_fd;
 
 	ts_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (ts_fd < 0) {
+		ALOGE("Unable to create socket\n");
+		return -10;
+	}
 
-	if (ts_fd >= 0) {
-		unaddr.sun_family = AF_UNIX;
-		strcpy(unaddr.sun_path, TS_SOCKET_LOCATION);
-		len = strlen(unaddr.sun_path) + sizeof(unaddr.sun_family);
-		if (connect(ts_fd, (struct sockaddr *)&unaddr, len) >= 0) {
-			int send_ret;
-			send_ret = send(ts_fd, send_data, sizeof(*send_data), 0);
-			if (send_ret <= 0) {
-				ALOGE("Unable to send data to socket\n");
-				return -30;
-			} else {
-				if ((strcmp(send_data, "F") == 0)) {
-					ALOGI("Touchscreen set for finger mode\n");
-					return 0;
-				} else if ((strcmp(send_data, "S") == 0)) {
-					ALOGI("Touchscreen set for stylus mode\n");
-					return 0;
-				} else {
-					// Get the current mode
-					return receive_ts_mode(ts_fd);
-				}
-			}
-		} else {
-			ALOGE("Unable to connect socket\n");
-			return -20;
-		}
+	unaddr.sun_family = AF_UNIX;
+	strcpy(unaddr.sun_path, TS_SOCKET_LOCATION);
+	len = strlen(unaddr.sun_path) + sizeof(unaddr.sun_family);
+	if (connect(ts_fd, (struct sockaddr *)&unaddr, len) < 0) {
+		ALOGE("Unable to connect socket\n");
 		close(ts_fd);
+		return -20;
+	}
+
+	memset(req, 0, sizeof(*req));
+	req->magic = TS_MSG_MAGIC;
+	req->cmd = cmd;
+	req->id = TS_REQUEST_ID;
+	req->len = strlen(payload);
+	memcpy(request + sizeof(*req), payload, req->len);
+	len = sizeof(*req) + req->len;
+	if (send(ts_fd, request, len, 0) != len) {
+		ALOGE("Unable to send data to socket\n");
+		close(ts_fd);
+		return -30;
+	}
+
+	ret = receive_ts_reply(ts_fd, reply, &reply_fd);
+	close(ts_fd);
+	if (ret == TS_MSG_OK && req->cmd == TS_CMD_HEATMAP) {
+		if (reply_fd < 0) {
+			ALOGE("No heatmap in reply\n");
+			return -80;
+		}
+		return print_heatmap(reply_fd);
+	}
+	if (reply_fd >= 0)
+		close(reply_fd);
+	if (ret != TS_MSG_OK) {
+		if (ret > 0)
+			ALOGE("Touchscreen refused '%c' with status %i\n",
+				req->cmd, ret);
+		return ret > 0 ? -70 - ret : ret;
+	}
+
+	if (req->cmd == TS_CMD_FINGER) {
+		ALOGI("Touchscreen set for finger mode\n");
+	} else if (req->cmd == TS_CMD_STYLUS) {
+		ALOGI("Touchscreen set for stylus mode\n");
+	} else if (req->cmd == TS_CMD_STATS || req->cmd == TS_CMD_PROFILES) {
+		data[ack->len] = 0;
+		printf("%s", data);
+	} else if (req->cmd == TS_CMD_WRITE_PARAM) {
+		ALOGI("Touchscreen setting written\n");
+	} else if (req->cmd == TS_CMD_USE_PROFILE) {
+		ALOGI("Touchscreen profile %s in use\n", payload);
+	} else if (req->cmd == TS_CMD_VSYNC) {
+		ALOGI("Touchscreen vsync set to %s\n", payload);
+	} else if (ack->len >= 1 && data[0] == 0) {
+		printf("Finger mode\n");
+	} else if (ack->len >= 1 && data[0] == 1) {
+		printf("Stylus mode\n");
 	} else {
-		ALOGE("Unable to create socket\n");
-		return -10;
+		ALOGI("Unknown mode '%i'\n", ack->len ? (int)data[0] : -1);
+		return -60;
 	}
+	return 0;
 }
 
 int main(int argc, char** argv)
 {
-	if (argc != 2 || strlen(argv[1]) != 1 ||
-		(strcmp(argv[1], "F") != 0 && strcmp(argv[1], "S") != 0 &&
-		strcmp(argv[1], "M") != 0)) {
-		printf("Please supply exactly 1 argument:\n");
-		printf("F to set finger mode\n");
-		printf("S to set stylus mode\n");
-		printf("M to display the current setting\n");
-		printf("This is used to set the mode of operation for the\n");
-		printf("touchscreen driver on the TouchPad\n");
-		return -1;
-	} else
-		return send_ts_socket(argv[1]);
+	char payload[TS_MSG_MAX_PAYLOAD];
+	int i, len = 0;
+
+	if (argc >= 2 && strlen(argv[1]) == 1) {
+		switch (argv[1][0]) {
+			case 'F':
+			case 'S':
+			case 'M':
+			case 'T':
+			case 'H':
+				if (argc == 2)
+					return send_ts_socket(argv[1][0], "");
+				break;
+			case 'P':
+			case 'W':
+			case 'U':
+			case 'V':
+				if ((argv[1][0] == 'P' && argc > 3) ||
+					(argv[1][0] == 'W' && argc != 5) ||
+					(argv[1][0] == 'U' && argc != 3) ||
+					(argv[1][0] == 'V' && argc != 4))
+					break;
+				// The rest of the arguments are sent as text
+				payload[0] = 0;
+				for (i = 2; i < argc; i++)
+					len += snprintf(payload + len,
+						sizeof(payload) - len, "%s%s",
+						i > 2 ? " " : "", argv[i]);
+				if (len >= (int)sizeof(payload))
+					break;
+				return send_ts_socket(argv[1][0], payload);
+		}
+	}
+	printf("Please supply one of:\n");
+	printf("F to set finger mode\n");
+	printf("S to set stylus mode\n");
+	printf("M to display the current setting\n");
+	printf("T to display driver statistics\n");
+	printf("H to display the newest frame and its touches\n");
+	printf("P to list the profiles, P profile to display its settings\n");
+	printf("W profile setting value to change a setting\n");
+	printf("U profile to use a profile\n");
+	printf("V time period to resample touches to vsyncs\n");
+	printf("This is used to set the mode of operation for the\n");
+	printf("touchscreen driver on the TouchPad\n");
+	return -1;
 }
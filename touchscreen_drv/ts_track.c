@@ -0,0 +1,193 @@
+/*
+ * Matching touches to the touches of the previous frame, shared by ts_srv
+ * and the levmar variant of it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+
+#include <limits.h>
+#include <stddef.h>
+
+#include "ts_track.h"
+
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+
+// Larger than any possible sum of squared distances between touches
+#define UNMATCHED_COST (1LL << 40)
+#define CLOSEST_MAX_DISTANCE 1000000
+
+static int point_distance(const struct ts_track_point *a,
+	const struct ts_track_point *b)
+{
+	int deltax = a->x - b->x, deltay = a->y - b->y;
+
+	return (deltax * deltax) + (deltay * deltay);
+}
+
+void ts_match_closest(const struct ts_track_point *cur, int count,
+	const struct ts_track_point *prev, int prev_count, int *match_loc,
+	int *match_distance)
+{
+	int i, j, cur_distance;
+
+	// Find closest points for each touch
+	for (i=0; i<count; i++) {
+		match_distance[i] = CLOSEST_MAX_DISTANCE;
+		match_loc[i] = -1;
+		for (j=0; j<prev_count; j++) {
+			if (prev[j].valid) {
+				cur_distance = point_distance(&cur[i], &prev[j]);
+				if(cur_distance < match_distance[i]) {
+					match_distance[i] = cur_distance;
+					match_loc[i] = j;
+				}
+			}
+		}
+	}
+
+	// Remove mapping for touches which aren't closest
+	for (i=0; i<count; i++) {
+		for (j=i + 1; j<count; j++) {
+			if (match_loc[i] > -1 && match_loc[i] == match_loc[j]) {
+				if (match_distance[i] < match_distance[j])
+					match_loc[j] = -1;
+				else
+					match_loc[i] = -1;
+			}
+		}
+	}
+}
+
+void ts_match_optimal(const struct ts_track_point *cur, int count,
+	const struct ts_track_point *prev, int prev_count, int *match_loc,
+	int *match_distance, ts_match_allowed_fn allowed, void *data)
+{
+	// This is the Hungarian algorithm on a square cost matrix padded out
+	// with dummy touches, so it is O(TS_MAX_TOUCH^3) at worst.  Pairs that
+	// aren't allowed cost more than any set of real matches.
+	long long cost[TS_MAX_TOUCH + 1][TS_MAX_TOUCH + 1];
+	long long u[TS_MAX_TOUCH + 1], v[TS_MAX_TOUCH + 1];
+	long long minv[TS_MAX_TOUCH + 1];
+	long long cur_cost, delta;
+	int p[TS_MAX_TOUCH + 1], way[TS_MAX_TOUCH + 1], used[TS_MAX_TOUCH + 1];
+	int distance[TS_MAX_TOUCH][TS_MAX_TOUCH];
+	int n = MAX(count, prev_count);
+	int i, j, i0, j0, j1;
+
+	for (i=0; i<count; i++)
+		match_loc[i] = -1;
+
+	// Rows and columns are 1 based, row i is touch i - 1 and column j is
+	// previous touch j - 1.
+	for (i=1; i<=n; i++) {
+		for (j=1; j<=n; j++) {
+			cost[i][j] = 0;
+			if (i > count || j > prev_count)
+				continue; // Dummy touch
+			cost[i][j] = UNMATCHED_COST;
+			if (!prev[j - 1].valid)
+				continue;
+			distance[i - 1][j - 1] = point_distance(&cur[i - 1],
+				&prev[j - 1]);
+			if (allowed != NULL && !allowed(i - 1, j - 1,
+				distance[i - 1][j - 1], data))
+				continue;
+			cost[i][j] = distance[i - 1][j - 1];
+		}
+	}
+
+	for (j=0; j<=n; j++) {
+		u[j] = 0;
+		v[j] = 0;
+		p[j] = 0;
+	}
+	for (i=1; i<=n; i++) {
+		// Add row i, following the shortest augmenting path to a free column
+		p[0] = i;
+		j0 = 0;
+		for (j=0; j<=n; j++) {
+			minv[j] = LLONG_MAX;
+			used[j] = 0;
+		}
+		do {
+			used[j0] = 1;
+			i0 = p[j0];
+			delta = LLONG_MAX;
+			j1 = 0;
+			for (j=1; j<=n; j++) {
+				if (used[j])
+					continue;
+				cur_cost = cost[i0][j] - u[i0] - v[j];
+				if (cur_cost < minv[j]) {
+					minv[j] = cur_cost;
+					way[j] = j0;
+				}
+				if (minv[j] < delta) {
+					delta = minv[j];
+					j1 = j;
+				}
+			}
+			for (j=0; j<=n; j++) {
+				if (used[j]) {
+					u[p[j]] += delta;
+					v[j] -= delta;
+				} else
+					minv[j] -= delta;
+			}
+			j0 = j1;
+		} while (p[j0]);
+		do {
+			j1 = way[j0];
+			p[j0] = p[j1];
+			j0 = j1;
+		} while (j0);
+	}
+
+	for (j=1; j<=n; j++) {
+		i = p[j];
+		if (i <= count && j <= prev_count &&
+			cost[i][j] < UNMATCHED_COST) {
+			match_loc[i - 1] = j - 1;
+			match_distance[i - 1] = distance[i - 1][j - 1];
+		}
+	}
+}
+
+static int within_distance(int cur, int prev, int distance, void *data)
+{
+	(void)cur;
+	(void)prev;
+	return distance < *(int *)data;
+}
+
+int ts_track_ids(const struct ts_track_point *cur, int count,
+	const struct ts_track_point *prev, int prev_count, const int *prev_ids,
+	int *ids, int next_id, int max_distance)
+{
+	int match_loc[TS_MAX_TOUCH], match_distance[TS_MAX_TOUCH];
+	int max_sq = max_distance * max_distance, i;
+
+	ts_match_optimal(cur, count, prev, prev_count, match_loc,
+		match_distance, within_distance, &max_sq);
+	for (i = 0; i < count; i++)
+		ids[i] = match_loc[i] < 0 ? next_id++ : prev_ids[match_loc[i]];
+	return next_id;
+}
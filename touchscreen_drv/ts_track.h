@@ -0,0 +1,60 @@
+/*
+ * Matching touches to the touches of the previous frame, shared by ts_srv
+ * and the levmar variant of it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+
+#define TS_MAX_TOUCH 10
+
+// Where a touch is in any units, distances are squared in the same units.
+// A previous touch that isn't valid is never matched.
+struct ts_track_point {
+	int x;
+	int y;
+	int valid;
+};
+
+// Returns 0 if touch cur can't be the same finger as previous touch prev
+// even though they are distance apart
+typedef int (*ts_match_allowed_fn)(int cur, int prev, int distance,
+	void *data);
+
+// Matches each touch to the closest previous touch.  If two touches are
+// closest to the same previous touch only the closer one keeps it.
+// match_loc is -1 for a touch without a match.
+void ts_match_closest(const struct ts_track_point *cur, int count,
+	const struct ts_track_point *prev, int prev_count, int *match_loc,
+	int *match_distance);
+
+// Matches touches to previous touches so that as many touches as possible
+// are matched and the total squared distance moved is as small as possible.
+// allowed can be NULL.
+void ts_match_optimal(const struct ts_track_point *cur, int count,
+	const struct ts_track_point *prev, int prev_count, int *match_loc,
+	int *match_distance, ts_match_allowed_fn allowed, void *data);
+
+// Gives each touch the tracking ID of its optimal match among the previous
+// touches if it is less than max_distance squared away, or next_id counting
+// up.  Returns the next unused ID.
+int ts_track_ids(const struct ts_track_point *cur, int count,
+	const struct ts_track_point *prev, int prev_count, const int *prev_ids,
+	int *ids, int next_id, int max_distance);